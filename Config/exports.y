@@ -6,6 +6,8 @@
  */
 #include "config.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <rpc/rpc.h>
 #include <limits.h>
 
@@ -26,6 +28,7 @@
 #include "mount.h"
 #include "daemon.h"
 #include "backend.h"
+#include "context.h"
 #include "exports.h"
 
 #ifndef PATH_MAX
@@ -74,10 +77,6 @@ static e_item *e_list = NULL;
 static e_item cur_item;
 static e_host cur_host;
 
-/* last looked-up anonuid and anongid */
-static uint32 last_anonuid = ANON_NOTSPECIAL;
-static uint32 last_anongid = ANON_NOTSPECIAL;
-
 /* mount protocol compatible variants */
 static exports ne_list = NULL;
 static struct exportnode ne_item;
@@ -694,33 +693,28 @@ static e_host* find_host(struct in_addr remote, e_item *item,
 	return NULL;
 }
 
-/* options cache */
-int exports_opts = -1;
-const char *export_path = NULL; 
-uint32 export_fsid = 0;
-uint32 export_password_hash = 0;
-
 /*
  * given a path, return client's effective options
+ * the options are also cached in the request context
  */
-int exports_options(const char *path, struct svc_req *rqstp,
+int exports_options(const char *path, unfs3_ctx_t *ctx,
 		    char **password, uint32 *fsid)
 {
 	e_item *list;
 	struct in_addr remote;
 	unsigned int last_len = 0;
 	
-	exports_opts = -1;
-	export_path = NULL;
-	export_fsid = 0;
-	last_anonuid = ANON_NOTSPECIAL;
-	last_anongid = ANON_NOTSPECIAL;
+	ctx->opts = -1;
+	ctx->export_path = NULL;
+	ctx->export_fsid = 0;
+	ctx->anonuid = ANON_NOTSPECIAL;
+	ctx->anongid = ANON_NOTSPECIAL;
 
 	/* check for client attempting to use invalid pathname */
 	if (!path || strstr(path, "/../"))
-		return exports_opts;
+		return ctx->opts;
 	
-	remote = get_remote(rqstp);
+	remote = get_remote(ctx->rqstp);
 
 	/* protect against SIGHUP reloading the list */
 	exports_access = TRUE;
@@ -734,23 +728,23 @@ int exports_options(const char *path, struct svc_req *rqstp,
 #else
 		    !win_utf8ncasecmp(path, list->path, strlen(list->path))) {
 #endif
-		    e_host* cur_host = find_host(remote, list, password, &export_password_hash);
+		    e_host* cur_host = find_host(remote, list, password, &ctx->pwhash);
 
 			if (fsid != NULL)
 				*fsid = list->fsid;
 			if (cur_host) {
-				exports_opts = cur_host->options;
-				export_path = list->path;
-				export_fsid = list->fsid;
+				ctx->opts = cur_host->options;
+				ctx->export_path = list->path;
+				ctx->export_fsid = list->fsid;
 				last_len = strlen(list->path);
-				last_anonuid = cur_host->anonuid;
-				last_anongid = cur_host->anongid;
+				ctx->anonuid = cur_host->anonuid;
+				ctx->anongid = cur_host->anongid;
 			}
 		}
 		list = (e_item *) list->next;
 	}
 	exports_access = FALSE;
-	return exports_opts;
+	return ctx->opts;
 }
 
 /*
@@ -803,20 +797,20 @@ char *export_point_from_fsid(uint32 fsid, time_t **last_mtime, uint32 **dir_hash
 /*
  * check whether export options of a path match with last set of options
  */
-nfsstat3 exports_compat(const char *path, struct svc_req *rqstp)
+nfsstat3 exports_compat(const char *path, unfs3_ctx_t *ctx)
 {
 	int prev;
 	uint32 prev_anonuid, prev_anongid;
 	
-	prev = exports_opts;
-	prev_anonuid = last_anonuid;
-	prev_anongid = last_anongid;
+	prev = ctx->opts;
+	prev_anonuid = ctx->anonuid;
+	prev_anongid = ctx->anongid;
 	
-	if (exports_options(path, rqstp, NULL, NULL) == prev &&
-	    last_anonuid == prev_anonuid &&
-	    last_anongid == prev_anongid)
+	if (exports_options(path, ctx, NULL, NULL) == prev &&
+	    ctx->anonuid == prev_anonuid &&
+	    ctx->anongid == prev_anongid)
 		return NFS3_OK;
-	else if (exports_opts == -1)
+	else if (ctx->opts == -1)
 		return NFS3ERR_ACCES;
 	else
 		return NFS3ERR_XDEV;
@@ -825,9 +819,9 @@ nfsstat3 exports_compat(const char *path, struct svc_req *rqstp)
 /*
  * check whether options indicate rw mount
  */
-nfsstat3 exports_rw(void)
+nfsstat3 exports_rw(unfs3_ctx_t *ctx)
 {
-	if (exports_opts != -1 && (exports_opts & OPT_RW))
+	if (ctx->opts != -1 && (ctx->opts & OPT_RW))
 		return NFS3_OK;
 	else
 		return NFS3ERR_ROFS;
@@ -836,15 +830,15 @@ nfsstat3 exports_rw(void)
 /*
  * returns the last looked-up anonuid for a mount (ANON_NOTSPECIAL means none in effect)
  */
-uint32 exports_anonuid(void)
+uint32 exports_anonuid(unfs3_ctx_t *ctx)
 {
-	return last_anonuid;
+	return ctx->anonuid;
 }
 
 /*
  * returns the last looked-up anongid for a mount (ANON_NOTSPECIAL means none in effect)
  */
-uint32 exports_anongid(void)
+uint32 exports_anongid(unfs3_ctx_t *ctx)
 {
-	return last_anongid;
+	return ctx->anongid;
 }
@@ -26,6 +26,8 @@
 #include "fh_cache.h"
 #include "daemon.h"
 #include "user.h"
+#include "context.h"
+#include "fd_cache.h"
 #include "Config/exports.h"
 
 /*
@@ -33,11 +35,11 @@
  *
  * fh_decomp must be called before to fill the stat cache
  */
-nfsstat3 is_reg(void)
+nfsstat3 is_reg(unfs3_ctx_t * ctx)
 {
-    if (!st_cache_valid)
+    if (!ctx->st_valid)
 	return NFS3ERR_STALE;
-    else if (S_ISREG(st_cache.st_mode))
+    else if (S_ISREG(ctx->st.st_mode))
 	return NFS3_OK;
     else
 	return NFS3ERR_INVAL;
@@ -78,26 +80,43 @@ static post_op_attr error_attr = {.attributes_follow = FALSE };
 static post_op_attr error_attr = { FALSE };
 #endif
 
+/*
+ * size of an object as clients know it
+ * WRITEs kept behind the fd cache count, although not in the file yet
+ */
+static uint64 file_size(backend_statstruct buf)
+{
+    uint64 end;
+
+    if (S_ISREG(buf.st_mode)) {
+	end = fd_behind_end(buf.st_dev, buf.st_ino);
+	if (end > (uint64) buf.st_size)
+	    return end;
+    }
+
+    return buf.st_size;
+}
+
 /*
  * return pre-operation attributes
  *
  * fh_decomp must be called before to fill the stat cache
  */
-pre_op_attr get_pre_cached(void)
+pre_op_attr get_pre_cached(unfs3_ctx_t * ctx)
 {
     pre_op_attr result;
 
-    if (!st_cache_valid) {
+    if (!ctx->st_valid) {
 	result.attributes_follow = FALSE;
 	return result;
     }
 
     result.attributes_follow = TRUE;
 
-    result.pre_op_attr_u.attributes.size = st_cache.st_size;
-    result.pre_op_attr_u.attributes.mtime.seconds = st_cache.st_mtime;
+    result.pre_op_attr_u.attributes.size = file_size(ctx->st);
+    result.pre_op_attr_u.attributes.mtime.seconds = ctx->st.st_mtime;
     result.pre_op_attr_u.attributes.mtime.nseconds = 0;
-    result.pre_op_attr_u.attributes.ctime.seconds = st_cache.st_ctime;
+    result.pre_op_attr_u.attributes.ctime.seconds = ctx->st.st_ctime;
     result.pre_op_attr_u.attributes.ctime.nseconds = 0;
 
     return result;
@@ -106,7 +125,7 @@ pre_op_attr get_pre_cached(void)
 /*
  * compute post-operation attributes given a stat buffer
  */
-post_op_attr get_post_buf(backend_statstruct buf, struct svc_req * req)
+post_op_attr get_post_buf(backend_statstruct buf, unfs3_ctx_t * ctx)
 {
     post_op_attr result;
 
@@ -148,10 +167,11 @@ post_op_attr get_post_buf(backend_statstruct buf, struct svc_req * req)
     if (opt_singleuser) {
 	unsigned int req_uid = 0;
 	unsigned int req_gid = 0;
-	struct authunix_parms *auth = (struct authunix_parms *) req->rq_clntcred;
+	struct authunix_parms *auth =
+	    (struct authunix_parms *) ctx->rqstp->rq_clntcred;
 	uid_t ruid = backend_getuid();
 
-	if (req->rq_cred.oa_flavor == AUTH_UNIX) {
+	if (ctx->rqstp->rq_cred.oa_flavor == AUTH_UNIX) {
 	    req_uid = auth->aup_uid;
 	    req_gid = auth->aup_gid;
 	}
@@ -171,7 +191,7 @@ post_op_attr get_post_buf(backend_statstruct buf, struct svc_req * req)
 	result.post_op_attr_u.attributes.gid = buf.st_gid;
     }
 
-    result.post_op_attr_u.attributes.size = buf.st_size;
+    result.post_op_attr_u.attributes.size = file_size(buf);
     result.post_op_attr_u.attributes.used = buf.st_blocks * 512;
     result.post_op_attr_u.attributes.rdev.specdata1 =
 	(buf.st_rdev >> 8) & 0xFF;
@@ -181,12 +201,12 @@ post_op_attr get_post_buf(backend_statstruct buf, struct svc_req * req)
     /* If this is a removable export point, we should return the preset fsid
        for all objects which resides in the same file system as the exported
        directory */
-    if (exports_opts & OPT_REMOVABLE) {
+    if (ctx->opts & OPT_REMOVABLE) {
 	backend_statstruct epbuf;
 
-	if (backend_lstat(export_path, &epbuf) != -1 &&
+	if (backend_lstat(ctx->export_path, &epbuf) != -1 &&
 	    buf.st_dev == epbuf.st_dev) {
-	    result.post_op_attr_u.attributes.fsid = export_fsid;
+	    result.post_op_attr_u.attributes.fsid = ctx->export_fsid;
 	}
     }
 
@@ -221,7 +241,7 @@ post_op_attr get_post_buf(backend_statstruct buf, struct svc_req * req)
  * lowlevel routine for getting post-operation attributes
  */
 static post_op_attr get_post_ll(const char *path, uint32 dev, uint64 ino,
-				struct svc_req *req)
+				unfs3_ctx_t * ctx)
 {
     backend_statstruct buf;
     int res;
@@ -237,26 +257,26 @@ static post_op_attr get_post_ll(const char *path, uint32 dev, uint64 ino,
     if (dev != buf.st_dev || ino != buf.st_ino)
 	return error_attr;
 
-    return get_post_buf(buf, req);
+    return get_post_buf(buf, ctx);
 }
 
 /*
  * return post-operation attributes, using fh for old dev/ino
  */
 post_op_attr get_post_attr(const char *path, nfs_fh3 nfh,
-			   struct svc_req * req)
+			   unfs3_ctx_t * ctx)
 {
     unfs3_fh_t fh = fh_decode(&nfh);
 
-    return get_post_ll(path, fh.dev, fh.ino, req);
+    return get_post_ll(path, fh.dev, fh.ino, ctx);
 }
 
 /*
  * return post-operation attributes, using stat cache for old dev/ino
  */
-post_op_attr get_post_stat(const char *path, struct svc_req * req)
+post_op_attr get_post_stat(const char *path, unfs3_ctx_t * ctx)
 {
-    return get_post_ll(path, st_cache.st_dev, st_cache.st_ino, req);
+    return get_post_ll(path, ctx->st.st_dev, ctx->st.st_ino, ctx);
 }
 
 /*
@@ -264,12 +284,38 @@ post_op_attr get_post_stat(const char *path, struct svc_req * req)
  *
  * fd_decomp must be called before to fill the stat cache
  */
-post_op_attr get_post_cached(struct svc_req * req)
+post_op_attr get_post_cached(unfs3_ctx_t * ctx)
 {
-    if (!st_cache_valid)
+    if (!ctx->st_valid)
 	return error_attr;
 
-    return get_post_buf(st_cache, req);
+    return get_post_buf(ctx->st, ctx);
+}
+
+/*
+ * bring size and times of post-operation attributes up to date,
+ * for replies sent after the request has been run
+ */
+void update_post_attr(post_op_attr * attr, const char *path, uint32 dev,
+		      uint64 ino)
+{
+    backend_statstruct buf;
+    fattr3 *a = &attr->post_op_attr_u.attributes;
+
+    if (!attr->attributes_follow)
+	return;
+
+    if (backend_lstat(path, &buf) == -1 || buf.st_dev != dev ||
+	buf.st_ino != ino) {
+	attr->attributes_follow = FALSE;
+	return;
+    }
+
+    a->size = file_size(buf);
+    a->used = buf.st_blocks * 512;
+    a->atime.seconds = buf.st_atime;
+    a->mtime.seconds = buf.st_mtime;
+    a->ctime.seconds = buf.st_ctime;
 }
 
 /*
@@ -383,6 +429,10 @@ nfsstat3 set_attr(const char *path, nfs_fh3 nfh, sattr3 new)
     if (res != 0)
 	return NFS3ERR_STALE;
 
+    /* kept WRITEs must not land after a truncate */
+    if (new.size.set_it == TRUE)
+	fd_flush_behind(nfh);
+
     /* 
      * don't open(2) device nodes, it could trigger
      * module loading on the server
@@ -487,10 +537,10 @@ mode_t create_mode(sattr3 new)
 /*
  * check whether an sattr3 is settable atomically on a create op
  */
-nfsstat3 atomic_attr(sattr3 attr)
+nfsstat3 atomic_attr(sattr3 attr, unfs3_ctx_t * ctx)
 {
-    uid_t used_uid = mangle_uid(attr.uid.set_uid3_u.uid);
-    gid_t used_gid = mangle_gid(attr.gid.set_gid3_u.gid);
+    uid_t used_uid = mangle_uid(attr.uid.set_uid3_u.uid, ctx);
+    gid_t used_gid = mangle_gid(attr.gid.set_gid3_u.gid, ctx);
 
     if ((attr.uid.set_it == TRUE && used_uid != backend_geteuid()) ||
 	(attr.gid.set_it == TRUE && used_gid != backend_getegid()) ||
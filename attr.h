@@ -7,20 +7,22 @@
 #ifndef NFS_ATTR_H
 #define NFS_ATTR_H
 
-nfsstat3 is_reg(void);
+nfsstat3 is_reg(unfs3_ctx_t *ctx);
 
 mode_t type_to_mode(ftype3 ftype);
 
-post_op_attr get_post_attr(const char *path, nfs_fh3 fh, struct svc_req *req);
-post_op_attr get_post_stat(const char *path, struct svc_req *req);
-post_op_attr get_post_cached(struct svc_req *req);
-post_op_attr get_post_buf(backend_statstruct buf, struct svc_req *req);
-pre_op_attr  get_pre_cached(void);
+post_op_attr get_post_attr(const char *path, nfs_fh3 fh, unfs3_ctx_t *ctx);
+post_op_attr get_post_stat(const char *path, unfs3_ctx_t *ctx);
+post_op_attr get_post_cached(unfs3_ctx_t *ctx);
+post_op_attr get_post_buf(backend_statstruct buf, unfs3_ctx_t *ctx);
+pre_op_attr  get_pre_cached(unfs3_ctx_t *ctx);
+void update_post_attr(post_op_attr *attr, const char *path, uint32 dev,
+		      uint64 ino);
 
 nfsstat3 set_attr(const char *path, nfs_fh3 fh, sattr3 sattr);
 
 mode_t create_mode(sattr3 sattr);
 
-nfsstat3 atomic_attr(sattr3 sattr);
+nfsstat3 atomic_attr(sattr3 sattr, unfs3_ctx_t *ctx);
 
 #endif
@@ -39,6 +39,7 @@
 #define backend_link link
 #define backend_lseek lseek
 #define backend_lstat lstat
+#define backend_lstat_many lstat_many
 #define backend_mkdir mkdir
 #define backend_mkfifo mkfifo
 #define backend_mknod mknod
@@ -81,6 +82,25 @@
 #define backend_lchown chown
 #endif
 
+/*
+ * the libc wrappers change credentials of all threads of a process,
+ * worker threads need credentials of their own; they switch their
+ * effective ids with the raw system calls, which only affect the
+ * calling thread
+ */
+#if defined(__linux__) && HAVE_SYS_SYSCALL_H == 1 && HAVE_PTHREAD_H == 1
+#  define THREAD_CREDENTIALS 1
+#  undef  backend_setegid
+#  define backend_setegid	thread_setegid
+#  undef  backend_seteuid
+#  define backend_seteuid	thread_seteuid
+#  undef  backend_setgroups
+#  define backend_setgroups	thread_setgroups
+int thread_setegid(gid_t egid);
+int thread_seteuid(uid_t euid);
+int thread_setgroups(size_t size, const gid_t *list);
+#endif
+
 #ifdef AFS_SUPPORT
 #  undef  backend_get_gen
 #  define backend_get_gen	afs_get_gen
@@ -41,6 +41,7 @@
 #define backend_link win_link
 #define backend_lseek lseek
 #define backend_lstat win_stat
+#define backend_lstat_many lstat_many
 #define backend_mkdir win_mkdir
 #define backend_mkfifo win_mkfifo
 #define backend_mknod win_mknod
@@ -0,0 +1,69 @@
+/*
+ * UNFS3 request context
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/rpc.h>
+#include <stdlib.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "mount.h"
+#include "context.h"
+#include "daemon.h"
+#include "Config/exports.h"
+
+/* context of the calling thread */
+static THREAD_LOCAL unfs3_ctx_t *thread_ctx = NULL;
+
+/*
+ * return context for the calling thread, allocating it on first use
+ */
+unfs3_ctx_t *ctx_get(void)
+{
+    if (!thread_ctx) {
+	thread_ctx = calloc(1, sizeof(unfs3_ctx_t));
+	if (!thread_ctx)
+	    logmsg(LOG_CRIT, "ctx_get: Unable to allocate memory");
+    }
+
+    return thread_ctx;
+}
+
+/*
+ * reset per-request state before running a procedure
+ */
+void ctx_begin(unfs3_ctx_t * ctx, struct svc_req *rqstp)
+{
+    ctx->rqstp = rqstp;
+    ctx->st_valid = FALSE;
+    ctx->fh_busy = FALSE;
+    ctx->opts = -1;
+    ctx->export_path = NULL;
+    ctx->export_fsid = 0;
+    ctx->pwhash = 0;
+    ctx->anonuid = ANON_NOTSPECIAL;
+    ctx->anongid = ANON_NOTSPECIAL;
+}
+
+/*
+ * return buffer for READ and READLINK data
+ * holds NFS_MAXDATA_TCP + 1 bytes, allocated on first use
+ */
+char *ctx_data(unfs3_ctx_t * ctx)
+{
+    if (!ctx->data) {
+	ctx->data = malloc(NFS_MAXDATA_TCP + 1);
+	if (!ctx->data)
+	    logmsg(LOG_CRIT, "ctx_data: Unable to allocate memory");
+    }
+
+    return ctx->data;
+}
@@ -0,0 +1,80 @@
+/*
+ * UNFS3 request context
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_CONTEXT_H
+#define UNFS3_CONTEXT_H
+
+#include "backend.h"
+#include "mount.h"
+#include "fh.h"
+
+/*
+ * state of the request being served
+ *
+ * everything a procedure hands back to the dispatcher lives here, so
+ * that nothing is shared between requests in flight
+ */
+struct unfs3_ctx {
+	struct svc_req		*rqstp;		/* RPC request */
+	int			drc;		/* duplicate cache entry */
+
+	/* stat cache, filled by filehandle resolution */
+	int			st_valid;
+	backend_statstruct	st;
+	int			fh_busy;	/* still being resolved */
+
+	/* options cache, filled by exports_options */
+	int			opts;
+	const char		*export_path;
+	uint32			export_fsid;
+	uint32			pwhash;
+	uint32			anonuid;
+	uint32			anongid;
+
+	/* paths returned by fh_decomp, RENAME and LINK need two */
+	char			path[2][NFS_MAXPATHLEN];
+	int			path_slot;
+
+	unfs3_fh_t		fh;		/* fh_extend, fh_comp_ptr */
+	char			fhbuf[FH_MAXBUF];	/* encoded result fh */
+	char			*data;		/* READ and READLINK data */
+	entry3			*entries;	/* READDIR entries */
+	char			*names;		/* READDIR names */
+	mountlist		dump;		/* MOUNTPROC_DUMP reply */
+	char			nonce[32];	/* @getnonce reply */
+
+	/* procedure results */
+	union {
+		GETATTR3res	getattr;
+		SETATTR3res	setattr;
+		LOOKUP3res	lookup;
+		ACCESS3res	access;
+		READLINK3res	readlink;
+		READ3res	read;
+		WRITE3res	write;
+		CREATE3res	create;
+		MKDIR3res	mkdir;
+		SYMLINK3res	symlink;
+		MKNOD3res	mknod;
+		REMOVE3res	remove;
+		RMDIR3res	rmdir;
+		RENAME3res	rename;
+		LINK3res	link;
+		READDIR3res	readdir;
+		READDIRPLUS3res	readdirplus;
+		FSSTAT3res	fsstat;
+		FSINFO3res	fsinfo;
+		PATHCONF3res	pathconf;
+		COMMIT3res	commit;
+		mountres3	mnt;
+	} res;
+};
+
+unfs3_ctx_t *ctx_get(void);
+void ctx_begin(unfs3_ctx_t *ctx, struct svc_req *rqstp);
+char *ctx_data(unfs3_ctx_t *ctx);
+
+#endif
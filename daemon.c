@@ -50,6 +50,15 @@
 #include "user.h"
 #include "daemon.h"
 #include "backend.h"
+#include "worker.h"
+#include "event.h"
+#include "tcp.h"
+#include "flush.h"
+#include "drc.h"
+#include "notify.h"
+#include "resolve.h"
+#include "index.h"
+#include "context.h"
 #include "Config/exports.h"
 
 #ifndef SIG_PF
@@ -58,6 +67,12 @@
 
 #define UNFS_NAME "UNFS3 unfsd " PACKAGE_VERSION " (C) 2009, Pascal Schmidt <unfs3-server@ewetel.net>\n"
 
+/* threads resolving filehandles missing from the cache */
+#define RESOLVE_THREADS 4
+
+/* milliseconds between saves of the filehandle cache */
+#define SNAPSHOT_INTERVAL 300000
+
 /* write verifier */
 writeverf3 wverf;
 
@@ -78,6 +93,16 @@ int opt_testconfig = FALSE;
 struct in_addr opt_bind_addr;
 int opt_readable_executables = FALSE;
 char *opt_pid_file = NULL;
+int opt_threads = 1;
+int opt_listeners = 1;
+int opt_flushers = 2;
+int opt_fd_entries = FD_ENTRIES;
+int opt_fh_entries = FH_ENTRIES;
+int opt_notify = FALSE;
+int opt_kernel_fh = FALSE;
+char *opt_snapshot = NULL;
+char *opt_index = NULL;
+int opt_prewarm = 0;
 
 /* Register with portmapper? */
 int opt_portmapper = TRUE;
@@ -124,6 +149,18 @@ short get_port(struct svc_req *rqstp)
     return (svc_getcaller(rqstp->rq_xprt))->sin_port;
 }
 
+/*
+ * return the socket of a transport
+ */
+static int get_transport_socket(SVCXPRT * transp)
+{
+#if HAVE_STRUCT___RPC_SVCXPRT_XP_FD == 1
+    return transp->xp_fd;
+#else
+    return transp->xp_sock;
+#endif
+}
+
 /*
  * return the socket type of the request (SOCK_STREAM or SOCK_DGRAM)
  */
@@ -134,11 +171,8 @@ int get_socket_type(struct svc_req *rqstp)
 
     l = sizeof(v);
 
-#if HAVE_STRUCT___RPC_SVCXPRT_XP_FD == 1
-    res = getsockopt(rqstp->rq_xprt->xp_fd, SOL_SOCKET, SO_TYPE, &v, &l);
-#else
-    res = getsockopt(rqstp->rq_xprt->xp_sock, SOL_SOCKET, SO_TYPE, &v, &l);
-#endif
+    res = getsockopt(get_transport_socket(rqstp->rq_xprt), SOL_SOCKET,
+		     SO_TYPE, &v, &l);
 
     if (res < 0) {
 	logmsg(LOG_CRIT, "unable to determine socket type");
@@ -206,7 +240,7 @@ static void parse_options(int argc, char **argv)
 {
 
     int opt = 0;
-    char *optstring = "bcC:de:hl:m:n:prstTuwi:";
+    char *optstring = "bcC:de:f:F:hH:I:kl:L:m:n:NprsS:tTuw:W:i:";
 
     while (opt != -1) {
 	opt = getopt(argc, argv, optstring);
@@ -237,6 +271,20 @@ static void parse_options(int argc, char **argv)
 #endif
 		opt_exports = optarg;
 		break;
+	    case 'f':
+		opt_fd_entries = strtol(optarg, NULL, 10);
+		if (opt_fd_entries < 1) {
+		    fprintf(stderr, "Invalid number of file descriptors\n");
+		    exit(1);
+		}
+		break;
+	    case 'F':
+		opt_flushers = strtol(optarg, NULL, 10);
+		if (opt_flushers < 0) {
+		    fprintf(stderr, "Invalid number of flusher threads\n");
+		    exit(1);
+		}
+		break;
 	    case 'h':
 		printf(UNFS_NAME);
 		printf("Usage: %s [options]\n", argv[0]);
@@ -261,8 +309,36 @@ static void parse_options(int argc, char **argv)
 		printf
 		    ("\t-r          report unreadable executables as readable\n");
 		printf("\t-T          test exports file and exit\n");
+		printf("\t-w <num>    number of worker threads\n");
+		printf
+		    ("\t-L <num>    number of listening sockets per port\n");
+		printf
+		    ("\t-F <num>    number of threads for COMMIT and stable WRITE\n");
+		printf
+		    ("\t-f <num>    number of open file descriptors to cache\n");
+		printf("\t-H <num>    number of filehandles to cache\n");
+		printf
+		    ("\t-N          trust cached filehandles until notified of changes\n");
+		printf
+		    ("\t-k          use kernel file handles in new filehandles\n");
+		printf
+		    ("\t-S <file>   save and restore filehandle cache in file\n");
+		printf
+		    ("\t-W <depth>  fill filehandle cache from exports at startup\n");
+		printf
+		    ("\t-I <file>   keep an index of inodes below the exports in file\n");
 		exit(0);
 		break;
+	    case 'H':
+		opt_fh_entries = strtol(optarg, NULL, 10);
+		if (opt_fh_entries < 1) {
+		    fprintf(stderr, "Invalid number of filehandles\n");
+		    exit(1);
+		}
+		break;
+	    case 'k':
+		opt_kernel_fh = TRUE;
+		break;
 	    case 'l':
 		opt_bind_addr.s_addr = inet_addr(optarg);
 		if (opt_bind_addr.s_addr == (unsigned) -1) {
@@ -270,6 +346,13 @@ static void parse_options(int argc, char **argv)
 		    exit(1);
 		}
 		break;
+	    case 'L':
+		opt_listeners = strtol(optarg, NULL, 10);
+		if (opt_listeners < 1) {
+		    fprintf(stderr, "Invalid number of listeners\n");
+		    exit(1);
+		}
+		break;
 	    case 'm':
 		opt_mount_port = strtol(optarg, NULL, 10);
 		if (opt_mount_port == 0) {
@@ -284,6 +367,9 @@ static void parse_options(int argc, char **argv)
 		    exit(1);
 		}
 		break;
+	    case 'N':
+		opt_notify = TRUE;
+		break;
 	    case 'p':
 		opt_portmapper = FALSE;
 		break;
@@ -304,6 +390,20 @@ static void parse_options(int argc, char **argv)
 	    case 't':
 		opt_tcponly = TRUE;
 		break;
+	    case 'S':
+		if (optarg[0] != '/') {
+		    fprintf(stderr, "Error: relative path to snapshot file\n");
+		    exit(1);
+		}
+		opt_snapshot = optarg;
+		break;
+	    case 'I':
+		if (optarg[0] != '/') {
+		    fprintf(stderr, "Error: relative path to index file\n");
+		    exit(1);
+		}
+		opt_index = optarg;
+		break;
 	    case 'T':
 		opt_testconfig = TRUE;
 		break;
@@ -314,11 +414,109 @@ static void parse_options(int argc, char **argv)
 	    case 'i':
 		opt_pid_file = optarg;
 		break;
+	    case 'W':
+		opt_prewarm = strtol(optarg, NULL, 10);
+		if (opt_prewarm < 1) {
+		    fprintf(stderr, "Invalid depth\n");
+		    exit(1);
+		}
+		break;
+	    case 'w':
+		opt_threads = strtol(optarg, NULL, 10);
+		if (opt_threads < 1) {
+		    fprintf(stderr, "Invalid number of worker threads\n");
+		    exit(1);
+		}
+		break;
 	    case '?':
 		exit(1);
 		break;
 	}
     }
+
+    /* every listener needs a thread of its own */
+    if (opt_listeners > 1) {
+#if defined(WANT_EPOLL) && defined(WANT_WORKERS) && defined(SO_REUSEPORT)
+	if (opt_threads < opt_listeners)
+	    opt_threads = opt_listeners;
+#else
+	logmsg(LOG_WARNING,
+	       "Multiple listeners not supported, using one listener");
+	opt_listeners = 1;
+#endif
+    }
+
+    if (opt_threads > 1) {
+#ifndef WANT_WORKERS
+	logmsg(LOG_WARNING, "Worker threads not supported, using one thread");
+	opt_threads = 1;
+#else
+	if (opt_cluster) {
+	    logmsg(LOG_WARNING,
+		   "Worker threads cannot be used with cluster extensions");
+	    opt_threads = 1;
+	}
+#ifndef THREAD_CREDENTIALS
+	/* without per-thread credentials, only -s is safe */
+	if (!opt_singleuser && backend_getuid() == 0) {
+	    logmsg(LOG_WARNING,
+		   "Worker threads need single user mode on this platform");
+	    opt_threads = 1;
+	}
+#endif
+#endif
+    }
+
+    if (opt_threads == 1)
+	opt_listeners = 1;
+}
+
+#ifndef WIN32
+/* signals caught, handled by the main loop */
+static volatile sig_atomic_t signal_hup = FALSE;
+static volatile sig_atomic_t signal_usr1 = FALSE;
+static volatile sig_atomic_t signal_exit = 0;
+
+/*
+ * signal handler
+ * the work is done by daemon_signals in the main loop
+ */
+static void daemon_defer(int sig)
+{
+    if (sig == SIGHUP)
+	signal_hup = TRUE;
+    else if (sig == SIGUSR1)
+	signal_usr1 = TRUE;
+    else
+	signal_exit = sig;
+}
+#endif				       /* WIN32 */
+
+/*
+ * handle signals deferred by daemon_defer
+ */
+static void daemon_signals(void)
+{
+#ifndef WIN32
+    if (signal_hup) {
+	signal_hup = FALSE;
+
+	/* no request may use the exports list while it is reloaded */
+	requests_block();
+	daemon_exit(SIGHUP);
+	requests_unblock();
+    }
+
+    if (signal_usr1) {
+	signal_usr1 = FALSE;
+	daemon_exit(SIGUSR1);
+    }
+
+    if (signal_exit) {
+	requests_block();
+	daemon_exit(signal_exit);
+    }
+#endif				       /* WIN32 */
 }
 
 /*
@@ -335,13 +533,24 @@ void daemon_exit(int error)
 
     if (error == SIGUSR1) {
 	if (fh_cache_use > 0)
-	    logmsg(LOG_INFO, "fh entries %i access %i hit %i miss %i",
+	    logmsg(LOG_INFO,
+		   "fh entries %i access %i hit %i miss %i evicted %i trusted %i stale %i",
 		   fh_cache_max, fh_cache_use, fh_cache_hit,
-		   fh_cache_use - fh_cache_hit);
+		   fh_cache_use - fh_cache_hit, fh_cache_evict,
+		   fh_cache_trust, fh_cache_stale);
 	else
 	    logmsg(LOG_INFO, "fh cache unused");
 	logmsg(LOG_INFO, "open file descriptors: read %i, write %i",
 	       fd_cache_readers, fd_cache_writers);
+	logmsg(LOG_INFO,
+	       "fd cache: hit %i miss %i evicted %i forced close %i",
+	       fd_cache_hit, fd_cache_miss, fd_cache_evict, fd_cache_forced);
+	logmsg(LOG_INFO, "duplicate requests: hit %i busy %i miss %i",
+	       drc_hit, drc_busy, drc_miss);
+	logmsg(LOG_INFO, "fh searches %i deferred %i cancelled %i",
+	       resolve_searches, resolve_deferred, resolve_cancelled);
+	logmsg(LOG_INFO, "inode index: hit %i miss %i", index_hit,
+	       index_miss);
 	return;
     }
 #endif				       /* WIN32 */
@@ -355,10 +564,16 @@ void daemon_exit(int error)
 	svc_unregister(NFS3_PROGRAM, NFS_V3);
     }
 
+    /* the caches take locks, which the faulting thread may hold */
     if (error == SIGSEGV)
 	logmsg(LOG_EMERG, "segmentation fault");
-
-    fd_cache_purge();
+    else {
+	fd_cache_purge();
+#ifndef WIN32
+	fh_cache_save();
+	index_sync();
+#endif
+    }
 
     if (opt_detach)
 	closelog();
@@ -369,6 +584,28 @@ void daemon_exit(int error)
     exit(1);
 }
 
+/*
+ * procedures that change files or directories
+ */
+static int nfs_changes(unsigned long proc)
+{
+    switch (proc) {
+	case NFSPROC3_SETATTR:
+	case NFSPROC3_WRITE:
+	case NFSPROC3_CREATE:
+	case NFSPROC3_MKDIR:
+	case NFSPROC3_SYMLINK:
+	case NFSPROC3_MKNOD:
+	case NFSPROC3_REMOVE:
+	case NFSPROC3_RMDIR:
+	case NFSPROC3_RENAME:
+	case NFSPROC3_LINK:
+	    return TRUE;
+	default:
+	    return FALSE;
+    }
+}
+
 /*
  * NFS service dispatch function
  * generated by rpcgen
@@ -400,129 +637,130 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
     } argument;
     char *result;
     xdrproc_t _xdr_argument, _xdr_result;
-    char *(*local) (char *, struct svc_req *);
+    char *(*local) (char *, unfs3_ctx_t *);
+    unfs3_ctx_t *ctx;
 
     switch (rqstp->rq_proc) {
 	case NFSPROC3_NULL:
 	    _xdr_argument = (xdrproc_t) xdr_void;
 	    _xdr_result = (xdrproc_t) xdr_void;
-	    local = (char *(*)(char *, struct svc_req *)) nfsproc3_null_3_svc;
+	    local = (char *(*)(char *, unfs3_ctx_t *)) nfsproc3_null_3_svc;
 	    break;
 
 	case NFSPROC3_GETATTR:
 	    _xdr_argument = (xdrproc_t) xdr_GETATTR3args;
 	    _xdr_result = (xdrproc_t) xdr_GETATTR3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_getattr_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_getattr_3_svc;
 	    break;
 
 	case NFSPROC3_SETATTR:
 	    _xdr_argument = (xdrproc_t) xdr_SETATTR3args;
 	    _xdr_result = (xdrproc_t) xdr_SETATTR3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_setattr_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_setattr_3_svc;
 	    break;
 
 	case NFSPROC3_LOOKUP:
 	    _xdr_argument = (xdrproc_t) xdr_LOOKUP3args;
 	    _xdr_result = (xdrproc_t) xdr_LOOKUP3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_lookup_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_lookup_3_svc;
 	    break;
 
 	case NFSPROC3_ACCESS:
 	    _xdr_argument = (xdrproc_t) xdr_ACCESS3args;
 	    _xdr_result = (xdrproc_t) xdr_ACCESS3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_access_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_access_3_svc;
 	    break;
 
 	case NFSPROC3_READLINK:
 	    _xdr_argument = (xdrproc_t) xdr_READLINK3args;
 	    _xdr_result = (xdrproc_t) xdr_READLINK3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_readlink_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_readlink_3_svc;
 	    break;
 
 	case NFSPROC3_READ:
 	    _xdr_argument = (xdrproc_t) xdr_READ3args;
 	    _xdr_result = (xdrproc_t) xdr_READ3res;
-	    local = (char *(*)(char *, struct svc_req *)) nfsproc3_read_3_svc;
+	    local = (char *(*)(char *, unfs3_ctx_t *)) nfsproc3_read_3_svc;
 	    break;
 
 	case NFSPROC3_WRITE:
 	    _xdr_argument = (xdrproc_t) xdr_WRITE3args;
 	    _xdr_result = (xdrproc_t) xdr_WRITE3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_write_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_write_3_svc;
 	    break;
 
 	case NFSPROC3_CREATE:
 	    _xdr_argument = (xdrproc_t) xdr_CREATE3args;
 	    _xdr_result = (xdrproc_t) xdr_CREATE3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_create_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_create_3_svc;
 	    break;
 
 	case NFSPROC3_MKDIR:
 	    _xdr_argument = (xdrproc_t) xdr_MKDIR3args;
 	    _xdr_result = (xdrproc_t) xdr_MKDIR3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_mkdir_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_mkdir_3_svc;
 	    break;
 
 	case NFSPROC3_SYMLINK:
 	    _xdr_argument = (xdrproc_t) xdr_SYMLINK3args;
 	    _xdr_result = (xdrproc_t) xdr_SYMLINK3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_symlink_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_symlink_3_svc;
 	    break;
 
 	case NFSPROC3_MKNOD:
 	    _xdr_argument = (xdrproc_t) xdr_MKNOD3args;
 	    _xdr_result = (xdrproc_t) xdr_MKNOD3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_mknod_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_mknod_3_svc;
 	    break;
 
 	case NFSPROC3_REMOVE:
 	    _xdr_argument = (xdrproc_t) xdr_REMOVE3args;
 	    _xdr_result = (xdrproc_t) xdr_REMOVE3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_remove_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_remove_3_svc;
 	    break;
 
 	case NFSPROC3_RMDIR:
 	    _xdr_argument = (xdrproc_t) xdr_RMDIR3args;
 	    _xdr_result = (xdrproc_t) xdr_RMDIR3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_rmdir_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_rmdir_3_svc;
 	    break;
 
 	case NFSPROC3_RENAME:
 	    _xdr_argument = (xdrproc_t) xdr_RENAME3args;
 	    _xdr_result = (xdrproc_t) xdr_RENAME3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_rename_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_rename_3_svc;
 	    break;
 
 	case NFSPROC3_LINK:
 	    _xdr_argument = (xdrproc_t) xdr_LINK3args;
 	    _xdr_result = (xdrproc_t) xdr_LINK3res;
-	    local = (char *(*)(char *, struct svc_req *)) nfsproc3_link_3_svc;
+	    local = (char *(*)(char *, unfs3_ctx_t *)) nfsproc3_link_3_svc;
 	    break;
 
 	case NFSPROC3_READDIR:
 	    _xdr_argument = (xdrproc_t) xdr_READDIR3args;
 	    _xdr_result = (xdrproc_t) xdr_READDIR3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_readdir_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_readdir_3_svc;
 	    break;
 
 	case NFSPROC3_READDIRPLUS:
 	    _xdr_argument = (xdrproc_t) xdr_READDIRPLUS3args;
 	    _xdr_result = (xdrproc_t) xdr_READDIRPLUS3res;
-	    local = (char *(*)(char *, struct svc_req *))
+	    local = (char *(*)(char *, unfs3_ctx_t *))
 		nfsproc3_readdirplus_3_svc;
 	    break;
 
@@ -530,40 +768,57 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
 	    _xdr_argument = (xdrproc_t) xdr_FSSTAT3args;
 	    _xdr_result = (xdrproc_t) xdr_FSSTAT3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_fsstat_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_fsstat_3_svc;
 	    break;
 
 	case NFSPROC3_FSINFO:
 	    _xdr_argument = (xdrproc_t) xdr_FSINFO3args;
 	    _xdr_result = (xdrproc_t) xdr_FSINFO3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_fsinfo_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_fsinfo_3_svc;
 	    break;
 
 	case NFSPROC3_PATHCONF:
 	    _xdr_argument = (xdrproc_t) xdr_PATHCONF3args;
 	    _xdr_result = (xdrproc_t) xdr_PATHCONF3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_pathconf_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_pathconf_3_svc;
 	    break;
 
 	case NFSPROC3_COMMIT:
 	    _xdr_argument = (xdrproc_t) xdr_COMMIT3args;
 	    _xdr_result = (xdrproc_t) xdr_COMMIT3res;
 	    local =
-		(char *(*)(char *, struct svc_req *)) nfsproc3_commit_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) nfsproc3_commit_3_svc;
 	    break;
 
 	default:
 	    svcerr_noproc(transp);
 	    return;
     }
+    ctx = ctx_get();
+    if (!ctx) {
+	svcerr_systemerr(transp);
+	return;
+    }
+    /* retransmits are answered from the duplicate request cache */
+    if (drc_begin(rqstp, &ctx->drc) != DRC_NEW)
+	return;
     memset((char *) &argument, 0, sizeof(argument));
+    request_begin();
     if (!svc_getargs(transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
+	drc_done(ctx->drc, NULL, NULL);
 	svcerr_decode(transp);
+	request_end();
 	return;
     }
-    result = (*local) ((char *) &argument, rqstp);
+    ctx_begin(ctx, rqstp);
+    result = (*local) ((char *) &argument, ctx);
+    if (nfs_changes(rqstp->rq_proc))
+	notify_changed();
+    /* without a result, a flusher has taken over the cache entry */
+    if (result != NULL)
+	drc_done(ctx->drc, _xdr_result, result);
     if (result != NULL &&
 	!svc_sendreply(transp, (xdrproc_t) _xdr_result, result)) {
 	svcerr_systemerr(transp);
@@ -573,6 +828,7 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
 	(transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
 	logmsg(LOG_CRIT, "unable to free XDR arguments");
     }
+    request_end();
     return;
 }
 
@@ -588,60 +844,69 @@ static void mountprog_3(struct svc_req *rqstp, register SVCXPRT * transp)
     } argument;
     char *result;
     xdrproc_t _xdr_argument, _xdr_result;
-    char *(*local) (char *, struct svc_req *);
+    char *(*local) (char *, unfs3_ctx_t *);
+    unfs3_ctx_t *ctx;
 
     switch (rqstp->rq_proc) {
 	case MOUNTPROC_NULL:
 	    _xdr_argument = (xdrproc_t) xdr_void;
 	    _xdr_result = (xdrproc_t) xdr_void;
 	    local =
-		(char *(*)(char *, struct svc_req *)) mountproc_null_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) mountproc_null_3_svc;
 	    break;
 
 	case MOUNTPROC_MNT:
 	    _xdr_argument = (xdrproc_t) xdr_dirpath;
 	    _xdr_result = (xdrproc_t) xdr_mountres3;
-	    local = (char *(*)(char *, struct svc_req *)) mountproc_mnt_3_svc;
+	    local = (char *(*)(char *, unfs3_ctx_t *)) mountproc_mnt_3_svc;
 	    break;
 
 	case MOUNTPROC_DUMP:
 	    _xdr_argument = (xdrproc_t) xdr_void;
 	    _xdr_result = (xdrproc_t) xdr_mountlist;
 	    local =
-		(char *(*)(char *, struct svc_req *)) mountproc_dump_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) mountproc_dump_3_svc;
 	    break;
 
 	case MOUNTPROC_UMNT:
 	    _xdr_argument = (xdrproc_t) xdr_dirpath;
 	    _xdr_result = (xdrproc_t) xdr_void;
 	    local =
-		(char *(*)(char *, struct svc_req *)) mountproc_umnt_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) mountproc_umnt_3_svc;
 	    break;
 
 	case MOUNTPROC_UMNTALL:
 	    _xdr_argument = (xdrproc_t) xdr_void;
 	    _xdr_result = (xdrproc_t) xdr_void;
 	    local =
-		(char *(*)(char *, struct svc_req *)) mountproc_umntall_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) mountproc_umntall_3_svc;
 	    break;
 
 	case MOUNTPROC_EXPORT:
 	    _xdr_argument = (xdrproc_t) xdr_void;
 	    _xdr_result = (xdrproc_t) xdr_exports;
 	    local =
-		(char *(*)(char *, struct svc_req *)) mountproc_export_3_svc;
+		(char *(*)(char *, unfs3_ctx_t *)) mountproc_export_3_svc;
 	    break;
 
 	default:
 	    svcerr_noproc(transp);
 	    return;
     }
+    ctx = ctx_get();
+    if (!ctx) {
+	svcerr_systemerr(transp);
+	return;
+    }
     memset((char *) &argument, 0, sizeof(argument));
+    request_begin();
     if (!svc_getargs(transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
 	svcerr_decode(transp);
+	request_end();
 	return;
     }
-    result = (*local) ((char *) &argument, rqstp);
+    ctx_begin(ctx, rqstp);
+    result = (*local) ((char *) &argument, ctx);
     if (result != NULL &&
 	!svc_sendreply(transp, (xdrproc_t) _xdr_result, result)) {
 	svcerr_systemerr(transp);
@@ -651,6 +916,7 @@ static void mountprog_3(struct svc_req *rqstp, register SVCXPRT * transp)
 	(transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
 	logmsg(LOG_CRIT, "unable to free XDR arguments");
     }
+    request_end();
     return;
 }
 
@@ -680,6 +946,7 @@ static void register_nfs_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 		    "unable to register (NFS3_PROGRAM, NFS_V3, tcp).");
 	    daemon_exit(0);
 	}
+	tcp_register(NFS3_PROGRAM, NFS_V3, nfs3_program_3);
     }
 }
 
@@ -719,6 +986,7 @@ static void register_mount_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 		    "unable to register (MOUNTPROG, MOUNTVERS1, tcp).");
 	    daemon_exit(0);
 	}
+	tcp_register(MOUNTPROG, MOUNTVERS1, mountprog_3);
 
 	/* Register MOUNT service (v3) for TCP */
 	if (!svc_register
@@ -728,6 +996,7 @@ static void register_mount_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 		    "unable to register (MOUNTPROG, MOUNTVERS3, tcp).");
 	    daemon_exit(0);
 	}
+	tcp_register(MOUNTPROG, MOUNTVERS3, mountprog_3);
     }
 }
 
@@ -741,7 +1010,7 @@ static SVCXPRT *create_udp_transport(unsigned int port)
     /* Make sure we null the entire sockaddr_in structure */
     memset(&sin, 0, sizeof(struct sockaddr_in));
 
-    if (port == 0)
+    if (port == 0 && opt_listeners == 1)
 	sock = RPC_ANYSOCK;
     else {
 	sin.sin_family = AF_INET;
@@ -749,6 +1018,12 @@ static SVCXPRT *create_udp_transport(unsigned int port)
 	sin.sin_addr.s_addr = opt_bind_addr.s_addr;
 	sock = socket(PF_INET, SOCK_DGRAM, 0);
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
+#ifdef SO_REUSEPORT
+	/* the listeners of all shards share the port */
+	if (opt_listeners > 1)
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char *) &on,
+		       sizeof(on));
+#endif
 	if (bind(sock, (struct sockaddr *) &sin, sizeof(struct sockaddr))) {
 	    perror("bind");
 	    fprintf(stderr, "Couldn't bind to udp port %d\n", port);
@@ -776,7 +1051,7 @@ static SVCXPRT *create_tcp_transport(unsigned int port)
     /* Make sure we null the entire sockaddr_in structure */
     memset(&sin, 0, sizeof(struct sockaddr_in));
 
-    if (port == 0)
+    if (port == 0 && opt_listeners == 1)
 	sock = RPC_ANYSOCK;
     else {
 	sin.sin_family = AF_INET;
@@ -784,6 +1059,12 @@ static SVCXPRT *create_tcp_transport(unsigned int port)
 	sin.sin_addr.s_addr = opt_bind_addr.s_addr;
 	sock = socket(PF_INET, SOCK_STREAM, 0);
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
+#ifdef SO_REUSEPORT
+	/* the listeners of all shards share the port */
+	if (opt_listeners > 1)
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char *) &on,
+		       sizeof(on));
+#endif
 	if (bind(sock, (struct sockaddr *) &sin, sizeof(struct sockaddr))) {
 	    perror("bind");
 	    fprintf(stderr, "Couldn't bind to tcp port %d\n", port);
@@ -801,10 +1082,80 @@ static SVCXPRT *create_tcp_transport(unsigned int port)
     return transp;
 }
 
+/*
+ * create additional UDP transports on the socket of a transport, so
+ * that the worker threads of its shard can receive from it at the
+ * same time
+ */
+static void clone_udp_transport(SVCXPRT * transp, int shard)
+{
+    int i, sock, fd, clones;
+
+    sock = get_transport_socket(transp);
+    event_shard(sock, shard);
+
+    clones = (opt_threads + opt_listeners - 1) / opt_listeners - 1;
+    if (clones == 0)
+	return;
+
+    /* workers that lose the race for a datagram must not block */
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    /* dispatch goes by program number, no need to register the clones */
+    for (i = 0; i < clones; i++) {
+	fd = dup(sock);
+	if (fd == -1 ||
+	    !svcudp_bufcreate(fd, NFS_MAX_UDP_PACKET, NFS_MAX_UDP_PACKET)) {
+	    logmsg(LOG_WARNING, "cannot create additional udp service");
+	    if (fd != -1)
+		close(fd);
+	    break;
+	}
+	event_shard(fd, shard);
+    }
+}
+
+/*
+ * return the port a transport is bound to
+ */
+static unsigned int get_transport_port(SVCXPRT * transp)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+
+    if (getsockname(get_transport_socket(transp),
+		    (struct sockaddr *) &sin, &len) == -1) {
+	perror("getsockname");
+	daemon_exit(0);
+    }
+
+    return ntohs(sin.sin_port);
+}
+
+/*
+ * create the transports of the other listener shards on the ports of
+ * the given ones, the kernel spreads clients across all of them
+ */
+static void create_shards(SVCXPRT * udptransp, SVCXPRT * tcptransp)
+{
+    SVCXPRT *transp;
+    int i;
+
+    for (i = 1; i < opt_listeners; i++) {
+	if (udptransp != NULL) {
+	    transp = create_udp_transport(get_transport_port(udptransp));
+	    clone_udp_transport(transp, i);
+	}
+	transp = create_tcp_transport(get_transport_port(tcptransp));
+	event_shard(get_transport_socket(transp), i);
+    }
+}
+
 /* Run RPC service. This is our own implementation of svc_run(), which
    allows us to handle other events as well. */
 static void unfs3_svc_run(void)
 {
+    int timeout;
 #ifdef HAVE_SVC_GETREQ_POLL
     int r;
 #else
@@ -812,11 +1163,28 @@ static void unfs3_svc_run(void)
     struct timeval tv;
 #endif
 
+    /* housekeeping */
+    event_timer(fd_cache_close_inactive, 1000);
+#ifndef WIN32
+    if (opt_snapshot)
+	event_timer(fh_cache_save, SNAPSHOT_INTERVAL);
+    if (opt_index)
+	event_timer(index_maintain, 1000);
+#endif
+
     for (;;) {
-	fd_cache_close_inactive();
+	daemon_signals();
+	timeout = event_timers();
 
 #ifdef HAVE_SVC_GETREQ_POLL
-	r = poll(svc_pollfd, svc_max_pollfd, 2*1000);
+	if (event_enabled() && opt_threads > 1)
+		r = poll(NULL, 0, timeout);	/* workers serve the sockets */
+	else if (event_enabled())
+		r = event_wait(timeout);
+	else if (opt_threads > 1)
+		r = worker_poll(timeout);
+	else
+		r = poll(svc_pollfd, svc_max_pollfd, timeout);
 	if (r < 0) {
 		if (errno == EINTR) {
 		    continue;
@@ -824,13 +1192,13 @@ static void unfs3_svc_run(void)
 		perror("unfs3_svc_run: poll failed");
 		return;
 	}
-	else if (r)
+	else if (r && opt_threads == 1 && !event_enabled())
 		svc_getreq_poll(svc_pollfd, r);
 
 #else
 	readfds = svc_fdset;
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
 	/* Note: On Windows, it's not possible to call select with all sets
 	   empty; to use it as a sleep function. In our case, however,
 	   readfds should never be empty, since we always have our listen
@@ -929,11 +1297,14 @@ int main(int argc, char **argv)
     }
 
     /* NFS transports */
-    if (!opt_tcponly)
+    if (!opt_tcponly) {
 	udptransp = create_udp_transport(opt_nfs_port);
+	clone_udp_transport(udptransp, 0);
+    }
     tcptransp = create_tcp_transport(opt_nfs_port);
 
     register_nfs_service(udptransp, tcptransp);
+    create_shards(udptransp, tcptransp);
 
     /* MOUNT transports. If ports are equal, then the MOUNT service can reuse 
        the NFS transports. */
@@ -941,6 +1312,7 @@ int main(int argc, char **argv)
 	if (!opt_tcponly)
 	    udptransp = create_udp_transport(opt_mount_port);
 	tcptransp = create_tcp_transport(opt_mount_port);
+	create_shards(udptransp, tcptransp);
     }
 
     register_mount_service(udptransp, tcptransp);
@@ -961,11 +1333,14 @@ int main(int argc, char **argv)
 	act.sa_handler = daemon_exit;
 	act.sa_mask = actset;
 	act.sa_flags = 0;
+	sigaction(SIGSEGV, &act, NULL);
+
+	/* the work takes locks, so it is deferred to the main loop */
+	act.sa_handler = daemon_defer;
 	sigaction(SIGHUP, &act, NULL);
 	sigaction(SIGTERM, &act, NULL);
 	sigaction(SIGINT, &act, NULL);
 	sigaction(SIGQUIT, &act, NULL);
-	sigaction(SIGSEGV, &act, NULL);
 	sigaction(SIGUSR1, &act, NULL);
 
 	act.sa_handler = SIG_IGN;
@@ -992,10 +1367,49 @@ int main(int argc, char **argv)
 	create_pid_file();
 
 	/* initialize internal stuff */
-	fh_cache_init();
-	fd_cache_init();
+	if (fh_cache_init(opt_fh_entries) == -1) {
+	    logmsg(LOG_CRIT, "could not allocate fh cache");
+	    daemon_exit(0);
+	}
+	if (opt_notify && notify_init() == -1)
+	    logmsg(LOG_WARNING, "change notification not available");
+#ifndef WIN32
+	if (opt_snapshot)
+	    fh_cache_restore(opt_snapshot);
+#endif
+	if (fd_cache_init(opt_fd_entries) == -1) {
+	    logmsg(LOG_CRIT, "could not allocate fd cache");
+	    daemon_exit(0);
+	}
+	drc_init();
 	get_squash_ids();
 	exports_parse();
+	if (opt_kernel_fh && fh_kernel_init() == -1)
+	    logmsg(LOG_WARNING, "kernel file handles not available");
+#ifndef WIN32
+	if (opt_prewarm > 0)
+	    fh_cache_prewarm(opt_prewarm);
+	if (opt_index && index_init(opt_index) == -1)
+	    logmsg(LOG_WARNING, "could not open inode index %s", opt_index);
+#endif
+
+	/* take over the sockets from the RPC library if possible */
+	event_init(opt_threads, opt_listeners);
+
+	/* start worker threads */
+	if (opt_threads > 1 && worker_start(opt_threads) == -1) {
+	    logmsg(LOG_WARNING, "could not start worker threads");
+	    opt_threads = 1;
+	}
+
+	/* resolvers run as root, safe only where workers are */
+	if (opt_threads > 1 && resolve_start(RESOLVE_THREADS) == -1)
+	    logmsg(LOG_WARNING, "could not start resolver threads");
+
+	/* flushers need the native transports to answer calls later */
+	if (event_enabled() && opt_flushers > 0 &&
+	    flush_start(opt_flushers) == -1)
+	    logmsg(LOG_WARNING, "could not start flusher threads");
 
 	unfs3_svc_run();
 	exit(1);
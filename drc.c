@@ -0,0 +1,283 @@
+/*
+ * UNFS3 duplicate request cache
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <syslog.h>
+#include <netinet/in.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "daemon.h"
+#include "worker.h"
+#include "event.h"
+#include "tcp.h"
+#include "udp.h"
+#include "drc.h"
+
+/*
+ * replies of procedures that must not or should not run twice are kept
+ * by client address, port, xid and procedure; a retransmitted call gets
+ * the kept reply instead of being run again, and a retransmit of a call
+ * that is still running is dropped, the client will ask again
+ *
+ * the xid is taken from the native transports, calls arriving through
+ * the RPC library are not cached
+ *
+ * entries are reused in a round, skipping those still running
+ */
+
+/* number of entries in the cache */
+#define DRC_ENTRIES	1024
+
+/* number of hash chains */
+#define DRC_HASH	256
+
+/* entry states */
+#define DRC_FREE	0
+#define DRC_RUNNING	1
+#define DRC_DONE	2
+
+typedef struct {
+    uint32 addr;		/* client address */
+    short port;			/* client port */
+    uint32 xid;			/* transaction id */
+    uint32 proc;		/* procedure */
+    int state;
+    char *reply;		/* encoded result */
+    u_int len;
+    int next;			/* hash chain */
+} drc_entry_t;
+
+typedef struct {
+    char *data;
+    u_int len;
+} drc_reply_t;
+
+static drc_entry_t drc[DRC_ENTRIES];
+static int drc_chain[DRC_HASH];
+
+/* next entry to reuse */
+static int drc_clock = 0;
+
+/* protects entries, chains and statistics */
+DEFINE_LOCK(drc_lock);
+
+/* statistics */
+int drc_hit = 0;
+int drc_miss = 0;
+int drc_busy = 0;
+
+/*
+ * initialize the cache
+ */
+void drc_init(void)
+{
+    int i;
+
+    for (i = 0; i < DRC_ENTRIES; i++) {
+	drc[i].state = DRC_FREE;
+	drc[i].reply = NULL;
+	drc[i].next = -1;
+    }
+
+    for (i = 0; i < DRC_HASH; i++)
+	drc_chain[i] = -1;
+}
+
+/*
+ * procedures that are not idempotent or expensive to repeat
+ */
+static int drc_wanted(unsigned long proc)
+{
+    switch (proc) {
+	case NFSPROC3_SETATTR:
+	case NFSPROC3_WRITE:
+	case NFSPROC3_CREATE:
+	case NFSPROC3_MKDIR:
+	case NFSPROC3_SYMLINK:
+	case NFSPROC3_MKNOD:
+	case NFSPROC3_REMOVE:
+	case NFSPROC3_RMDIR:
+	case NFSPROC3_RENAME:
+	case NFSPROC3_LINK:
+	case NFSPROC3_COMMIT:
+	    return TRUE;
+	default:
+	    return FALSE;
+    }
+}
+
+/*
+ * get the xid of a call from the transport
+ */
+#ifdef WANT_EPOLL
+static int drc_xid(SVCXPRT * xprt, uint32 * xid)
+{
+    return tcp_xid(xprt, xid) || udp_xid(xprt, xid);
+}
+#else				       /* WANT_EPOLL */
+static int drc_xid(U(SVCXPRT * xprt), U(uint32 * xid))
+{
+    return FALSE;
+}
+#endif				       /* WANT_EPOLL */
+
+static int drc_bucket(uint32 addr, short port, uint32 xid)
+{
+    return (xid ^ (xid >> 16) ^ addr ^ (unsigned short) port) % DRC_HASH;
+}
+
+/*
+ * unlink an entry from its hash chain and free it
+ */
+static void drc_remove(int idx)
+{
+    int *link;
+
+    link = &drc_chain[drc_bucket(drc[idx].addr, drc[idx].port,
+				 drc[idx].xid)];
+    while (*link != idx)
+	link = &drc[*link].next;
+    *link = drc[idx].next;
+
+    free(drc[idx].reply);
+    drc[idx].reply = NULL;
+    drc[idx].state = DRC_FREE;
+    drc[idx].next = -1;
+}
+
+/*
+ * find entry to reuse, -1 if all are running
+ */
+static int drc_unused(void)
+{
+    int i, idx;
+
+    for (i = 0; i < DRC_ENTRIES; i++) {
+	idx = drc_clock;
+	drc_clock = (drc_clock + 1) % DRC_ENTRIES;
+
+	if (drc[idx].state == DRC_RUNNING)
+	    continue;
+	if (drc[idx].state == DRC_DONE)
+	    drc_remove(idx);
+	return idx;
+    }
+
+    return -1;
+}
+
+static bool_t xdr_drc_reply(XDR * xdrs, drc_reply_t * reply)
+{
+    return xdr_opaque(xdrs, reply->data, reply->len);
+}
+
+/*
+ * look up a call before running it
+ * replays the reply of a completed duplicate, idx is set for new calls
+ * that are cached and must be passed to drc_done
+ */
+int drc_begin(struct svc_req *rqstp, int *idx)
+{
+    drc_reply_t reply;
+    uint32 xid, addr;
+    short port;
+    int i, h;
+
+    *idx = -1;
+    if (!drc_wanted(rqstp->rq_proc) || !drc_xid(rqstp->rq_xprt, &xid))
+	return DRC_NEW;
+
+    addr = get_remote(rqstp).s_addr;
+    port = get_port(rqstp);
+    h = drc_bucket(addr, port, xid);
+
+    LOCK(drc_lock);
+    for (i = drc_chain[h]; i != -1; i = drc[i].next) {
+	if (drc[i].xid != xid || drc[i].addr != addr ||
+	    drc[i].port != port || drc[i].proc != rqstp->rq_proc)
+	    continue;
+
+	if (drc[i].state == DRC_RUNNING) {
+	    drc_busy++;
+	    UNLOCK(drc_lock);
+	    return DRC_BUSY;
+	}
+
+	/* copy, the entry may be reused while sending */
+	reply.len = drc[i].len;
+	reply.data = malloc(reply.len);
+	if (reply.data)
+	    memcpy(reply.data, drc[i].reply, reply.len);
+	drc_hit++;
+	UNLOCK(drc_lock);
+
+	/* without memory the call is dropped like a busy one */
+	if (reply.data &&
+	    !svc_sendreply(rqstp->rq_xprt, (xdrproc_t) xdr_drc_reply,
+			   (caddr_t) & reply))
+	    logmsg(LOG_CRIT, "unable to send RPC reply");
+	free(reply.data);
+	return DRC_REPLAY;
+    }
+
+    drc_miss++;
+    i = drc_unused();
+    if (i != -1) {
+	drc[i].addr = addr;
+	drc[i].port = port;
+	drc[i].xid = xid;
+	drc[i].proc = rqstp->rq_proc;
+	drc[i].state = DRC_RUNNING;
+	drc[i].next = drc_chain[h];
+	drc_chain[h] = i;
+    }
+    UNLOCK(drc_lock);
+
+    *idx = i;
+    return DRC_NEW;
+}
+
+/*
+ * keep the result of a call from drc_begin
+ * without a result, the call is forgotten
+ */
+void drc_done(int idx, xdrproc_t xres, char *res)
+{
+    XDR xdrs;
+    char *buf = NULL;
+    u_int len = 0;
+
+    if (idx == -1)
+	return;
+
+    if (res) {
+	len = xdr_sizeof(xres, res);
+	buf = malloc(len);
+	if (buf) {
+	    xdrmem_create(&xdrs, buf, len, XDR_ENCODE);
+	    if (!(*xres) (&xdrs, res)) {
+		free(buf);
+		buf = NULL;
+	    }
+	}
+    }
+
+    LOCK(drc_lock);
+    if (buf) {
+	drc[idx].reply = buf;
+	drc[idx].len = len;
+	drc[idx].state = DRC_DONE;
+    } else
+	drc_remove(idx);
+    UNLOCK(drc_lock);
+}
@@ -0,0 +1,25 @@
+/*
+ * UNFS3 duplicate request cache
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_DRC_H
+#define UNFS3_DRC_H
+
+/* drc_begin results */
+#define DRC_NEW		0		/* run the request, then drc_done */
+#define DRC_REPLAY	1		/* cached reply has been sent */
+#define DRC_BUSY	2		/* still running, drop the call */
+
+/* statistics */
+extern int drc_hit;
+extern int drc_miss;
+extern int drc_busy;
+
+void drc_init(void);
+
+int drc_begin(struct svc_req *rqstp, int *idx);
+void drc_done(int idx, xdrproc_t xres, char *res);
+
+#endif
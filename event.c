@@ -0,0 +1,522 @@
+/*
+ * UNFS3 event loop
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <syslog.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "daemon.h"
+#include "event.h"
+#include "tcp.h"
+#include "udp.h"
+
+#ifdef WANT_EPOLL
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+# include <sys/poll.h>
+# include <sched.h>
+# include <pthread.h>
+#endif
+
+/* maximum number of timers */
+#define EVENT_TIMERS 8
+
+/* housekeeping functions run from the main loop */
+static struct {
+    void (*func) (void);
+    int64 interval;			/* milliseconds */
+    int64 due;
+} timers[EVENT_TIMERS];
+static int timer_count = 0;
+
+/*
+ * milliseconds on a clock that does not jump
+ */
+static int64 event_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	return (int64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+    return (int64) time(NULL) * 1000;
+}
+
+/*
+ * run func every interval milliseconds
+ */
+void event_timer(void (*func) (void), int interval)
+{
+    if (timer_count == EVENT_TIMERS) {
+	logmsg(LOG_CRIT, "event_timer: too many timers");
+	return;
+    }
+
+    timers[timer_count].func = func;
+    timers[timer_count].interval = interval;
+    timers[timer_count].due = event_clock() + interval;
+    timer_count++;
+}
+
+/*
+ * run timers that are due
+ * returns milliseconds until the next one, -1 if there are none
+ */
+int event_timers(void)
+{
+    int64 now, next = -1;
+    int i;
+
+    now = event_clock();
+    for (i = 0; i < timer_count; i++) {
+	if (timers[i].due <= now) {
+	    timers[i].func();
+	    now = event_clock();
+	    timers[i].due = now + timers[i].interval;
+	}
+	if (next == -1 || timers[i].due - now < next)
+	    next = timers[i].due - now;
+    }
+
+    return (int) next;
+}
+
+#ifdef WANT_EPOLL
+
+/* most events handled per epoll_wait() */
+#define EVENT_BATCH 64
+
+/* socket kinds */
+#define EV_NONE		0
+#define EV_DGRAM	1		/* UDP transport */
+#define EV_LISTEN	2		/* listening TCP socket */
+#define EV_STREAM	3		/* TCP connection */
+#define EV_QUEUE	4		/* calls queued for workers */
+
+/*
+ * every socket is registered edge-triggered and one-shot: an event
+ * goes to exactly one thread, which services the socket and then
+ * re-arms it, so no socket is ever read by two threads at once
+ * and sockets that are not ready cost nothing
+ *
+ * with SO_REUSEPORT listeners, each shard of sockets has an epoll set
+ * of its own, served by its own threads
+ */
+static int *epoll_fds = NULL;
+static int shard_count = 0;
+static int event_batch = 1;
+static int event_workers = FALSE;
+
+/* shard served by the current thread */
+static THREAD_LOCAL int thread_shard = 0;
+
+/* per-connection state, indexed by socket */
+static struct event_conn {
+    int kind;
+    int shard;
+    struct tcp_conn *conn;		/* native transport state */
+} *conns = NULL;
+static int fd_max = 0;
+
+/* CPUs available for pinning threads */
+static int *cpus = NULL;
+static int cpu_count = 0;
+
+/* counts calls queued for the workers */
+static int queue_fd = -1;
+
+/* listening sockets, re-armed by timer after running out of fds */
+static int *listen_fds = NULL;
+static int listen_count = 0;
+static volatile int listen_paused = FALSE;
+
+/*
+ * (re-)arm a socket for one event
+ */
+static int event_arm(int fd, int op)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    ev.data.fd = fd;
+
+    return epoll_ctl(epoll_fds[conns[fd].shard], op, fd, &ev);
+}
+
+/*
+ * re-arm a connection that stopped reading
+ */
+void event_rearm(int fd)
+{
+    event_arm(fd, EPOLL_CTL_MOD);
+}
+
+/*
+ * wake workers for queued calls
+ */
+void event_wake(int count)
+{
+    uint64 v = count;
+
+    while (write(queue_fd, &v, sizeof(v)) == -1 && errno == EINTR) ;
+}
+
+/*
+ * accept all pending connections on a listening socket
+ * returns -1 if accepting must pause because we ran out of fds
+ */
+static int event_accept(int sock)
+{
+    struct tcp_conn *conn;
+    int fd;
+    const int on = 1;
+
+    for (;;) {
+	fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+		errno == ENOMEM) {
+		logmsg(LOG_WARNING, "accept failed: %s", strerror(errno));
+		return -1;
+	    }
+	    return 0;
+	}
+
+	if (fd >= fd_max) {
+	    close(fd);
+	    continue;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	conn = tcp_open(fd);
+	if (!conn) {
+	    logmsg(LOG_WARNING, "cannot create tcp connection");
+	    close(fd);
+	    continue;
+	}
+
+	conns[fd].kind = EV_STREAM;
+	conns[fd].shard = conns[sock].shard;
+	conns[fd].conn = conn;
+	if (event_arm(fd, EPOLL_CTL_ADD) == -1) {
+	    logmsg(LOG_WARNING, "cannot watch tcp connection");
+	    tcp_close(conn);
+	}
+    }
+}
+
+/*
+ * try accepting again after running out of fds
+ */
+static void event_resume(void)
+{
+    int i;
+
+    if (!listen_paused)
+	return;
+
+    listen_paused = FALSE;
+    for (i = 0; i < listen_count; i++)
+	event_arm(listen_fds[i], EPOLL_CTL_MOD);
+}
+
+/*
+ * read from a connection and run the calls that arrived
+ */
+static void event_stream(int fd)
+{
+    struct tcp_conn *conn = conns[fd].conn;
+    struct tcp_call *calls, *next;
+
+    switch (tcp_input(conn, &calls)) {
+	case TCP_REARM:
+	    event_arm(fd, EPOLL_CTL_MOD);
+	    break;
+	case TCP_CLOSED:
+	    epoll_ctl(epoll_fds[conns[fd].shard], EPOLL_CTL_DEL, fd, NULL);
+	    tcp_close(conn);
+	    break;
+    }
+
+    /* the first call is run here, the others by idle workers */
+    if (calls && event_workers && tcp_next(calls)) {
+	tcp_queue(tcp_next(calls));
+	tcp_run(calls);
+	return;
+    }
+
+    while (calls) {
+	next = tcp_next(calls);
+	tcp_run(calls);
+	calls = next;
+    }
+}
+
+/*
+ * give up on epoll after a failed setup
+ */
+static void event_close(void)
+{
+    while (shard_count > 0) {
+	shard_count--;
+	if (epoll_fds[shard_count] != -1)
+	    close(epoll_fds[shard_count]);
+    }
+}
+
+/*
+ * allocate per-socket state
+ */
+static int event_alloc(void)
+{
+    if (conns)
+	return 0;
+
+    fd_max = sysconf(_SC_OPEN_MAX);
+    if (fd_max <= 0)
+	fd_max = FD_SETSIZE;
+
+    conns = calloc(fd_max, sizeof(struct event_conn));
+    if (!conns) {
+	logmsg(LOG_CRIT, "event_alloc: Unable to allocate memory");
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * assign a socket to a shard, before event_init
+ */
+void event_shard(int fd, int shard)
+{
+    if (event_alloc() == 0 && fd >= 0 && fd < fd_max)
+	conns[fd].shard = shard;
+}
+
+/*
+ * find CPUs this process may run on
+ */
+static void event_cpus(void)
+{
+#if HAVE_SCHED_GETAFFINITY == 1 && HAVE_PTHREAD_SETAFFINITY_NP == 1
+    cpu_set_t set;
+    int i;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == -1)
+	return;
+
+    cpus = malloc(CPU_COUNT(&set) * sizeof(int));
+    if (!cpus)
+	return;
+
+    for (i = 0; i < CPU_SETSIZE; i++)
+	if (CPU_ISSET(i, &set))
+	    cpus[cpu_count++] = i;
+#endif
+}
+
+/*
+ * take over all RPC sockets created so far
+ * must be called after all transports have been created
+ */
+int event_init(int threads, int shards)
+{
+    struct epoll_event ev;
+    int i, fd, on;
+    socklen_t len;
+
+    if (event_alloc() == -1)
+	return -1;
+
+    epoll_fds = malloc(shards * sizeof(int));
+    listen_fds = malloc(svc_max_pollfd * sizeof(int));
+    if (!epoll_fds || !listen_fds) {
+	logmsg(LOG_CRIT, "event_init: Unable to allocate memory");
+	return -1;
+    }
+
+    queue_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue_fd == -1 || queue_fd >= fd_max) {
+	logmsg(LOG_WARNING, "event_init: cannot create eventfd");
+	return -1;
+    }
+    conns[queue_fd].kind = EV_QUEUE;
+
+    /* level-triggered, every queued call wakes a worker */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = queue_fd;
+
+    for (i = 0; i < shards; i++) {
+	epoll_fds[i] = epoll_create1(EPOLL_CLOEXEC);
+	shard_count = i + 1;
+	if (epoll_fds[i] == -1 ||
+	    epoll_ctl(epoll_fds[i], EPOLL_CTL_ADD, queue_fd, &ev) == -1) {
+	    logmsg(LOG_WARNING, "event_init: cannot create epoll set: %s",
+		   strerror(errno));
+	    event_close();
+	    return -1;
+	}
+    }
+
+    for (i = 0; i < svc_max_pollfd; i++) {
+	fd = svc_pollfd[i].fd;
+	if (fd < 0 || fd >= fd_max)
+	    continue;
+
+	/* connections are served by the native transport */
+	len = sizeof(on);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == 0 && on) {
+	    conns[fd].kind = EV_LISTEN;
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	    listen_fds[listen_count++] = fd;
+	} else
+	    conns[fd].kind = EV_DGRAM;
+
+	if (event_arm(fd, EPOLL_CTL_ADD) == -1) {
+	    logmsg(LOG_WARNING, "event_init: epoll_ctl failed: %s",
+		   strerror(errno));
+	    event_close();
+	    return -1;
+	}
+    }
+
+    /* with workers, hand out one event at a time to spread the load */
+    event_workers = threads > 1;
+    event_batch = event_workers ? 1 : EVENT_BATCH;
+
+    if (shards > 1)
+	event_cpus();
+
+    event_timer(event_resume, 1000);
+
+    return 0;
+}
+
+/*
+ * whether the event loop is in use
+ */
+int event_enabled(void)
+{
+    return shard_count > 0;
+}
+
+/*
+ * serve the sockets of a shard forever, run by worker number index
+ */
+void event_loop(int index)
+{
+#if HAVE_SCHED_GETAFFINITY == 1 && HAVE_PTHREAD_SETAFFINITY_NP == 1
+    cpu_set_t set;
+
+    /* keep each shard on its own CPU */
+    if (cpu_count > 0) {
+	CPU_ZERO(&set);
+	CPU_SET(cpus[index % cpu_count], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    thread_shard = index % shard_count;
+    for (;;)
+	event_wait(-1);
+}
+
+/*
+ * wait for sockets and service the ready ones
+ * may be called from several threads, returns like poll()
+ */
+int event_wait(int timeout)
+{
+    struct epoll_event ev[EVENT_BATCH];
+    struct tcp_call *call;
+    uint64 v;
+    int i, n, fd;
+
+    n = epoll_wait(epoll_fds[thread_shard], ev, event_batch, timeout);
+
+    for (i = 0; i < n; i++) {
+	fd = ev[i].data.fd;
+
+	switch (conns[fd].kind) {
+	    case EV_LISTEN:
+		if (event_accept(fd) == -1)
+		    listen_paused = TRUE;
+		else
+		    event_arm(fd, EPOLL_CTL_MOD);
+		break;
+	    case EV_DGRAM:
+		udp_input(fd);
+		break;
+	    case EV_STREAM:
+		event_stream(fd);
+		break;
+	    case EV_QUEUE:
+		if (read(queue_fd, &v, sizeof(v)) == sizeof(v) &&
+		    (call = tcp_dequeue()))
+		    tcp_run(call);
+		break;
+	}
+    }
+
+    return n;
+}
+
+#else				       /* WANT_EPOLL */
+
+void event_shard(U(int fd), U(int shard))
+{
+}
+
+int event_init(U(int threads), U(int shards))
+{
+    return -1;
+}
+
+int event_enabled(void)
+{
+    return FALSE;
+}
+
+int event_wait(U(int timeout))
+{
+    errno = EINVAL;
+    return -1;
+}
+
+void event_loop(U(int index))
+{
+}
+
+void event_rearm(U(int fd))
+{
+}
+
+void event_wake(U(int count))
+{
+}
+
+#endif				       /* WANT_EPOLL */
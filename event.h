@@ -0,0 +1,35 @@
+/*
+ * UNFS3 event loop
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_EVENT_H
+#define UNFS3_EVENT_H
+
+/*
+ * the epoll loop accepts connections itself and services each ready
+ * socket directly, it needs the svc_pollfd array to pick up the
+ * transports created at startup; TCP connections are served by the
+ * native transport, which with TI-RPC needs <rpc/svc_mt.h> to
+ * authenticate calls
+ */
+#if HAVE_SYS_EPOLL_H == 1 && HAVE_SYS_EVENTFD_H == 1 && \
+    HAVE_EPOLL_CREATE1 == 1 && HAVE_ACCEPT4 == 1 && \
+    HAVE_SVC_GETREQ_POLL == 1 && !defined(WIN32) && \
+    (HAVE_SVC_TLI_CREATE == 0 || HAVE_RPC_SVC_MT_H == 1)
+#define WANT_EPOLL 1
+#endif
+
+void event_shard(int fd, int shard);
+int event_init(int threads, int shards);
+int event_enabled(void);
+int event_wait(int timeout);
+void event_loop(int index);
+void event_rearm(int fd);
+void event_wake(int count);
+
+void event_timer(void (*func) (void), int interval);
+int event_timers(void);
+
+#endif
@@ -13,11 +13,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #ifndef WIN32
 #include <syslog.h>
 #include <unistd.h>
+#include <sys/resource.h>
 #endif				       /* WIN32 */
+#if HAVE_PWRITEV == 1
+#include <sys/uio.h>
+#endif
 
 #include "nfs.h"
 #include "mount.h"
@@ -26,6 +32,8 @@
 #include "Config/exports.h"
 #include "fd_cache.h"
 #include "backend.h"
+#include "worker.h"
+#include "notify.h"
 
 /*
  * intention of the file descriptor cache
@@ -55,17 +63,68 @@
  * COMMITs may succeed even though data has been lost, but since the
  * verifier is changed, clients will notice this and re-send their
  * data. Eventually, with some luck, all clients will get an IO error.
+ *
+ * With worker threads, an open fd may be in use by several requests at
+ * once. ref counts these users; an entry is only closed when it drops
+ * to zero. While the fsync/close of an entry is running without the
+ * lock held, the entry is marked as closing and ignored by lookups.
+ *
+ * Entries are found through hash chains by inode and by fd. When all
+ * entries are used, the least recently used idle one is closed to make
+ * room, preferring readers; a writer closed early is synced first and
+ * keeps a pending error if that fails.
+ *
+ * Small UNSTABLE writes to a cached fd are kept in memory behind the
+ * entry and written out together with pwritev(), when a contiguous run
+ * has grown large enough, before a COMMIT or close, or when the fd is
+ * closed for inactivity. Errors writing them out are handled like
+ * fsync errors: they are returned by the next WRITE or COMMIT and the
+ * write verifier is changed, so clients send the lost data again.
  */
 
-/* number of entries in fd cache */
-#define FD_ENTRIES	256
+/* descriptors left for sockets and everything else */
+#define FD_RESERVE	128
+
+/* attempts to make room by closing idle entries */
+#define FD_EVICT_TRIES	4
 
 /* The number of seconds to wait before closing inactive fd */
 #define INACTIVE_TIMEOUT 2
 
+/* most inactive fds closed at once */
+#define FD_CLOSE_BATCH	64
+
 /* The number of seconds to keep pending errors */
 #define PENDING_ERROR_TIMEOUT 7200     /* 2 hours */
 
+/*
+ * READs of an entry are watched for sequential and strided streams;
+ * the kernel is asked to read ahead of them, with a window growing as
+ * the stream goes on, and to drop what is behind a long sequential
+ * stream, which is most likely a one-pass scan or backup
+ */
+#define RA_MIN_RUN	2			/* READs before readahead */
+#define RA_MAX		(8 * 1024 * 1024)	/* largest window */
+#define RA_STRIDES	4			/* strided READs ahead */
+#define RA_ONEPASS	(64 * 1024 * 1024)	/* stream length to drop */
+#define RA_BEHIND	(4 * 1024 * 1024)	/* kept behind a stream */
+
+#if HAVE_PWRITEV == 1 && !defined(WIN32)
+#define WANT_WRITE_BEHIND 1
+#endif
+
+/* write-behind limits */
+#define WB_SEGS		32			/* WRITEs kept per entry */
+#define WB_SMALL	(64 * 1024)		/* largest WRITE kept */
+#define WB_RUN		(1024 * 1024)		/* run written at once */
+#define WB_MAX		(64 * 1024 * 1024)	/* memory for all entries */
+
+typedef struct {
+    uint64 off;
+    uint32 len;
+    char *data;
+} fd_wb_t;
+
 typedef struct {
     int fd;			/* open file descriptor */
     int kind;			/* read or write */
@@ -73,43 +132,350 @@ typedef struct {
     uint32 dev;			/* device */
     uint64 ino;			/* inode */
     uint32 gen;			/* inode generation */
+    int ref;			/* requests using fd */
+    int closing;		/* fsync/close in progress */
+    uint64 ra_last;		/* offset of last READ */
+    uint64 ra_next;		/* end of last READ */
+    int64 ra_stride;		/* distance of strided READs, 0 if sequential */
+    int ra_run;			/* READs following the pattern */
+    uint64 ra_start;		/* start of sequential stream */
+    uint64 ra_end;		/* end of range read ahead */
+    uint64 ra_drop;		/* range before has been dropped */
+    LOCK_T wb_lock;		/* protects write-behind */
+    fd_wb_t *wb;		/* kept WRITEs, sorted by offset */
+    int wb_count;
+    int wb_err;			/* errno of failed write-behind */
+    int fh_next;		/* hash chain by inode */
+    int fd_next;		/* hash chain by fd */
+    int lru_prev;		/* used entries, oldest first */
+    int lru_next;		/* or free list */
 } fd_cache_t;
 
-static fd_cache_t fd_cache[FD_ENTRIES];
+static fd_cache_t *fd_cache = NULL;
+static int fd_entries = 0;
+
+static int *fd_hash_fh = NULL;
+static int *fd_hash_fd = NULL;
+static uint32 fd_hash_mask = 0;
+
+static int fd_free = -1;
+static int fd_lru_head = -1;
+static int fd_lru_tail = -1;
+
+/* protects cache entries and statistics */
+DEFINE_LOCK(fd_cache_lock);
 
 /* statistics */
 int fd_cache_readers = 0;
 int fd_cache_writers = 0;
+int fd_cache_hit = 0;
+int fd_cache_miss = 0;
+int fd_cache_evict = 0;
+int fd_cache_forced = 0;
+
+/* memory used by write-behind */
+static uint32 wb_bytes = 0;
+DEFINE_LOCK(wb_bytes_lock);
+
+/*
+ * forget the access pattern of an entry
+ */
+static void fd_cache_ra_reset(int idx, uint64 off)
+{
+    fd_cache[idx].ra_last = off;
+    fd_cache[idx].ra_next = off;
+    fd_cache[idx].ra_stride = 0;
+    fd_cache[idx].ra_run = 0;
+    fd_cache[idx].ra_start = off;
+    fd_cache[idx].ra_end = off;
+    fd_cache[idx].ra_drop = off;
+}
+
+static uint32 fh_bucket(uint32 dev, uint64 ino)
+{
+    return ((uint32) (ino ^ (ino >> 32)) * 2654435761U ^ dev) & fd_hash_mask;
+}
+
+static uint32 fd_bucket(int fd)
+{
+    return ((uint32) fd * 2654435761U) & fd_hash_mask;
+}
+
+static void hash_fh_add(int idx)
+{
+    uint32 h = fh_bucket(fd_cache[idx].dev, fd_cache[idx].ino);
+
+    fd_cache[idx].fh_next = fd_hash_fh[h];
+    fd_hash_fh[h] = idx;
+}
+
+static void hash_fh_del(int idx)
+{
+    int *link = &fd_hash_fh[fh_bucket(fd_cache[idx].dev, fd_cache[idx].ino)];
+
+    while (*link != idx)
+	link = &fd_cache[*link].fh_next;
+    *link = fd_cache[idx].fh_next;
+}
+
+static void hash_fd_add(int idx)
+{
+    uint32 h = fd_bucket(fd_cache[idx].fd);
+
+    fd_cache[idx].fd_next = fd_hash_fd[h];
+    fd_hash_fd[h] = idx;
+}
+
+static void hash_fd_del(int idx)
+{
+    int *link = &fd_hash_fd[fd_bucket(fd_cache[idx].fd)];
+
+    while (*link != idx)
+	link = &fd_cache[*link].fd_next;
+    *link = fd_cache[idx].fd_next;
+}
+
+static void lru_del(int idx)
+{
+    if (fd_cache[idx].lru_prev != -1)
+	fd_cache[fd_cache[idx].lru_prev].lru_next = fd_cache[idx].lru_next;
+    else
+	fd_lru_head = fd_cache[idx].lru_next;
+    if (fd_cache[idx].lru_next != -1)
+	fd_cache[fd_cache[idx].lru_next].lru_prev = fd_cache[idx].lru_prev;
+    else
+	fd_lru_tail = fd_cache[idx].lru_prev;
+}
+
+static void lru_add(int idx)
+{
+    fd_cache[idx].lru_prev = fd_lru_tail;
+    fd_cache[idx].lru_next = -1;
+    if (fd_lru_tail != -1)
+	fd_cache[fd_lru_tail].lru_next = idx;
+    else
+	fd_lru_head = idx;
+    fd_lru_tail = idx;
+}
+
+/*
+ * limit the number of entries to the open file limit, raising the
+ * soft limit if needed
+ */
+static int fd_cache_limit(int entries)
+{
+#ifndef WIN32
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY)
+	return entries;
+
+    if ((rlim_t) entries + FD_RESERVE > rl.rlim_cur) {
+	if (rl.rlim_max == RLIM_INFINITY ||
+	    rl.rlim_max > (rlim_t) entries + FD_RESERVE)
+	    rl.rlim_cur = (rlim_t) entries + FD_RESERVE;
+	else
+	    rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+	    getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((rlim_t) entries + FD_RESERVE > rl.rlim_cur) {
+	entries = rl.rlim_cur > 2 * FD_RESERVE ?
+	    (int) rl.rlim_cur - FD_RESERVE : FD_RESERVE;
+	logmsg(LOG_WARNING, "fd cache limited to %d entries by open file limit",
+	       entries);
+    }
+#endif
+
+    return entries;
+}
 
 /*
  * initialize the fd cache
+ * returns -1 if out of memory
  */
-void fd_cache_init(void)
+int fd_cache_init(int entries)
 {
-    int i;
+    int i, buckets;
+
+    fd_entries = fd_cache_limit(entries);
+    for (buckets = 1; buckets < fd_entries; buckets <<= 1) ;
+    fd_hash_mask = buckets - 1;
+
+    fd_cache = calloc(fd_entries, sizeof(fd_cache_t));
+    fd_hash_fh = malloc(buckets * sizeof(int));
+    fd_hash_fd = malloc(buckets * sizeof(int));
+    if (!fd_cache || !fd_hash_fh || !fd_hash_fd) {
+	fd_entries = 0;
+	return -1;
+    }
+
+    for (i = 0; i < buckets; i++) {
+	fd_hash_fh[i] = -1;
+	fd_hash_fd[i] = -1;
+    }
 
-    for (i = 0; i < FD_ENTRIES; i++) {
+    for (i = fd_entries - 1; i >= 0; i--) {
 	fd_cache[i].fd = -1;
 	fd_cache[i].kind = UNFS3_FD_READ;
 	fd_cache[i].use = 0;
 	fd_cache[i].dev = 0;
 	fd_cache[i].ino = 0;
 	fd_cache[i].gen = 0;
+	fd_cache[i].ref = 0;
+	fd_cache[i].closing = FALSE;
+	fd_cache_ra_reset(i, 0);
+	LOCK_INIT(fd_cache[i].wb_lock);
+	fd_cache[i].wb = NULL;
+	fd_cache[i].wb_count = 0;
+	fd_cache[i].wb_err = 0;
+	fd_cache[i].lru_next = fd_free;
+	fd_free = i;
+    }
+
+    return 0;
+}
+
+#ifdef WANT_WRITE_BEHIND
+/*
+ * allocate memory for a kept WRITE, NULL if over the limit
+ */
+static char *wb_alloc(uint32 len)
+{
+    char *data = NULL;
+
+    LOCK(wb_bytes_lock);
+    if (wb_bytes + len <= WB_MAX && (data = malloc(len)))
+	wb_bytes += len;
+    UNLOCK(wb_bytes_lock);
+
+    return data;
+}
+
+/*
+ * write out the contiguous kept WRITEs first to last of an entry
+ * must be called with the wb_lock of the entry held
+ */
+static void wb_write(fd_cache_t * e, int first, int last)
+{
+    struct iovec iov[WB_SEGS];
+    ssize_t res, want = 0;
+    int i, n = 0;
+
+    for (i = first; i <= last; i++) {
+	iov[n].iov_base = e->wb[i].data;
+	iov[n].iov_len = e->wb[i].len;
+	want += e->wb[i].len;
+	n++;
     }
+
+    res = pwritev(e->fd, iov, n, (off64_t) e->wb[first].off);
+    notify_changed();
+    if (res != want && e->wb_err == 0)
+	e->wb_err = (res == -1) ? errno : ENOSPC;
+
+    for (i = first; i <= last; i++)
+	free(e->wb[i].data);
+    LOCK(wb_bytes_lock);
+    wb_bytes -= want;
+    UNLOCK(wb_bytes_lock);
+
+    memmove(&e->wb[first], &e->wb[last + 1],
+	    (e->wb_count - last - 1) * sizeof(fd_wb_t));
+    e->wb_count -= n;
+}
+
+/*
+ * write out all kept WRITEs of an entry
+ * must be called with the wb_lock of the entry held
+ */
+static void wb_flush(fd_cache_t * e)
+{
+    int last;
+
+    while (e->wb_count > 0) {
+	last = 0;
+	while (last + 1 < e->wb_count &&
+	       e->wb[last].off + e->wb[last].len == e->wb[last + 1].off)
+	    last++;
+	wb_write(e, 0, last);
+    }
+}
+#endif
+
+/*
+ * write out the kept WRITEs of an entry in use or being closed
+ * returns -1 and sets errno if writing them failed, now or before
+ */
+static int fd_wb_flush(int idx)
+{
+    int res = 0;
+
+#ifdef WANT_WRITE_BEHIND
+    fd_cache_t *e = &fd_cache[idx];
+
+    LOCK(e->wb_lock);
+    wb_flush(e);
+    if (e->wb_err != 0) {
+	errno = e->wb_err;
+	e->wb_err = 0;
+	res = -1;
+    }
+    UNLOCK(e->wb_lock);
+#endif
+
+    return res;
+}
+
+static int fd_cache_del(int idx, int keep_on_error);
+
+/*
+ * close the least recently used idle entry of a kind
+ * returns FALSE if there is none
+ *
+ * must be called with fd_cache_lock held, drops it during fsync/close
+ */
+static int fd_cache_evict_kind(int kind)
+{
+    int idx;
+
+    for (idx = fd_lru_head; idx != -1; idx = fd_cache[idx].lru_next)
+	if (fd_cache[idx].kind == kind && fd_cache[idx].fd != -1 &&
+	    fd_cache[idx].ref == 0 && !fd_cache[idx].closing) {
+	    if (kind == UNFS3_FD_WRITE)
+		fd_cache_forced++;
+	    else
+		fd_cache_evict++;
+	    fd_cache_del(idx, TRUE);
+	    return TRUE;
+	}
+
+    return FALSE;
 }
 
 /*
  * find cache index to use for new entry
  * returns an empty slot if found, else return error
+ *
+ * must be called with fd_cache_lock held, may drop it to make room
  */
 static int fd_cache_unused(void)
 {
-    int i;
+    int idx, i;
     static time_t last_warning = 0;
 
-    for (i = 0; i < FD_ENTRIES; i++) {
-	if (fd_cache[i].use == 0)
-	    return i;
+    for (i = 0; i < FD_EVICT_TRIES; i++) {
+	if (fd_free != -1) {
+	    idx = fd_free;
+	    fd_free = fd_cache[idx].lru_next;
+	    return idx;
+	}
+
+	/* readers are closed without cost, writers need a sync */
+	if (!fd_cache_evict_kind(UNFS3_FD_READ) &&
+	    !fd_cache_evict_kind(UNFS3_FD_WRITE))
+	    break;
     }
 
     /* Do not print warning more than once per 10 second */
@@ -117,7 +483,7 @@ static int fd_cache_unused(void)
 	last_warning = time(NULL);
 	logmsg(LOG_INFO,
 	       "fd cache full due to more than %d active files or pending IO errors",
-	       FD_ENTRIES);
+	       fd_entries);
     }
 
     return -1;
@@ -130,28 +496,46 @@ static int fd_cache_unused(void)
  * fsync/close failures. It should be set to TRUE when fd_cache_del is
  * called from a code path which cannot report an IO error back to the
  * client through WRITE or COMMIT. 
+ *
+ * must be called with fd_cache_lock held, drops it during fsync/close
  */
 static int fd_cache_del(int idx, int keep_on_error)
 {
-    int res1, res2;
+    int res1, res2, fd, kind, err;
 
     res1 = -1;
 
     if (fd_cache[idx].fd != -1) {
-	if (fd_cache[idx].kind == UNFS3_FD_WRITE) {
-	    /* sync file data if writing descriptor */
+	fd = fd_cache[idx].fd;
+	kind = fd_cache[idx].kind;
+	if (kind == UNFS3_FD_WRITE)
 	    fd_cache_writers--;
-	    res1 = backend_fsync(fd_cache[idx].fd);
-	} else {
+	else
 	    fd_cache_readers--;
+	fd_cache[idx].closing = TRUE;
+	hash_fd_del(idx);
+	UNLOCK(fd_cache_lock);
+
+	if (kind == UNFS3_FD_WRITE) {
+	    /* write out kept WRITEs and sync file data */
+	    res1 = fd_wb_flush(idx);
+	    if (res1 != -1)
+		res1 = backend_fsync(fd);
+	} else
 	    res1 = 0;
-	}
-	res2 = backend_close(fd_cache[idx].fd);
+	err = errno;
+	res2 = backend_close(fd);
+	if (res1 != -1)
+	    err = errno;
+
+	LOCK(fd_cache_lock);
+	fd_cache[idx].closing = FALSE;
 	fd_cache[idx].fd = -1;
 
 	/* return -1 if something went wrong during sync or close */
 	if (res1 == -1 || res2 == -1) {
 	    res1 = -1;
+	    errno = err;
 	}
     } else
 	/* pending error */
@@ -164,24 +548,59 @@ static int fd_cache_del(int idx, int keep_on_error)
     }
 
     if (res1 != -1 || !keep_on_error) {
+	hash_fh_del(idx);
+	lru_del(idx);
+	fd_cache[idx].lru_next = fd_free;
+	fd_free = idx;
 	fd_cache[idx].fd = -1;
 	fd_cache[idx].use = 0;
 	fd_cache[idx].dev = 0;
 	fd_cache[idx].ino = 0;
 	fd_cache[idx].gen = 0;
+	fd_cache[idx].ref = 0;
     }
 
     return res1;
 }
 
+/*
+ * find entry by fh (device, inode, and generation number)
+ */
+static int idx_by_fh(unfs3_fh_t * ufh, int kind)
+{
+    int idx;
+
+    for (idx = fd_hash_fh[fh_bucket(ufh->dev, ufh->ino)]; idx != -1;
+	 idx = fd_cache[idx].fh_next)
+	if (fd_cache[idx].kind == kind && !fd_cache[idx].closing &&
+	    fd_cache[idx].dev == ufh->dev && fd_cache[idx].ino == ufh->ino &&
+	    fd_cache[idx].gen == ufh->gen)
+	    return idx;
+
+    return -1;
+}
+
 /*
  * add an entry to the cache
+ * returns FALSE if fd was not added
  */
-static void fd_cache_add(int fd, unfs3_fh_t * ufh, int kind)
+static int fd_cache_add(int fd, unfs3_fh_t * ufh, int kind)
 {
     int idx;
 
+    /* another request may have opened the same file meanwhile */
+    if (idx_by_fh(ufh, kind) != -1)
+	return FALSE;
+
     idx = fd_cache_unused();
+
+    /* or while making room */
+    if (idx != -1 && idx_by_fh(ufh, kind) != -1) {
+	fd_cache[idx].lru_next = fd_free;
+	fd_free = idx;
+	return FALSE;
+    }
+
     if (idx != -1) {
 	/* update statistics */
 	if (kind == UNFS3_FD_READ)
@@ -195,7 +614,15 @@ static void fd_cache_add(int fd, unfs3_fh_t * ufh, int kind)
 	fd_cache[idx].dev = ufh->dev;
 	fd_cache[idx].ino = ufh->ino;
 	fd_cache[idx].gen = ufh->gen;
+	fd_cache[idx].ref = 1;
+	fd_cache_ra_reset(idx, 0);
+	hash_fh_add(idx);
+	hash_fd_add(idx);
+	lru_add(idx);
+	return TRUE;
     }
+
+    return FALSE;
 }
 
 /*
@@ -203,34 +630,15 @@ static void fd_cache_add(int fd, unfs3_fh_t * ufh, int kind)
  */
 static int idx_by_fd(int fd, int kind)
 {
-    int i;
-    int idx = -1;
+    int idx;
 
-    for (i = 0; i < FD_ENTRIES; i++)
-	if (fd_cache[i].fd == fd && fd_cache[i].kind == kind) {
-	    idx = i;
-	    break;
-	}
-    return idx;
-}
+    for (idx = fd_hash_fd[fd_bucket(fd)]; idx != -1;
+	 idx = fd_cache[idx].fd_next)
+	if (fd_cache[idx].fd == fd && fd_cache[idx].kind == kind &&
+	    !fd_cache[idx].closing)
+	    return idx;
 
-/*
- * find entry by fh (device, inode, and generation number)
- */
-static int idx_by_fh(unfs3_fh_t * ufh, int kind)
-{
-    int i;
-    int idx = -1;
-
-    for (i = 0; i < FD_ENTRIES; i++)
-	if (fd_cache[i].kind == kind) {
-	    if (fd_cache[i].dev == ufh->dev && fd_cache[i].ino == ufh->ino &&
-		fd_cache[i].gen == ufh->gen) {
-		idx = i;
-		break;
-	    }
-	}
-    return idx;
+    return -1;
 }
 
 /*
@@ -243,16 +651,25 @@ int fd_open(const char *path, nfs_fh3 nfh, int kind, int allow_caching)
     backend_statstruct buf;
     unfs3_fh_t fh = fh_decode(&nfh);
 
+    LOCK(fd_cache_lock);
     idx = idx_by_fh(&fh, kind);
 
     if (idx != -1) {
 	if (fd_cache[idx].fd == -1) {
 	    /* pending error, report to client and remove from cache */
 	    fd_cache_del(idx, FALSE);
+	    UNLOCK(fd_cache_lock);
 	    return -1;
 	}
-	return fd_cache[idx].fd;
+	fd_cache[idx].ref++;
+	fd_cache_hit++;
+	fd = fd_cache[idx].fd;
+	UNLOCK(fd_cache_lock);
+	return fd;
     } else {
+	fd_cache_miss++;
+	UNLOCK(fd_cache_lock);
+
 	/* call open to obtain new fd */
 	if (kind == UNFS3_FD_READ)
 	    fd = backend_open(path, O_RDONLY);
@@ -282,8 +699,11 @@ int fd_open(const char *path, nfs_fh3 nfh, int kind, int allow_caching)
 	/* 
 	 * success, add to cache for later use
 	 */
-	if (allow_caching)
+	if (allow_caching) {
+	    LOCK(fd_cache_lock);
 	    fd_cache_add(fd, &fh, kind);
+	    UNLOCK(fd_cache_lock);
+	}
 	return fd;
     }
 }
@@ -296,17 +716,35 @@ int fd_close(int fd, int kind, int really_close)
 {
     int idx, res1 = 0, res2 = 0;
 
+    LOCK(fd_cache_lock);
     idx = idx_by_fd(fd, kind);
     if (idx != -1) {
 	/* update usage time of cache entry */
 	fd_cache[idx].use = time(NULL);
+	fd_cache[idx].ref--;
+	lru_del(idx);
+	lru_add(idx);
 
-	if (really_close == FD_CLOSE_REAL)
+	if (really_close == FD_CLOSE_REAL && fd_cache[idx].ref == 0)
 	    /* delete entry on real close, will close() fd */
-	    return fd_cache_del(idx, FALSE);
-	else
-	    return 0;
+	    res1 = fd_cache_del(idx, FALSE);
+	else if (really_close == FD_CLOSE_REAL && kind == UNFS3_FD_WRITE) {
+	    /* still in use by other requests, only sync */
+	    fd_cache[idx].ref++;
+	    UNLOCK(fd_cache_lock);
+	    res1 = fd_wb_flush(idx);
+	    if (res1 != -1)
+		res1 = backend_fsync(fd);
+	    LOCK(fd_cache_lock);
+	    fd_cache[idx].ref--;
+	    if (res1 == -1)
+		regenerate_write_verifier();
+	}
+	UNLOCK(fd_cache_lock);
+	return res1;
     } else {
+	UNLOCK(fd_cache_lock);
+
 	/* not in cache, sync and close directly */
 	if (kind == UNFS3_FD_WRITE)
 	    res1 = backend_fsync(fd);
@@ -325,15 +763,278 @@ int fd_close(int fd, int kind, int really_close)
  */
 int fd_sync(nfs_fh3 nfh)
 {
-    int idx;
+    int idx, fd, res = 0;
     unfs3_fh_t fh = fh_decode(&nfh);
 
+    LOCK(fd_cache_lock);
     idx = idx_by_fh(&fh, UNFS3_FD_WRITE);
-    if (idx != -1)
+    if (idx != -1 && fd_cache[idx].ref > 0) {
+	/* in use by other requests, sync without closing */
+	fd = fd_cache[idx].fd;
+	fd_cache[idx].ref++;
+	UNLOCK(fd_cache_lock);
+	res = fd_wb_flush(idx);
+	if (res != -1)
+	    res = backend_fsync(fd);
+	LOCK(fd_cache_lock);
+	fd_cache[idx].ref--;
+	if (res == -1)
+	    regenerate_write_verifier();
+    } else if (idx != -1)
 	/* delete entry, will fsync() and close() the fd */
-	return fd_cache_del(idx, FALSE);
-    else
+	res = fd_cache_del(idx, FALSE);
+    UNLOCK(fd_cache_lock);
+
+    return res;
+}
+
+/*
+ * write to a file descriptor from fd_open
+ * small UNSTABLE writes to a cached fd are kept and written later
+ */
+int fd_pwrite(int fd, const char *data, uint32 len, uint64 off,
+	      int stable)
+{
+#ifdef WANT_WRITE_BEHIND
+    fd_cache_t *e;
+    char *copy = NULL;
+    uint32 run;
+    int idx, res, pos, first, last;
+
+    LOCK(fd_cache_lock);
+    idx = idx_by_fd(fd, UNFS3_FD_WRITE);
+    UNLOCK(fd_cache_lock);
+
+    /* the caller's reference keeps the entry */
+    if (idx == -1)
+	return backend_pwrite(fd, data, len, (off64_t) off);
+    e = &fd_cache[idx];
+
+    LOCK(e->wb_lock);
+    for (pos = 0; pos < e->wb_count && e->wb[pos].off < off; pos++) ;
+
+    if (!e->wb)
+	e->wb = malloc(WB_SEGS * sizeof(fd_wb_t));
+
+    /* overlapping WRITEs must reach the file in order */
+    if (e->wb && stable == UNSTABLE && len <= WB_SMALL &&
+	e->wb_count < WB_SEGS &&
+	(pos == 0 || e->wb[pos - 1].off + e->wb[pos - 1].len <= off) &&
+	(pos == e->wb_count || off + len <= e->wb[pos].off))
+	copy = wb_alloc(len);
+
+    if (copy) {
+	memcpy(copy, data, len);
+	memmove(&e->wb[pos + 1], &e->wb[pos],
+		(e->wb_count - pos) * sizeof(fd_wb_t));
+	e->wb[pos].off = off;
+	e->wb[pos].len = len;
+	e->wb[pos].data = copy;
+	e->wb_count++;
+	res = len;
+
+	/* write out the run around it once large enough */
+	run = len;
+	for (first = pos; first > 0 &&
+	     e->wb[first - 1].off + e->wb[first - 1].len == e->wb[first].off;
+	     first--)
+	    run += e->wb[first - 1].len;
+	for (last = pos; last + 1 < e->wb_count &&
+	     e->wb[last].off + e->wb[last].len == e->wb[last + 1].off; last++)
+	    run += e->wb[last + 1].len;
+	if (run >= WB_RUN)
+	    wb_write(e, first, last);
+    } else {
+	wb_flush(e);
+	res = backend_pwrite(fd, data, len, (off64_t) off);
+    }
+
+    /* report errors of kept WRITEs, the client must send them again */
+    if (e->wb_err != 0) {
+	errno = e->wb_err;
+	e->wb_err = 0;
+	res = -1;
+	regenerate_write_verifier();
+    }
+    UNLOCK(e->wb_lock);
+
+    return res;
+#else
+    return backend_pwrite(fd, data, len, (off64_t) off);
+#endif
+}
+
+/*
+ * write out kept WRITEs to a file before it is read or truncated
+ * errors are left for the next WRITE or COMMIT
+ */
+void fd_flush_behind(nfs_fh3 nfh)
+{
+#ifdef WANT_WRITE_BEHIND
+    unfs3_fh_t fh;
+    int idx;
+
+    if (fd_cache_writers == 0)
+	return;
+
+    fh = fh_decode(&nfh);
+    LOCK(fd_cache_lock);
+    idx = idx_by_fh(&fh, UNFS3_FD_WRITE);
+    if (idx == -1 || fd_cache[idx].fd == -1) {
+	UNLOCK(fd_cache_lock);
+	return;
+    }
+    fd_cache[idx].ref++;
+    UNLOCK(fd_cache_lock);
+
+    LOCK(fd_cache[idx].wb_lock);
+    wb_flush(&fd_cache[idx]);
+    UNLOCK(fd_cache[idx].wb_lock);
+
+    LOCK(fd_cache_lock);
+    fd_cache[idx].ref--;
+    UNLOCK(fd_cache_lock);
+#endif
+}
+
+/*
+ * find the end of the kept WRITEs to a file, 0 if there are none
+ */
+uint64 fd_behind_end(uint32 dev, uint64 ino)
+{
+    uint64 end = 0;
+
+#ifdef WANT_WRITE_BEHIND
+    fd_cache_t *e;
+    int idx;
+
+    if (fd_cache_writers == 0)
 	return 0;
+
+    LOCK(fd_cache_lock);
+    for (idx = fd_hash_fh[fh_bucket(dev, ino)]; idx != -1;
+	 idx = fd_cache[idx].fh_next)
+	if (fd_cache[idx].kind == UNFS3_FD_WRITE && fd_cache[idx].fd != -1 &&
+	    !fd_cache[idx].closing && fd_cache[idx].dev == dev &&
+	    fd_cache[idx].ino == ino)
+	    break;
+    if (idx == -1) {
+	UNLOCK(fd_cache_lock);
+	return 0;
+    }
+    fd_cache[idx].ref++;
+    UNLOCK(fd_cache_lock);
+
+    /* kept WRITEs are sorted and do not overlap */
+    e = &fd_cache[idx];
+    LOCK(e->wb_lock);
+    if (e->wb_count > 0)
+	end = e->wb[e->wb_count - 1].off + e->wb[e->wb_count - 1].len;
+    UNLOCK(e->wb_lock);
+
+    LOCK(fd_cache_lock);
+    fd_cache[idx].ref--;
+    UNLOCK(fd_cache_lock);
+#endif
+
+    return end;
+}
+
+/*
+ * follow the READs of a cached fd and read ahead of streams
+ */
+void fd_readahead(int fd, uint64 off, uint32 count)
+{
+#if HAVE_POSIX_FADVISE == 1
+    uint64 end = off + count, ahead = 0, ahead_len = 0;
+    uint64 drop = 0, drop_len = 0, last;
+    int64 stride = 0;
+    int idx, run, i, first = 0;
+    fd_cache_t *e;
+
+    LOCK(fd_cache_lock);
+    idx = idx_by_fd(fd, UNFS3_FD_READ);
+    if (idx == -1) {
+	UNLOCK(fd_cache_lock);
+	return;
+    }
+    e = &fd_cache[idx];
+
+    last = e->ra_last;
+    if (off == e->ra_next) {
+	/* a strided stream may have turned sequential */
+	if (e->ra_stride != 0)
+	    fd_cache_ra_reset(idx, off);
+	e->ra_run++;
+    } else if (e->ra_stride != 0 && off > last &&
+	       off - last == (uint64) e->ra_stride)
+	e->ra_run++;
+    else {
+	/* a new stream, the distance may be its stride */
+	fd_cache_ra_reset(idx, off);
+	if (off > last)
+	    e->ra_stride = off - last;
+    }
+
+    e->ra_last = off;
+    e->ra_next = end;
+    run = e->ra_run;
+    stride = e->ra_stride;
+
+    if (run >= RA_MIN_RUN && stride == 0) {
+	/* window grows with the length of the stream */
+	ahead = count << (run < 8 ? run : 8);
+	if (ahead > RA_MAX)
+	    ahead = RA_MAX;
+	ahead += end;
+	if (ahead > e->ra_end) {
+	    ahead_len = ahead - (e->ra_end > end ? e->ra_end : end);
+	    e->ra_end = ahead;
+	    ahead -= ahead_len;
+	}
+
+	/* drop what is far behind a one-pass stream */
+	if (end - e->ra_start > RA_ONEPASS && off > RA_BEHIND &&
+	    off - RA_BEHIND > e->ra_drop + RA_BEHIND) {
+	    drop = e->ra_drop;
+	    drop_len = off - RA_BEHIND - drop;
+	    e->ra_drop = off - RA_BEHIND;
+	}
+    } else if (run >= RA_MIN_RUN) {
+	/* the first time all strides ahead, then the one coming up */
+	first = (run == RA_MIN_RUN) ? 1 : RA_STRIDES;
+    }
+    UNLOCK(fd_cache_lock);
+
+    if (ahead_len > 0)
+	posix_fadvise(fd, ahead, ahead_len, POSIX_FADV_WILLNEED);
+    if (drop_len > 0)
+	posix_fadvise(fd, drop, drop_len, POSIX_FADV_DONTNEED);
+    for (i = first; i > 0 && i <= RA_STRIDES; i++)
+	posix_fadvise(fd, off + i * stride, count, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+ * find the generation number of an open file
+ * returns FALSE if there is no fd for the inode
+ */
+int fd_cache_gen(uint32 dev, uint64 ino, uint32 * gen)
+{
+    int idx, found = FALSE;
+
+    LOCK(fd_cache_lock);
+    for (idx = fd_hash_fh[fh_bucket(dev, ino)]; idx != -1;
+	 idx = fd_cache[idx].fh_next)
+	if (fd_cache[idx].fd != -1 && !fd_cache[idx].closing &&
+	    fd_cache[idx].dev == dev && fd_cache[idx].ino == ino) {
+	    *gen = fd_cache[idx].gen;
+	    found = TRUE;
+	    break;
+	}
+    UNLOCK(fd_cache_lock);
+
+    return found;
 }
 
 /*
@@ -343,9 +1044,12 @@ void fd_cache_purge(void)
 {
     int i;
 
+    LOCK(fd_cache_lock);
+
     /* close any open file descriptors we still have */
-    for (i = 0; i < FD_ENTRIES; i++) {
-	if (fd_cache[i].use != 0) {
+    for (i = 0; i < fd_entries; i++) {
+	if (fd_cache[i].use != 0 && fd_cache[i].ref == 0 &&
+	    !fd_cache[i].closing) {
 	    if (fd_cache_del(i, TRUE) == -1)
 		logmsg(LOG_CRIT,
 		       "Error during shutdown fsync/close for dev %lu, inode %lu",
@@ -353,32 +1057,58 @@ void fd_cache_purge(void)
 
 	}
     }
+
+    UNLOCK(fd_cache_lock);
 }
 
 /*
  * close inactive fds
+ *
+ * the LRU list is ordered by last use, so it is walked from the oldest
+ * entry up to the first one still active; idle entries are collected
+ * under the lock and closed one by one, fd_cache_del drops the lock
+ * while writing out and syncing
  */
 void fd_cache_close_inactive(void)
 {
     time_t now;
-    int i;
+    int idle[FD_CLOSE_BATCH];
+    int i, idx, n = 0;
     int found_error = 0;
     int active_error = 0;
 
+    LOCK(fd_cache_lock);
+
     now = time(NULL);
-    for (i = 0; i < FD_ENTRIES; i++) {
-	/* Check for inactive open fds */
-	if (fd_cache[i].use && fd_cache[i].fd != -1 &&
-	    fd_cache[i].use + INACTIVE_TIMEOUT < now) {
-	    fd_cache_del(i, TRUE);
-	}
+    for (idx = fd_lru_head; idx != -1; idx = fd_cache[idx].lru_next) {
+	/* the rest has been used since */
+	if (fd_cache[idx].use + INACTIVE_TIMEOUT >= now)
+	    break;
 
 	/* Check for inactive pending errors */
-	if (fd_cache[i].use && fd_cache[i].fd == -1) {
+	if (fd_cache[idx].fd == -1) {
 	    found_error = 1;
-	    if (fd_cache[i].use + PENDING_ERROR_TIMEOUT > now)
+	    if (fd_cache[idx].use + PENDING_ERROR_TIMEOUT > now)
 		active_error = 1;
-	}
+	} else if (fd_cache[idx].ref == 0 && !fd_cache[idx].closing &&
+		   n < FD_CLOSE_BATCH)
+	    idle[n++] = idx;
+    }
+
+    /* pending errors after the walk are recent */
+    if (idx != -1 && found_error && !active_error)
+	for (i = 0; i < fd_entries; i++)
+	    if (fd_cache[i].use && fd_cache[i].fd == -1 &&
+		fd_cache[i].use + PENDING_ERROR_TIMEOUT > now)
+		active_error = 1;
+
+    /* entries may have been used or reused while the lock was dropped */
+    for (i = 0; i < n; i++) {
+	idx = idle[i];
+	if (fd_cache[idx].use && fd_cache[idx].fd != -1 &&
+	    fd_cache[idx].ref == 0 && !fd_cache[idx].closing &&
+	    fd_cache[idx].use + INACTIVE_TIMEOUT < now)
+	    fd_cache_del(idx, TRUE);
     }
 
     if (found_error && !active_error) {
@@ -388,11 +1118,14 @@ void fd_cache_close_inactive(void)
 	   will be written again. In this case, we throw away the errors, and 
 	   change the server verifier. If clients has pending COMMITs, they
 	   will notify the changed verifier and re-send. */
-	for (i = 0; i < FD_ENTRIES; i++) {
-	    if (fd_cache[i].use && fd_cache[i].fd == -1) {
+	for (i = 0; i < fd_entries; i++) {
+	    if (fd_cache[i].use && fd_cache[i].fd == -1 &&
+		!fd_cache[i].closing) {
 		fd_cache_del(i, FALSE);
 	    }
 	}
 	regenerate_write_verifier();
     }
+
+    UNLOCK(fd_cache_lock);
 }
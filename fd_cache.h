@@ -17,12 +17,25 @@
 /* statistics */
 extern int fd_cache_readers;
 extern int fd_cache_writers;
+extern int fd_cache_hit;
+extern int fd_cache_miss;
+extern int fd_cache_evict;
+extern int fd_cache_forced;
 
-void fd_cache_init(void);
+/* default number of entries */
+#define FD_ENTRIES	256
+
+int fd_cache_init(int entries);
 
 int fd_open(const char *path, nfs_fh3 fh, int kind, int allow_caching);
 int fd_close(int fd, int kind, int really_close);
 int fd_sync(nfs_fh3 nfh);
+int fd_pwrite(int fd, const char *data, uint32 len, uint64 off,
+	      int stable);
+void fd_flush_behind(nfs_fh3 nfh);
+uint64 fd_behind_end(uint32 dev, uint64 ino);
+void fd_readahead(int fd, uint64 off, uint32 count);
+int fd_cache_gen(uint32 dev, uint64 ino, uint32 *gen);
 void fd_cache_purge(void);
 void fd_cache_close_inactive(void);
 
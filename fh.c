@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <assert.h>
 
 #if HAVE_LINUX_EXT2_FS_H == 1
@@ -37,24 +38,97 @@
 #include "daemon.h"
 #include "fh.h"
 #include "backend.h"
+#include "user.h"
+#include "fd_cache.h"
+#include "worker.h"
+#include "context.h"
+#include "resolve.h"
 #include "Config/exports.h"
 
+#if HAVE_NAME_TO_HANDLE_AT == 1 && !defined(WIN32)
+#define WANT_KERNEL_FH 1
+#endif
+
 /*
- * hash function for inode numbers
+ * --------------------------------
+ * INODE GENERATION NUMBER HANDLING
+ * --------------------------------
  */
-#define FH_HASH(n) ((n ^ (n >> 8) ^ (n >> 16) ^ (n >> 24) ^ (n >> 32) ^ (n >> 40) ^ (n >> 48) ^ (n >> 56)) & 0xFF)
+
+#if !defined(HAVE_STRUCT_STAT_ST_GEN) && defined(HAVE_LINUX_EXT2_FS_H)
 
 /*
- * stat cache
+ * getting the generation number takes an open() and an ioctl() as
+ * root; numbers are kept by device and inode, and reused as long as
+ * the change time and type of the inode stay the same
  */
-int st_cache_valid = FALSE;
-backend_statstruct st_cache;
+
+/* number of entries in generation cache */
+#define GEN_ENTRIES	4096
+
+/* nanoseconds of the change time, where the stat buffer has them */
+#if HAVE_STRUCT_STAT_ST_CTIM == 1 && !defined(AFS_SUPPORT)
+#define GEN_CTIME_NSEC(buf) ((buf).st_ctim.tv_nsec)
+#else
+#define GEN_CTIME_NSEC(buf) 0
+#endif
+
+typedef struct {
+    uint32 dev;			/* device */
+    uint64 ino;			/* inode */
+    time_t ctime;		/* change time */
+    long ctime_nsec;
+    mode_t mode;		/* type and permissions */
+    uint32 gen;			/* generation number */
+} gen_cache_t;
+
+static gen_cache_t gen_cache[GEN_ENTRIES];
+
+/* protects cache entries */
+DEFINE_LOCK(gen_cache_lock);
+
+static gen_cache_t *gen_cache_entry(backend_statstruct * buf)
+{
+    uint64 n = buf->st_ino ^ ((uint64) buf->st_dev << 20);
+
+    return &gen_cache[(n ^ (n >> 12) ^ (n >> 32)) % GEN_ENTRIES];
+}
 
 /*
- * --------------------------------
- * INODE GENERATION NUMBER HANDLING
- * --------------------------------
+ * look up generation number, returns FALSE if not cached
  */
+static int gen_cache_get(backend_statstruct * buf, uint32 * gen)
+{
+    gen_cache_t *entry = gen_cache_entry(buf);
+    int found;
+
+    LOCK(gen_cache_lock);
+    found = entry->ino == buf->st_ino && entry->dev == buf->st_dev &&
+	entry->ctime == buf->st_ctime &&
+	entry->ctime_nsec == GEN_CTIME_NSEC(*buf) &&
+	entry->mode == buf->st_mode;
+    if (found)
+	*gen = entry->gen;
+    UNLOCK(gen_cache_lock);
+
+    return found;
+}
+
+static void gen_cache_put(backend_statstruct * buf, uint32 gen)
+{
+    gen_cache_t *entry = gen_cache_entry(buf);
+
+    LOCK(gen_cache_lock);
+    entry->dev = buf->st_dev;
+    entry->ino = buf->st_ino;
+    entry->ctime = buf->st_ctime;
+    entry->ctime_nsec = GEN_CTIME_NSEC(*buf);
+    entry->mode = buf->st_mode;
+    entry->gen = gen;
+    UNLOCK(gen_cache_lock);
+}
+
+#endif
 
 /*
  * obtain inode generation number if possible
@@ -80,36 +154,35 @@ uint32 get_gen(backend_statstruct obuf, U(int fd), U(const char *path))
     if (!S_ISREG(obuf.st_mode) && !S_ISDIR(obuf.st_mode))
 	return 0;
 
-    euid = backend_geteuid();
-    egid = backend_getegid();
-    backend_setegid(0);
-    backend_seteuid(0);
+    if (gen_cache_get(&obuf, &gen))
+	return gen;
+
+    /* an open fd keeps the inode from being reused */
+    if (fd == FD_NONE && fd_cache_gen(obuf.st_dev, obuf.st_ino, &gen))
+	return gen;
 
     if (fd != FD_NONE) {
 	res = ioctl(fd, EXT2_IOC_GETVERSION, &gen);
 	if (res == -1)
 	    gen = 0;
     } else {
+	switch_save(&euid, &egid);
 	newfd = backend_open(path, O_RDONLY);
-	if (newfd == -1)
-	    gen = 0;
-	else {
-	    res = ioctl(newfd, EXT2_IOC_GETVERSION, &gen);
-	    close(newfd);
+	switch_restore(euid, egid);
 
-	    if (res == -1)
-		gen = 0;
-	}
-    }
+	/* try again next time */
+	if (newfd == -1)
+	    return 0;
 
-    backend_setegid(egid);
-    backend_seteuid(euid);
+	res = ioctl(newfd, EXT2_IOC_GETVERSION, &gen);
+	close(newfd);
 
-    if (backend_geteuid() != euid || backend_getegid() != egid) {
-	logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
-	daemon_exit(CRISIS);
+	if (res == -1)
+	    gen = 0;
     }
 
+    gen_cache_put(&obuf, gen);
+
     return gen;
 #endif
 
@@ -118,6 +191,304 @@ uint32 get_gen(backend_statstruct obuf, U(int fd), U(const char *path))
 #endif
 }
 
+/*
+ * -------------------
+ * KERNEL FILE HANDLES
+ * -------------------
+ */
+
+#ifdef WANT_KERNEL_FH
+
+/*
+ * with CAP_DAC_READ_SEARCH, Linux opens a file system object by the
+ * handle name_to_handle_at() gave for it, however deep it is and
+ * wherever it has been renamed to; the path is read back from /proc
+ *
+ * directories carry their own handle; other objects carry the handle
+ * of their directory and are looked up there by inode number, since
+ * the kernel cannot name a file opened by handle that is not in the
+ * dentry cache
+ */
+
+/* number of file systems to keep a directory open on */
+#define FH_MOUNTS	32
+
+static struct {
+    uint32 dev;
+    int fd;
+    char *dir;			/* path fd was opened on */
+} fh_mounts[FH_MOUNTS];
+static int fh_mount_count = 0;
+
+/* protects the mount table */
+DEFINE_LOCK(fh_mount_lock);
+
+/* kernel file handles are made for new filehandles */
+static int fh_kernel = FALSE;
+
+typedef union {
+    struct file_handle fh;
+    char buf[sizeof(struct file_handle) + FH_MAXLEN];
+} fh_kernel_t;
+
+/*
+ * get an open directory on the file system of dev, needed to open
+ * handles; path is opened if given, otherwise an export on dev
+ * open_by_handle_at refuses O_PATH descriptors here
+ *
+ * a kept directory is dropped once its path leads elsewhere, so that
+ * an unmounted file system is let go and a reused device number is
+ * not taken for the old one; callers get a duplicate to close
+ */
+static int fh_kernel_mount(uint32 dev, const char *path)
+{
+    exports list;
+    backend_statstruct buf;
+    struct stat st;
+    const char *dir = NULL;
+    int i, fd = -1;
+    uid_t euid;
+    gid_t egid;
+
+    switch_save(&euid, &egid);
+    LOCK(fh_mount_lock);
+    for (i = 0; i < fh_mount_count; i++)
+	if (fh_mounts[i].dev == dev) {
+	    if (fstat(fh_mounts[i].fd, &st) != -1 &&
+		backend_lstat(fh_mounts[i].dir, &buf) != -1 &&
+		buf.st_dev == st.st_dev && buf.st_ino == st.st_ino &&
+		buf.st_dev == dev) {
+		fd = fh_mounts[i].fd;
+		break;
+	    }
+	    close(fh_mounts[i].fd);
+	    free(fh_mounts[i].dir);
+	    fh_mounts[i] = fh_mounts[--fh_mount_count];
+	    break;
+	}
+
+    if (fd == -1 && fh_mount_count < FH_MOUNTS) {
+	if (path) {
+	    fd = open(path, O_RDONLY | O_DIRECTORY);
+	    dir = path;
+	} else
+	    for (list = exports_nfslist; list && fd == -1;
+		 list = list->ex_next)
+		if (backend_lstat(list->ex_dir, &buf) != -1 &&
+		    buf.st_dev == dev) {
+		    fd = open(list->ex_dir, O_RDONLY | O_DIRECTORY);
+		    dir = list->ex_dir;
+		}
+
+	if (fd != -1) {
+	    fh_mounts[fh_mount_count].dir = strdup(dir);
+	    if (!fh_mounts[fh_mount_count].dir) {
+		close(fd);
+		fd = -1;
+	    } else {
+		fh_mounts[fh_mount_count].dev = dev;
+		fh_mounts[fh_mount_count].fd = fd;
+		fh_mount_count++;
+	    }
+	}
+    }
+    if (fd != -1)
+	fd = dup(fd);
+    UNLOCK(fh_mount_lock);
+    switch_restore(euid, egid);
+
+    return fd;
+}
+
+/*
+ * check whether a directory is kept for dev, without checking it
+ */
+static int fh_kernel_known(uint32 dev)
+{
+    int i, found = FALSE;
+
+    LOCK(fh_mount_lock);
+    for (i = 0; i < fh_mount_count && !found; i++)
+	found = (fh_mounts[i].dev == dev);
+    UNLOCK(fh_mount_lock);
+
+    return found;
+}
+
+/*
+ * enable kernel file handles if they can be opened
+ * exports_parse must be called before
+ */
+int fh_kernel_init(void)
+{
+    fh_kernel_t handle;
+    exports list;
+    int mnt, fd;
+
+    for (list = exports_nfslist; list; list = list->ex_next) {
+	handle.fh.handle_bytes = FH_MAXLEN - 1;
+	if (name_to_handle_at(AT_FDCWD, list->ex_dir, &handle.fh, &mnt, 0)
+	    == -1)
+	    continue;
+
+	mnt = open(list->ex_dir, O_RDONLY | O_DIRECTORY);
+	if (mnt == -1)
+	    continue;
+	fd = open_by_handle_at(mnt, &handle.fh, O_PATH);
+	close(mnt);
+
+	if (fd != -1) {
+	    close(fd);
+	    fh_kernel = TRUE;
+	    return 0;
+	}
+
+	/* needs CAP_DAC_READ_SEARCH */
+	if (errno == EPERM)
+	    return -1;
+    }
+
+    return -1;
+}
+
+/*
+ * store the kernel file handle for an object in fh
+ * returns FALSE if the file system has none
+ */
+static int fh_kernel_comp(const char *path, backend_statstruct * buf,
+			  unfs3_fh_t * fh)
+{
+    fh_kernel_t handle;
+    char dir[NFS_MAXPATHLEN];
+    const char *last;
+    int mnt, flags = FH_KERNEL;
+
+    if (!fh_kernel)
+	return FALSE;
+
+    if (!S_ISDIR(buf->st_mode)) {
+	last = strrchr(path, '/');
+	if (!last)
+	    return FALSE;
+	if (last == path)
+	    strcpy(dir, "/");
+	else {
+	    memcpy(dir, path, last - path);
+	    dir[last - path] = 0;
+	}
+	path = dir;
+	flags |= FH_KPARENT;
+    }
+
+    handle.fh.handle_bytes = FH_MAXLEN - 1;
+    if (name_to_handle_at(AT_FDCWD, path, &handle.fh, &mnt, 0) == -1 ||
+	handle.fh.handle_type < 0 || handle.fh.handle_type > 255)
+	return FALSE;
+
+    /* the directory is checked when a handle is opened */
+    if (!fh_kernel_known(buf->st_dev)) {
+	mnt = fh_kernel_mount(buf->st_dev, path);
+	if (mnt == -1)
+	    return FALSE;
+	close(mnt);
+    }
+
+    fh->len = flags | handle.fh.handle_bytes;
+    fh->inos[0] = handle.fh.handle_type;
+    memcpy(fh->inos + 1, handle.fh.f_handle, handle.fh.handle_bytes);
+
+    return TRUE;
+}
+
+/*
+ * resolve a kernel file handle into a path
+ */
+static char *fh_kernel_decomp(const unfs3_fh_t * fh, char *result,
+			      unfs3_ctx_t * ctx)
+{
+    fh_kernel_t handle;
+    backend_dirstream *search;
+    struct dirent *entry;
+    char link[32];
+    int mnt, fd, len;
+    uid_t euid;
+    gid_t egid;
+
+    mnt = fh_kernel_mount(fh->dev, NULL);
+    if (mnt == -1)
+	return NULL;
+
+    handle.fh.handle_bytes = FH_KLEN(fh->len);
+    handle.fh.handle_type = fh->inos[0];
+    memcpy(handle.fh.f_handle, fh->inos + 1, handle.fh.handle_bytes);
+
+    /* needs CAP_DAC_READ_SEARCH, which client ids do not have */
+    switch_save(&euid, &egid);
+    fd = open_by_handle_at(mnt, &handle.fh, O_PATH);
+    switch_restore(euid, egid);
+    close(mnt);
+    if (fd == -1)
+	return NULL;
+
+    sprintf(link, "/proc/self/fd/%i", fd);
+    len = readlink(link, result, NFS_MAXPATHLEN - 1);
+    close(fd);
+    if (len <= 0 || result[0] != '/')
+	return NULL;
+    result[len] = 0;
+
+    if (fh->len & FH_KPARENT) {
+	/* look for the object in its directory */
+	search = backend_opendir(result);
+	if (!search)
+	    return NULL;
+
+	if (len == 1)
+	    len = 0;
+	while ((entry = backend_readdir(search)) != NULL)
+	    if (entry->d_ino == fh->ino &&
+		len + strlen(entry->d_name) + 1 < NFS_MAXPATHLEN) {
+		sprintf(result + len, "/%s", entry->d_name);
+		break;
+	    }
+	backend_closedir(search);
+
+	if (!entry)
+	    return NULL;
+    }
+
+    /* removed or renamed meanwhile */
+    if (backend_lstat(result, &ctx->st) == -1 ||
+	ctx->st.st_dev != fh->dev || ctx->st.st_ino != fh->ino) {
+	ctx->st_valid = FALSE;
+	return NULL;
+    }
+
+    ctx->st_valid = TRUE;
+    return result;
+}
+
+#else				       /* WANT_KERNEL_FH */
+
+int fh_kernel_init(void)
+{
+    return -1;
+}
+
+static int fh_kernel_comp(U(const char *path), U(backend_statstruct * buf),
+			  U(unfs3_fh_t * fh))
+{
+    return FALSE;
+}
+
+static char *fh_kernel_decomp(U(const unfs3_fh_t * fh), U(char *result),
+			      U(unfs3_ctx_t * ctx))
+{
+    return NULL;
+}
+
+#endif				       /* WANT_KERNEL_FH */
+
 /*
  * --------------------------------
  * FILEHANDLE COMPOSITION FUNCTIONS
@@ -165,10 +536,10 @@ static const unfs3_fh_t invalid_fh = { 0, 0, 0, 0, 0, {0} };
 /*
  * compose a filehandle for a given path
  * path:     path to compose fh for
- * rqstp:    If not NULL, generate special FHs for removables
+ * ctx:      If not NULL, generate special FHs for removables
  * need_dir: if not 0, path must point to a directory
  */
-unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir)
+unfs3_fh_t fh_comp_raw(const char *path, unfs3_ctx_t * ctx, int need_dir)
 {
     char work[NFS_MAXPATHLEN];
     unfs3_fh_t fh;
@@ -181,15 +552,15 @@ unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir)
 
     /* special case for removable device export point: return preset fsid and 
        inod 1. */
-    if (rqstp && export_point(path)) {
+    if (ctx && export_point(path)) {
 	uint32 fsid;
 
-	if (exports_options(path, rqstp, NULL, &fsid) == -1) {
+	if (exports_options(path, ctx, NULL, &fsid) == -1) {
 	    /* Shouldn't happen, unless the exports file changed after the
 	       call to export_point() */
 	    return invalid_fh;
 	}
-	if (exports_opts & OPT_REMOVABLE) {
+	if (ctx->opts & OPT_REMOVABLE) {
 	    fh.dev = fsid;
 	    /* There's a small risk that the file system contains other file
 	       objects with st_ino = 1. This should be fairly uncommon,
@@ -221,6 +592,9 @@ unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir)
     fh.ino = buf.st_ino;
     fh.gen = backend_get_gen(buf, FD_NONE, path);
 
+    if (fh_kernel_comp(path, &buf, &fh))
+	return fh;
+
     /* special case for root directory */
     if (strcmp(path, "/") == 0)
 	return fh;
@@ -253,65 +627,91 @@ unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir)
     return fh;
 }
 
+/*
+ * get number of bytes used in inos array
+ */
+static u_int fh_inos_len(const unfs3_fh_t * fh)
+{
+    if (fh->len & FH_KERNEL)
+	return FH_KLEN(fh->len) + 1;
+
+    return fh->len;
+}
+
 /*
  * get real length of a filehandle
  */
 u_int fh_length(const unfs3_fh_t * fh)
 {
-    return fh->len + sizeof(fh->len) + sizeof(fh->dev) + sizeof(fh->ino) +
-	sizeof(fh->gen) + sizeof(fh->pwhash);
+    return fh_inos_len(fh) + sizeof(fh->len) + sizeof(fh->dev) +
+	sizeof(fh->ino) + sizeof(fh->gen) + sizeof(fh->pwhash);
 }
 
 /*
- * extend a filehandle with a given device, inode, and generation number
+ * extend a filehandle by an object in its directory
+ * path: path to the object
+ * buf:  stat buffer of the object
  */
-unfs3_fh_t *fh_extend(nfs_fh3 nfh, uint32 dev, uint64 ino, uint32 gen)
+unfs3_fh_t *fh_extend(nfs_fh3 nfh, const char *path, backend_statstruct * buf,
+		      uint32 gen, unfs3_ctx_t * ctx)
 {
-    static unfs3_fh_t new;
-
-    new = fh_decode(&nfh);
-
-    if (new.len == 0) {
-	char *path;
+    unfs3_fh_t *new = &ctx->fh;
+
+    *new = fh_decode(&nfh);
+
+    if (!fh_kernel_comp(path, buf, new)) {
+	if (new->len == 0) {
+	    char *exp;
+
+	    exp = export_point_from_fsid(new->dev, NULL, NULL);
+	    if (exp != NULL) {
+		/* Our FH to extend refers to a removable device export
+		   point, which lacks .inos. We need to construct a real FH
+		   to extend, which can be done by passing ctx=NULL to
+		   fh_comp_raw. */
+		*new = fh_comp_raw(exp, NULL, FH_ANY);
+		if (!fh_valid(*new))
+		    return NULL;
+	    }
+	}
 
-	path = export_point_from_fsid(new.dev, NULL, NULL);
-	if (path != NULL) {
-	    /* Our FH to extend refers to a removable device export point,
-	       which lacks .inos. We need to construct a real FH to extend,
-	       which can be done by passing rqstp=NULL to fh_comp_raw. */
-	    new = fh_comp_raw(path, NULL, FH_ANY);
-	    if (!fh_valid(new))
+	if (new->len & FH_KERNEL) {
+	    /* no kernel handle below one that has, hash the whole path */
+	    *new = fh_comp_raw(path, NULL, FH_ANY);
+	    if (!fh_valid(*new))
+		return NULL;
+	} else {
+	    if (new->len == FH_MAXLEN)
 		return NULL;
+
+	    new->inos[new->len] = FH_HASH(buf->st_ino);
+	    new->len++;
 	}
     }
 
-    if (new.len == FH_MAXLEN)
-	return NULL;
-
-    new.dev = dev;
-    new.ino = ino;
-    new.gen = gen;
-    new.pwhash = export_password_hash;
-    new.inos[new.len] = FH_HASH(ino);
-    new.len++;
+    new->dev = buf->st_dev;
+    new->ino = buf->st_ino;
+    new->gen = gen;
+    new->pwhash = ctx->pwhash;
 
-    return &new;
+    return new;
 }
 
 /*
- * get post_op_fh3 extended by device, inode, and generation number
+ * get post_op_fh3 extended by an object in the directory
  */
-post_op_fh3 fh_extend_post(nfs_fh3 fh, uint32 dev, uint64 ino, uint32 gen)
+post_op_fh3 fh_extend_post(nfs_fh3 fh, const char *path,
+			   backend_statstruct * buf, uint32 gen,
+			   unfs3_ctx_t * ctx)
 {
     post_op_fh3 post;
     unfs3_fh_t *new;
-    static char buffer[FH_MAXBUF];
 
-    new = fh_extend(fh, dev, ino, gen);
+    new = fh_extend(fh, path, buf, gen, ctx);
 
     if (new) {
 	post.handle_follows = TRUE;
-	post.post_op_fh3_u.handle = fh_encode(new, buffer);
+	post.post_op_fh3_u.handle = fh_encode(new, ctx->fhbuf);
     } else
 	post.handle_follows = FALSE;
 
@@ -321,7 +721,8 @@ post_op_fh3 fh_extend_post(nfs_fh3 fh, uint32 dev, uint64 ino, uint32 gen)
 /*
  * extend a filehandle given a path and needed type
  */
-post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type)
+post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type,
+			   unfs3_ctx_t * ctx)
 {
     post_op_fh3 result;
     backend_statstruct buf;
@@ -329,16 +730,16 @@ post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type)
 
     res = backend_lstat(path, &buf);
     if (res == -1 || (buf.st_mode & type) != type) {
-	st_cache_valid = FALSE;
+	ctx->st_valid = FALSE;
 	result.handle_follows = FALSE;
 	return result;
     }
 
-    st_cache_valid = TRUE;
-    st_cache = buf;
+    ctx->st_valid = TRUE;
+    ctx->st = buf;
 
-    return fh_extend_post(fh, buf.st_dev, buf.st_ino,
-			  backend_get_gen(buf, FD_NONE, path));
+    return fh_extend_post(fh, path, &buf,
+			  backend_get_gen(buf, FD_NONE, path), ctx);
 }
 
 /*
@@ -356,6 +757,8 @@ post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type)
  * inos: array of max FH_MAXLEN directories needed to traverse to reach
  *       object, for each name, an 8 bit hash of the inode number is stored
  *
+ * with FH_KERNEL set in len, inos holds a kernel file handle instead
+ *
  * - search functions traverse directory structure from the root looking
  *   for directories matching the inode information stored
  * - if such a directory is found, we descend into it trying to locate the
@@ -368,9 +771,10 @@ post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type)
  * pos:    position in filehandles path inode array
  * lead:   current directory for search
  * result: where to store path if seach is complete
+ * ctx:    request context, its stat cache is filled on success
  */
 static int fh_rec(const unfs3_fh_t * fh, int pos, const char *lead,
-		  char *result)
+		  char *result, unfs3_ctx_t * ctx)
 {
     backend_dirstream *search;
     struct dirent *entry;
@@ -407,8 +811,8 @@ static int fh_rec(const unfs3_fh_t * fh, int pos, const char *lead,
 		/* found the object */
 		sprintf(result, "%s/%s", lead + 1, entry->d_name);
 		/* update stat cache */
-		st_cache_valid = TRUE;
-		st_cache = buf;
+		ctx->st_valid = TRUE;
+		ctx->st = buf;
 		matches++;
 #ifndef WIN32
 		break;
@@ -422,7 +826,7 @@ static int fh_rec(const unfs3_fh_t * fh, int pos, const char *lead,
 		 * might be directory we're looking for,
 		 * try descending into it
 		 */
-		rec = fh_rec(fh, pos + 1, obj, result);
+		rec = fh_rec(fh, pos + 1, obj, result, ctx);
 		if (rec) {
 		    /* object was found in dir */
 		    backend_closedir(search);
@@ -449,21 +853,33 @@ static int fh_rec(const unfs3_fh_t * fh, int pos, const char *lead,
 
 /*
  * resolve a filehandle into a path
+ * the path is stored in result, which must hold NFS_MAXPATHLEN bytes
+ * ctx->fh_busy is set if the search goes on in the background
  */
-char *fh_decomp_raw(const unfs3_fh_t * fh)
+char *fh_decomp_raw(const unfs3_fh_t * fh, char *result, unfs3_ctx_t * ctx)
 {
     int rec = 0;
-    static char result[NFS_MAXPATHLEN];
 
     /* valid fh? */
     if (!fh)
 	return NULL;
 
+    if (fh->len & FH_KERNEL)
+	return fh_kernel_decomp(fh, result, ctx);
+
     /* special case for root directory */
-    if (fh->len == 0)
-	return "/";
+    if (fh->len == 0) {
+	strcpy(result, "/");
+	return result;
+    }
 
-    rec = fh_rec(fh, 0, "/", result);
+    rec = resolve_fh(fh, result, ctx);
+    if (rec == RESOLVE_OFF)
+	rec = fh_rec(fh, 0, "/", result, ctx);
+    else if (rec == RESOLVE_BUSY) {
+	ctx->fh_busy = TRUE;
+	rec = FALSE;
+    }
 
     if (rec)
 	return result;
@@ -498,10 +914,9 @@ unfs3_fh_t fh_decode(const nfs_fh3 *fh)
     memcpy(&obj.len, buf, sizeof(obj.len));
     buf += sizeof(obj.len);
 
-    assert(fh->data.data_len == (FH_MINLEN + obj.len));
+    assert(fh->data.data_len == fh_length(&obj));
 
-    if (obj.len)
-        memcpy(obj.inos, buf, obj.len);
+    memcpy(obj.inos, buf, fh_inos_len(&obj));
 
     return obj;
 }
@@ -532,8 +947,7 @@ nfs_fh3 fh_encode(const unfs3_fh_t *fh, char *buffer)
     buf += sizeof(fh->pwhash);
     memcpy(buf, &fh->len, sizeof(fh->len));
     buf += sizeof(fh->len);
-    if (fh->len)
-        memcpy(buf, fh->inos, fh->len);
+    memcpy(buf, fh->inos, fh_inos_len(fh));
 
     return handle;
 }
@@ -27,27 +27,44 @@ typedef struct {
 	unsigned char	inos[FH_MAXLEN];
 } unfs3_fh_t;
 
+/*
+ * hash function for inode numbers
+ */
+#define FH_HASH(n) ((n ^ (n >> 8) ^ (n >> 16) ^ (n >> 24) ^ (n >> 32) ^ (n >> 40) ^ (n >> 48) ^ (n >> 56)) & 0xFF)
+
+/*
+ * flags in len of filehandles that hold a kernel file handle
+ * instead of inode hashes: inos[0] is the handle type, followed by
+ * FH_KLEN(len) bytes of handle
+ */
+#define FH_KERNEL	0x80
+#define FH_KPARENT	0x40		/* handle is of the parent directory */
+#define FH_KLEN(len)	((len) & 0x3f)
+
 #define FH_ANY 0
 #define FH_DIR 1
 
 #define FD_NONE (-1)			/* used for get_gen */
 
-extern int st_cache_valid;		/* stat value is valid */
-extern backend_statstruct st_cache;	/* cached stat value */
-
 uint32 get_gen(backend_statstruct obuf, int fd, const char *path);
 
 int nfh_valid(nfs_fh3 fh);
 int fh_valid(unfs3_fh_t fh);
 
-unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir);
+int fh_kernel_init(void);
+
+unfs3_fh_t fh_comp_raw(const char *path, unfs3_ctx_t *ctx, int need_dir);
 u_int fh_length(const unfs3_fh_t *fh);
 
-unfs3_fh_t *fh_extend(nfs_fh3 fh, uint32 dev, uint64 ino, uint32 gen);
-post_op_fh3 fh_extend_post(nfs_fh3 fh, uint32 dev, uint64 ino, uint32 gen);
-post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type);
+unfs3_fh_t *fh_extend(nfs_fh3 fh, const char *path, backend_statstruct *buf,
+		      uint32 gen, unfs3_ctx_t *ctx);
+post_op_fh3 fh_extend_post(nfs_fh3 fh, const char *path,
+			   backend_statstruct *buf, uint32 gen,
+			   unfs3_ctx_t *ctx);
+post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type,
+			   unfs3_ctx_t *ctx);
 
-char *fh_decomp_raw(const unfs3_fh_t *fh);
+char *fh_decomp_raw(const unfs3_fh_t *fh, char *result, unfs3_ctx_t *ctx);
 
 unfs3_fh_t fh_decode(const nfs_fh3 *fh);
 nfs_fh3 fh_encode(const unfs3_fh_t *fh, char *buffer);
@@ -16,6 +16,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#ifndef WIN32
+#include <syslog.h>
+#include <sys/mman.h>
+#endif				       /* WIN32 */
 
 #include "nfs.h"
 #include "fh.h"
@@ -26,86 +33,648 @@
 #include "Config/exports.h"
 #include "readdir.h"
 #include "backend.h"
+#include "worker.h"
+#include "context.h"
+#include "notify.h"
+#include "index.h"
+#include "user.h"
 
-/* number of entries in fh cache */
-#define CACHE_ENTRIES	4096
+/*
+ * paths are kept as a tree of nodes, each one a name below its parent
+ * node; nodes and names are shared by all entries below them, counted
+ * by references, and found through hash tables, so a path is stored
+ * once per component and rebuilt when looked up
+ *
+ * entries are found by hash chains on device and inode; when the cache
+ * is full, a clock hand sweeps the entries and reuses the first one not
+ * looked up since its last pass
+ *
+ * with change notification, all directories from the export point down
+ * to a checked directory are watched; events stamp the nodes they
+ * concern with a new epoch, and a directory checked in an earlier epoch
+ * is trusted, attributes included, while no node on its path has been
+ * stamped since and all those directories are still watched; other
+ * files may change through links elsewhere or through mappings, which
+ * no watch reports, and are always checked
+ */
+
+typedef struct fh_name {
+    struct fh_name *next;	/* hash chain */
+    int refs;			/* nodes using it */
+    unsigned int len;
+    char str[1];		/* not terminated */
+} fh_name_t;
+
+typedef struct fh_node {
+    struct fh_node *parent;
+    fh_name_t *name;
+    struct fh_node *next;	/* hash chain by parent and name */
+    int refs;			/* children and entries */
+    int hashed;			/* can be found by name */
+    int wd;			/* watch of directory, -1 if none */
+    int top;			/* export point, valid while watched */
+    struct fh_node *wd_next;	/* hash chain by watch */
+    uint32 moved;		/* epoch of last change of path */
+    uint32 changed;		/* epoch of last change of attributes */
+} fh_node_t;
 
 typedef struct {
     uint32 dev;			/* device */
     uint64 ino;			/* inode */
-    char path[NFS_MAXPATHLEN];	/* pathname */
-    unsigned int use;		/* last use */
+    fh_node_t *node;		/* pathname, NULL if unused */
+    int next;			/* hash chain or free list */
+    int ref;			/* used since last sweep */
+    uint32 valid;		/* epoch of last check, 0 if none */
+    backend_statstruct *st;	/* attributes at last check */
 } unfs3_cache_t;
 
-static unfs3_cache_t fh_cache[CACHE_ENTRIES];
+static unfs3_cache_t *fh_cache = NULL;
+static int fh_cache_size = 0;
+
+static int *fh_cache_hash = NULL;
+static fh_name_t **fh_name_hash = NULL;
+static fh_node_t **fh_node_hash = NULL;
+static fh_node_t **fh_wd_hash = NULL;
+static uint32 fh_cache_mask = 0;
+
+/* the root directory, parent of all nodes */
+static fh_node_t fh_root =
+    { NULL, NULL, NULL, 1, FALSE, -1, FALSE, NULL, 0, 0 };
+
+/* current epoch, entries checked up to floor are not trusted */
+static uint32 fh_epoch = 1;
+static uint32 fh_floor = 0;
+
+/* request changes and time when events were last read */
+static unsigned int fh_seen_changes = 0;
+static time_t fh_seen_time = 0;
+
+/* names changed by events, given to the inode index once unlocked */
+#define FH_MOVED_MAX	256
+
+typedef struct fh_moved {
+    struct fh_moved *next;
+    char path[1];
+} fh_moved_t;
+
+static fh_moved_t *fh_moved = NULL;
+static int fh_moved_count = 0;
+
+/* unused entries, next entry checked by the clock hand */
+static int fh_cache_free = -1;
+static int fh_cache_hand = 0;
 
 /* statistics */
 int fh_cache_max = 0;
 int fh_cache_use = 0;
 int fh_cache_hit = 0;
+int fh_cache_evict = 0;
+int fh_cache_trust = 0;
+int fh_cache_stale = 0;
+
+/*
+ * filehandles recently found to be stale, so that clients retrying one
+ * do not start a search each time; an entry goes when its inode gets a
+ * path again, when the server renames anything, and after a while for
+ * changes made by others
+ */
+#define FH_STALE_ENTRIES	1024	/* power of two */
+#define FH_STALE_TIME		30
+
+typedef struct {
+    uint32 dev;
+    uint64 ino;			/* 0 if unused */
+    uint32 gen;
+    uint32 moves;		/* renames done when found stale */
+    time_t time;
+} fh_stale_t;
+
+static fh_stale_t fh_stale[FH_STALE_ENTRIES];
+static uint32 fh_stale_moves = 0;
+
+/* protects cache entries, nodes, names, clock hand and statistics */
+DEFINE_LOCK(fh_cache_lock);
 
-/* counter for LRU */
-static unsigned int fh_cache_time = 0;
+static uint32 fh_cache_bucket(uint32 dev, uint64 ino)
+{
+    return ((uint32) (ino ^ (ino >> 32)) * 2654435761U ^ dev) & fh_cache_mask;
+}
+
+static uint32 fh_name_bucket(const char *str, unsigned int len)
+{
+    uint32 h = 2166136261U;
+
+    while (len--)
+	h = (h ^ (unsigned char) *str++) * 16777619U;
+    return h & fh_cache_mask;
+}
+
+static uint32 fh_node_bucket(fh_node_t * parent, fh_name_t * name)
+{
+    return ((uint32) ((size_t) parent >> 4) * 2654435761U ^
+	    (uint32) ((size_t) name >> 4)) & fh_cache_mask;
+}
 
 /*
- * last returned entry
- *
- * this entry must not be overwritten before the next lookup, because
- * operations such as CREATE may still be needing the path inside the
- * entry for getting directory attributes
- *
- * this is needed since fh_cache_time can roll around to 0, thus
- * making the entry evictable
+ * find a name without adding a reference
+ * returns NULL if it is not known
+ */
+static fh_name_t *fh_name_find(const char *str, unsigned int len)
+{
+    fh_name_t *name;
+
+    for (name = fh_name_hash[fh_name_bucket(str, len)]; name;
+	 name = name->next)
+	if (name->len == len && memcmp(name->str, str, len) == 0)
+	    return name;
+
+    return NULL;
+}
+
+/*
+ * get a name, adding it if needed
+ * returns NULL if out of memory
+ */
+static fh_name_t *fh_name_get(const char *str, unsigned int len)
+{
+    fh_name_t *name;
+    uint32 h;
+
+    name = fh_name_find(str, len);
+    if (!name) {
+	name = malloc(sizeof(fh_name_t) + len);
+	if (!name)
+	    return NULL;
+	h = fh_name_bucket(str, len);
+	memcpy(name->str, str, len);
+	name->len = len;
+	name->refs = 0;
+	name->next = fh_name_hash[h];
+	fh_name_hash[h] = name;
+    }
+
+    name->refs++;
+    return name;
+}
+
+static void fh_name_put(fh_name_t * name)
+{
+    fh_name_t **link;
+
+    if (--name->refs > 0)
+	return;
+
+    link = &fh_name_hash[fh_name_bucket(name->str, name->len)];
+    while (*link != name)
+	link = &(*link)->next;
+    *link = name->next;
+    free(name);
+}
+
+static void fh_node_unhash(fh_node_t * node)
+{
+    fh_node_t **link;
+
+    if (!node->hashed)
+	return;
+
+    link = &fh_node_hash[fh_node_bucket(node->parent, node->name)];
+    while (*link != node)
+	link = &(*link)->next;
+    *link = node->next;
+    node->hashed = FALSE;
+}
+
+static uint32 fh_wd_bucket(int wd)
+{
+    return ((uint32) wd * 2654435761U) & fh_cache_mask;
+}
+
+static fh_node_t *fh_wd_node(int wd)
+{
+    fh_node_t *node;
+
+    for (node = fh_wd_hash[fh_wd_bucket(wd)]; node; node = node->wd_next)
+	if (node->wd == wd)
+	    return node;
+
+    return NULL;
+}
+
+static void fh_wd_del(fh_node_t * node)
+{
+    fh_node_t **link = &fh_wd_hash[fh_wd_bucket(node->wd)];
+
+    while (*link != node)
+	link = &(*link)->wd_next;
+    *link = node->wd_next;
+    node->wd = -1;
+}
+
+static void fh_node_hash_add(fh_node_t * node)
+{
+    uint32 h = fh_node_bucket(node->parent, node->name);
+
+    node->next = fh_node_hash[h];
+    fh_node_hash[h] = node;
+    node->hashed = TRUE;
+}
+
+/*
+ * drop a reference to a node, freeing it and parents no longer used
  */
-static int fh_last_entry = -1;
+static void fh_node_put(fh_node_t * node)
+{
+    fh_node_t *parent;
+
+    /* the root starts with a reference of its own */
+    while (--node->refs == 0) {
+	parent = node->parent;
+	if (node->wd != -1) {
+	    notify_rm(node->wd);
+	    fh_wd_del(node);
+	}
+	fh_node_unhash(node);
+	fh_name_put(node->name);
+	free(node);
+	node = parent;
+    }
+}
 
 /*
- * return next pseudo-time value for LRU counter
+ * find the node for a name below parent, adding it if create is set
+ * a new node has no references
  */
-static unsigned int fh_cache_next(void)
+static fh_node_t *fh_node_child(fh_node_t * parent, const char *str,
+				unsigned int len, int create)
 {
-    return ++fh_cache_time;
+    fh_name_t *name;
+    fh_node_t *node;
+
+    name = fh_name_find(str, len);
+    if (name)
+	for (node = fh_node_hash[fh_node_bucket(parent, name)]; node;
+	     node = node->next)
+	    if (node->parent == parent && node->name == name)
+		return node;
+
+    if (!create)
+	return NULL;
+
+    node = malloc(sizeof(fh_node_t));
+    if (!node)
+	return NULL;
+    node->name = fh_name_get(str, len);
+    if (!node->name) {
+	free(node);
+	return NULL;
+    }
+    node->parent = parent;
+    node->refs = 0;
+    node->wd = -1;
+    node->top = FALSE;
+    node->wd_next = NULL;
+    node->moved = 0;
+    node->changed = 0;
+    parent->refs++;
+    fh_node_hash_add(node);
+
+    return node;
+}
+
+/*
+ * find the node for a path, adding missing nodes if create is set
+ * returns the node with a reference added, NULL if not found
+ */
+static fh_node_t *fh_node_path(const char *path, int create)
+{
+    fh_node_t *node = &fh_root, *child;
+    const char *end;
+
+    if (path[0] != '/')
+	return NULL;
+
+    while (*path) {
+	while (*path == '/')
+	    path++;
+	if (!*path)
+	    break;
+	end = strchr(path, '/');
+	if (!end)
+	    end = path + strlen(path);
+
+	child = fh_node_child(node, path, end - path, create);
+	if (!child) {
+	    /* let go of nodes added so far */
+	    node->refs++;
+	    fh_node_put(node);
+	    return NULL;
+	}
+	node = child;
+	path = end;
+    }
+
+    node->refs++;
+    return node;
+}
+
+/*
+ * write the path of a node to result
+ * returns FALSE if it does not fit into NFS_MAXPATHLEN bytes
+ */
+static int fh_node_name(fh_node_t * node, char *result)
+{
+    fh_node_t *n;
+    size_t len = 0;
+
+    if (node == &fh_root) {
+	strcpy(result, "/");
+	return TRUE;
+    }
+
+    for (n = node; n != &fh_root; n = n->parent)
+	len += n->name->len + 1;
+    if (len >= NFS_MAXPATHLEN)
+	return FALSE;
+
+    result[len] = 0;
+    for (n = node; n != &fh_root; n = n->parent) {
+	len -= n->name->len;
+	memcpy(result + len, n->name->str, n->name->len);
+	result[--len] = '/';
+    }
+
+    return TRUE;
+}
+
+/*
+ * watch the directory of a node
+ * returns FALSE if it is not watched
+ */
+static int fh_node_watch(fh_node_t * node)
+{
+    char path[NFS_MAXPATHLEN];
+    int wd;
+
+    if (node->wd != -1)
+	return TRUE;
+
+    if (!fh_node_name(node, path) || (wd = notify_add(path)) == -1)
+	return FALSE;
+
+    /* the same directory may be watched through another path */
+    if (fh_wd_node(wd))
+	return FALSE;
+
+    node->wd = wd;
+    node->top = export_point(path);
+    node->wd_next = fh_wd_hash[fh_wd_bucket(wd)];
+    fh_wd_hash[fh_wd_bucket(wd)] = node;
+    return TRUE;
+}
+
+/*
+ * stamp nodes concerned by a change notification
+ */
+static void fh_cache_event(int wd, int kind, const char *name)
+{
+    fh_node_t *node, *child = NULL;
+    fh_moved_t *moved;
+    char path[NFS_MAXPATHLEN];
+    size_t len;
+
+    if (wd == -1) {
+	/* events were lost, trust nothing checked before */
+	fh_floor = fh_epoch++;
+	return;
+    }
+
+    node = fh_wd_node(wd);
+    if (!node)
+	return;
+
+    if (name)
+	child = fh_node_child(node, name, strlen(name), FALSE);
+
+    fh_epoch++;
+    switch (kind) {
+	case NOTIFY_ATTR:
+	    if (child)
+		child->changed = fh_epoch;
+	    else if (!name)
+		node->changed = fh_epoch;
+	    break;
+	case NOTIFY_NAME:
+	    /* the directory itself changes as well */
+	    if (child)
+		child->moved = fh_epoch;
+	    node->changed = fh_epoch;
+
+	    /* keep the inode index current, beyond the queue it is
+	       corrected when looked up */
+	    if (name && fh_moved_count < FH_MOVED_MAX &&
+		fh_node_name(node, path)) {
+		len = strcmp(path, "/") ? strlen(path) : 0;
+		if (len + strlen(name) + 2 <= NFS_MAXPATHLEN &&
+		    (moved = malloc(sizeof(fh_moved_t) + len +
+				    strlen(name) + 1))) {
+		    memcpy(moved->path, path, len);
+		    sprintf(moved->path + len, "/%s", name);
+		    moved->next = fh_moved;
+		    fh_moved = moved;
+		    fh_moved_count++;
+		}
+	    }
+	    break;
+	case NOTIFY_GONE:
+	    node->moved = fh_epoch;
+	    break;
+	case NOTIFY_LOST:
+	    node->moved = fh_epoch;
+	    fh_wd_del(node);
+	    break;
+    }
+}
+
+/*
+ * read change notifications if requests changed anything since they
+ * were last read, or at least once a second for other changes
+ */
+static void fh_cache_sync(void)
+{
+    unsigned int changes = notify_changes();
+    time_t now = time(NULL);
+
+    if (changes == fh_seen_changes && now == fh_seen_time)
+	return;
+
+    fh_seen_changes = changes;
+    fh_seen_time = now;
+    notify_read(fh_cache_event);
+}
+
+/*
+ * take the names queued by events, to be passed to fh_cache_moved
+ */
+static fh_moved_t *fh_cache_take_moved(void)
+{
+    fh_moved_t *moved = fh_moved;
+
+    fh_moved = NULL;
+    fh_moved_count = 0;
+    return moved;
+}
+
+/*
+ * update the inode index for names changed by events
+ * index_moved takes its own lock, so fh_cache_lock must not be held
+ */
+static void fh_cache_moved(fh_moved_t * moved)
+{
+    fh_moved_t *next;
+
+    for (; moved; moved = next) {
+	next = moved->next;
+	index_moved(moved->path);
+	free(moved);
+    }
+}
+
+/*
+ * check whether an entry can be used without lstat
+ */
+static int fh_cache_trusted(int idx)
+{
+    unfs3_cache_t *e = &fh_cache[idx];
+    fh_node_t *n;
+
+    if (!e->st || e->valid <= fh_floor || e->node == &fh_root ||
+	!S_ISDIR(e->st->st_mode))
+	return FALSE;
+
+    /* a rename is only reported to the directory it happens in */
+    for (n = e->node;; n = n->parent) {
+	if (n->wd == -1)
+	    return FALSE;
+	if (n->top || n == &fh_root)
+	    break;
+    }
+
+    if (e->node->changed > e->valid)
+	return FALSE;
+    for (n = e->node; n != &fh_root; n = n->parent)
+	if (n->moved > e->valid)
+	    return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * remember a checked entry, watching what is needed to trust it
+ */
+static void fh_cache_checked(int idx, backend_statstruct * buf,
+			     uint32 epoch)
+{
+    unfs3_cache_t *e = &fh_cache[idx];
+    fh_node_t *n;
+
+    if (e->node == &fh_root || !S_ISDIR(buf->st_mode))
+	return;
+
+    /* every directory up to the export point */
+    for (n = e->node;; n = n->parent) {
+	if (!fh_node_watch(n))
+	    return;
+	if (n->top || n == &fh_root)
+	    break;
+    }
+
+    if (!e->st && !(e->st = malloc(sizeof(backend_statstruct))))
+	return;
+
+    *e->st = *buf;
+    e->valid = epoch;
 }
 
 /*
  * initialize cache
+ * returns -1 if out of memory
+ */
+int fh_cache_init(int entries)
+{
+    int i, buckets;
+
+    for (buckets = 1; buckets < entries; buckets <<= 1) ;
+    fh_cache_mask = buckets - 1;
+
+    fh_cache = calloc(entries, sizeof(unfs3_cache_t));
+    fh_cache_hash = malloc(buckets * sizeof(int));
+    fh_name_hash = calloc(buckets, sizeof(fh_name_t *));
+    fh_node_hash = calloc(buckets, sizeof(fh_node_t *));
+    fh_wd_hash = calloc(buckets, sizeof(fh_node_t *));
+    if (!fh_cache || !fh_cache_hash || !fh_name_hash || !fh_node_hash ||
+	!fh_wd_hash)
+	return -1;
+    fh_cache_size = entries;
+
+    for (i = 0; i < buckets; i++)
+	fh_cache_hash[i] = -1;
+
+    for (i = entries - 1; i >= 0; i--) {
+	fh_cache[i].next = fh_cache_free;
+	fh_cache_free = i;
+    }
+
+    return 0;
+}
+
+/*
+ * remove an entry from its hash chain and drop its path
  */
-void fh_cache_init(void)
+static void fh_cache_unlink(int idx)
 {
-    memset(fh_cache, 0, sizeof(unfs3_cache_t) * CACHE_ENTRIES);
+    int *link;
+
+    link = &fh_cache_hash[fh_cache_bucket(fh_cache[idx].dev,
+					  fh_cache[idx].ino)];
+    while (*link != idx)
+	link = &fh_cache[*link].next;
+    *link = fh_cache[idx].next;
+
+    fh_node_put(fh_cache[idx].node);
+    fh_cache[idx].dev = 0;
+    fh_cache[idx].ino = 0;
+    fh_cache[idx].node = NULL;
+    fh_cache[idx].valid = 0;
+    fh_cache_max--;
 }
 
 /*
  * find cache index to use for new entry
- * returns either an empty slot or the least recently used slot if no
- * empty slot is present
+ * returns an unused slot, or the first one passed by the clock hand
+ * that was not used since its last pass
  */
-static int fh_cache_lru(void)
+static int fh_cache_victim(void)
 {
-    unsigned int best = UINT_MAX;
-    int best_idx = 0;
-    int i;
+    int idx;
 
-    /* if cache is not full, we simply hand out the next slot */
-    if (fh_cache_max < CACHE_ENTRIES - 1)
-	return fh_cache_max++;
+    if (fh_cache_free != -1) {
+	idx = fh_cache_free;
+	fh_cache_free = fh_cache[idx].next;
+	return idx;
+    }
 
-    for (i = 0; i < CACHE_ENTRIES; i++) {
-	if (i == fh_last_entry)
+    for (;;) {
+	idx = fh_cache_hand;
+	fh_cache_hand = (fh_cache_hand + 1) % fh_cache_size;
+	if (fh_cache[idx].ref) {
+	    fh_cache[idx].ref = FALSE;
 	    continue;
-	if (fh_cache[i].use == 0)
-	    return i;
-	if (fh_cache[i].use < best) {
-	    best = fh_cache[i].use;
-	    best_idx = i;
 	}
+	fh_cache_evict++;
+	fh_cache_unlink(idx);
+	return idx;
     }
-
-    /* avoid stomping over last returned entry */
-    if (best_idx == 0 && fh_last_entry == 0)
-	best_idx = 1;
-
-    return best_idx;
 }
 
 /*
@@ -113,10 +682,9 @@ static int fh_cache_lru(void)
  */
 static void fh_cache_inval(int idx)
 {
-    fh_cache[idx].dev = 0;
-    fh_cache[idx].ino = 0;
-    fh_cache[idx].use = 0;
-    fh_cache[idx].path[0] = 0;
+    fh_cache_unlink(idx);
+    fh_cache[idx].next = fh_cache_free;
+    fh_cache_free = idx;
 }
 
 /*
@@ -124,77 +692,568 @@ static void fh_cache_inval(int idx)
  */
 static int fh_cache_index(uint32 dev, uint64 ino)
 {
-    int i, res = -1;
+    int idx;
 
-    for (i = 0; i < fh_cache_max + 1; i++)
-	if (fh_cache[i].dev == dev && fh_cache[i].ino == ino) {
-	    res = i;
-	    break;
-	}
+    for (idx = fh_cache_hash[fh_cache_bucket(dev, ino)]; idx != -1;
+	 idx = fh_cache[idx].next)
+	if (fh_cache[idx].dev == dev && fh_cache[idx].ino == ino)
+	    return idx;
+
+    return -1;
+}
+
+static fh_stale_t *fh_stale_slot(uint32 dev, uint64 ino)
+{
+    uint32 h = (uint32) (ino ^ (ino >> 32)) * 2654435761U ^ dev;
+
+    return &fh_stale[h & (FH_STALE_ENTRIES - 1)];
+}
+
+/*
+ * check if a filehandle has been found stale recently
+ */
+static int fh_stale_check(uint32 dev, uint64 ino, uint32 gen)
+{
+    fh_stale_t *e;
+    int res;
+
+    LOCK(fh_cache_lock);
+    e = fh_stale_slot(dev, ino);
+    res = e->ino == ino && e->dev == dev && e->gen == gen &&
+	e->moves == fh_stale_moves && time(NULL) - e->time < FH_STALE_TIME;
+    if (res)
+	fh_cache_stale++;
+    UNLOCK(fh_cache_lock);
 
     return res;
 }
 
+static void fh_stale_add(uint32 dev, uint64 ino, uint32 gen)
+{
+    fh_stale_t *e;
+
+    LOCK(fh_cache_lock);
+    e = fh_stale_slot(dev, ino);
+    e->dev = dev;
+    e->ino = ino;
+    e->gen = gen;
+    e->moves = fh_stale_moves;
+    e->time = time(NULL);
+    UNLOCK(fh_cache_lock);
+}
+
 /*
- * add an entry to the filehandle cache
+ * drop the stale entry of an inode, lock held
  */
-char *fh_cache_add(uint32 dev, uint64 ino, const char *path)
+static void fh_stale_forget(uint32 dev, uint64 ino)
+{
+    fh_stale_t *e = fh_stale_slot(dev, ino);
+
+    if (e->ino == ino && e->dev == dev)
+	e->ino = 0;
+}
+
+/*
+ * add an entry to the filehandle cache, not to the index
+ */
+static void fh_cache_put(uint32 dev, uint64 ino, const char *path)
 {
     int idx;
+    uint32 h;
+    fh_node_t *node;
+
+    LOCK(fh_cache_lock);
+
+    node = fh_node_path(path, TRUE);
+    if (!node) {
+	UNLOCK(fh_cache_lock);
+	return;
+    }
+
+    /* the inode is no longer stale */
+    fh_stale_forget(dev, ino);
 
     /* if we already have a matching entry, overwrite that */
     idx = fh_cache_index(dev, ino);
+    if (idx != -1) {
+	fh_node_put(fh_cache[idx].node);
+	fh_cache[idx].node = node;
+	fh_cache[idx].valid = 0;
+    } else {
+	/* otherwise take a free or unused entry */
+	idx = fh_cache_victim();
+	h = fh_cache_bucket(dev, ino);
+	fh_cache[idx].dev = dev;
+	fh_cache[idx].ino = ino;
+	fh_cache[idx].node = node;
+	fh_cache[idx].ref = FALSE;
+	fh_cache[idx].valid = 0;
+	fh_cache[idx].next = fh_cache_hash[h];
+	fh_cache_hash[h] = idx;
+	fh_cache_max++;
+    }
 
-    /* otherwise overwrite least recently used entry */
-    if (idx == -1)
-	idx = fh_cache_lru();
+    UNLOCK(fh_cache_lock);
+}
+
+/*
+ * add an entry to the filehandle cache
+ */
+void fh_cache_add(uint32 dev, uint64 ino, const char *path)
+{
+    index_add(dev, ino, path);
+    fh_cache_put(dev, ino, path);
+}
+
+/*
+ * follow a rename in the cache
+ * the node of the old path is moved, so cached paths below it stay valid
+ */
+void fh_cache_rename(const char *from, const char *to)
+{
+    fh_node_t *node, *parent, *old, *dest;
+    fh_name_t *name;
+    const char *base;
+    char dir[NFS_MAXPATHLEN];
+
+    base = strrchr(to, '/');
+    if (!base || !base[1] || base - to >= NFS_MAXPATHLEN)
+	return;
+    memcpy(dir, to, base - to);
+    dir[base - to] = 0;
+    base++;
 
-    fh_cache[idx].dev = dev;
-    fh_cache[idx].ino = ino;
-    fh_cache[idx].use = fh_cache_next();
+    LOCK(fh_cache_lock);
 
-    strcpy(fh_cache[idx].path, path);
+    /* lost objects may be found in their new place */
+    fh_stale_moves++;
 
-    return fh_cache[idx].path;
+    node = fh_node_path(from, FALSE);
+    if (!node || node == &fh_root) {
+	if (node)
+	    fh_node_put(node);
+	UNLOCK(fh_cache_lock);
+	return;
+    }
+
+    parent = fh_node_path(dir[0] ? dir : "/", TRUE);
+    name = parent ? fh_name_get(base, strlen(base)) : NULL;
+    if (!name) {
+	if (parent)
+	    fh_node_put(parent);
+	fh_node_put(node);
+	UNLOCK(fh_cache_lock);
+	return;
+    }
+
+    /* entries of a replaced object keep their node, it cannot be found;
+       events for the name reach the moved object, so it is stamped here */
+    dest = fh_node_child(parent, base, strlen(base), FALSE);
+    if (dest && dest != node) {
+	fh_node_unhash(dest);
+	dest->moved = ++fh_epoch;
+    }
+
+    old = node->parent;
+    fh_node_unhash(node);
+    fh_name_put(node->name);
+    node->name = name;
+    node->parent = parent;
+    parent->refs++;
+    fh_node_hash_add(node);
+
+    fh_node_put(old);
+    fh_node_put(parent);
+    fh_node_put(node);
+
+    UNLOCK(fh_cache_lock);
 }
 
+#ifndef WIN32
 /*
- * lookup an entry in the cache given a device, inode, and generation number
+ * the cache can be saved to a snapshot file and loaded at startup, so
+ * that filehandles of clients resolve without a search after a restart;
+ * loaded entries are checked on first use like any other, and kept out
+ * of the inode index until then
+ *
+ * the file is a header followed by records of device, path length,
+ * inode and path, each record padded to 8 bytes
  */
-static char *fh_cache_lookup(uint32 dev, uint64 ino)
+
+#define SNAP_MAGIC	"UNFS3FHC"
+#define SNAP_VERSION	1
+
+typedef struct {
+    char magic[8];
+    uint32 version;
+    uint32 count;
+} fh_snap_head_t;
+
+typedef struct {
+    uint32 dev;
+    uint32 len;
+    uint64 ino;
+} fh_snap_rec_t;
+
+/* entry copied for saving */
+typedef struct {
+    uint32 dev;
+    uint64 ino;
+    fh_node_t *node;
+} fh_snap_ent_t;
+
+#define SNAP_ALIGN(x)	(((x) + 7) & ~(size_t) 7)
+
+/* snapshot file, NULL if none */
+static char *fh_snap_file = NULL;
+
+/*
+ * load the cache from a snapshot file, which is also used for saving
+ */
+void fh_cache_restore(const char *file)
+{
+    fh_snap_head_t *head;
+    fh_snap_rec_t *rec;
+    struct stat st;
+    char path[NFS_MAXPATHLEN];
+    char *map, *p, *end;
+    uint32 i, loaded = 0;
+    int fd;
+
+    fh_snap_file = strdup(file);
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1)
+	return;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(*head)) {
+	close(fd);
+	return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return;
+
+    head = (fh_snap_head_t *) map;
+    if (memcmp(head->magic, SNAP_MAGIC, 8) != 0 ||
+	head->version != SNAP_VERSION) {
+	logmsg(LOG_WARNING, "ignoring invalid fh cache snapshot %s", file);
+	munmap(map, st.st_size);
+	return;
+    }
+
+    p = map + sizeof(*head);
+    end = map + st.st_size;
+    for (i = 0; i < head->count && loaded < (uint32) fh_cache_size; i++) {
+	rec = (fh_snap_rec_t *) p;
+	if (p + sizeof(*rec) > end || rec->len >= NFS_MAXPATHLEN ||
+	    (size_t) (end - p) < SNAP_ALIGN(sizeof(*rec) + rec->len))
+	    break;
+
+	memcpy(path, p + sizeof(*rec), rec->len);
+	path[rec->len] = 0;
+	p += SNAP_ALIGN(sizeof(*rec) + rec->len);
+
+	fh_cache_put(rec->dev, rec->ino, path);
+	loaded++;
+    }
+
+    munmap(map, st.st_size);
+    logmsg(LOG_INFO, "loaded %u filehandles from %s", loaded, file);
+}
+
+/*
+ * save the cache to the snapshot file
+ */
+void fh_cache_save(void)
+{
+    fh_snap_head_t head;
+    fh_snap_rec_t rec;
+    fh_snap_ent_t *ents;
+    char tmp[NFS_MAXPATHLEN + 8];
+    char path[NFS_MAXPATHLEN];
+    static const char pad[8] = { 0 };
+    char *buf = NULL, *p;
+    size_t size = 0, len, used = 0;
+    int i, n = 0, fd, res;
+    uid_t euid;
+    gid_t egid;
+
+    if (!fh_snap_file)
+	return;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", fh_snap_file) >=
+	(int) sizeof(tmp))
+	return;
+
+    memcpy(head.magic, SNAP_MAGIC, 8);
+    head.version = SNAP_VERSION;
+    head.count = 0;
+
+    /* copy the entries, holding their nodes */
+    LOCK(fh_cache_lock);
+    ents = malloc(fh_cache_size * sizeof(fh_snap_ent_t));
+    if (!ents) {
+	UNLOCK(fh_cache_lock);
+	return;
+    }
+    for (i = 0; i < fh_cache_size; i++) {
+	if (!fh_cache[i].node)
+	    continue;
+	ents[n].dev = fh_cache[i].dev;
+	ents[n].ino = fh_cache[i].ino;
+	ents[n].node = fh_cache[i].node;
+	ents[n].node->refs++;
+	n++;
+    }
+    UNLOCK(fh_cache_lock);
+
+    /* renames change nodes in place, so each name is built locked */
+    for (i = 0; i < n; i++) {
+	LOCK(fh_cache_lock);
+	res = fh_node_name(ents[i].node, path);
+	fh_node_put(ents[i].node);
+	UNLOCK(fh_cache_lock);
+	if (!res)
+	    continue;
+
+	len = strlen(path);
+	if (used + SNAP_ALIGN(sizeof(rec) + len) > size) {
+	    size = size ? size * 2 : 65536;
+	    p = realloc(buf, size);
+	    if (!p) {
+		for (i++; i < n; i++) {
+		    LOCK(fh_cache_lock);
+		    fh_node_put(ents[i].node);
+		    UNLOCK(fh_cache_lock);
+		}
+		free(ents);
+		free(buf);
+		return;
+	    }
+	    buf = p;
+	}
+
+	rec.dev = ents[i].dev;
+	rec.len = len;
+	rec.ino = ents[i].ino;
+	p = buf + used;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), path, len);
+	memcpy(p + sizeof(rec) + len, pad,
+	       SNAP_ALIGN(sizeof(rec) + len) - sizeof(rec) - len);
+	used += SNAP_ALIGN(sizeof(rec) + len);
+	head.count++;
+    }
+    free(ents);
+
+    /* the file is written as root, whatever ids the thread has */
+    switch_save(&euid, &egid);
+
+    /* replace the old snapshot only once the new one is on disk */
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+	logmsg(LOG_WARNING, "could not create fh cache snapshot %s: %s",
+	       tmp, strerror(errno));
+    } else {
+	res = (write(fd, &head, sizeof(head)) == sizeof(head) &&
+	       (used == 0 || write(fd, buf, used) == (ssize_t) used) &&
+	       fsync(fd) == 0);
+	if (close(fd) == -1 || !res || rename(tmp, fh_snap_file) == -1) {
+	    logmsg(LOG_WARNING, "could not save fh cache snapshot %s",
+		   fh_snap_file);
+	    unlink(tmp);
+	}
+    }
+
+    switch_restore(euid, egid);
+    free(buf);
+}
+
+/*
+ * add the contents of a directory to the cache, down to depth levels
+ * returns FALSE once the cache is full
+ */
+static int fh_cache_walk(char *path, int depth)
+{
+    backend_dirstream *search;
+    struct dirent *this;
+    backend_statstruct buf;
+    size_t len = strlen(path);
+    int more = TRUE;
+
+    search = backend_opendir(path);
+    if (!search)
+	return TRUE;
+
+    while (more && (this = backend_readdir(search)) != NULL) {
+	if (strcmp(this->d_name, ".") == 0 || strcmp(this->d_name, "..") == 0)
+	    continue;
+	if (len + strlen(this->d_name) + 2 > NFS_MAXPATHLEN)
+	    continue;
+
+	sprintf(path + len, "/%s", this->d_name);
+	if (backend_lstat(path, &buf) == -1)
+	    continue;
+
+	LOCK(fh_cache_lock);
+	more = fh_cache_max < fh_cache_size;
+	UNLOCK(fh_cache_lock);
+	if (!more)
+	    break;
+
+	fh_cache_add(buf.st_dev, buf.st_ino, path);
+	if (S_ISDIR(buf.st_mode) && depth > 1)
+	    more = fh_cache_walk(path, depth - 1);
+    }
+
+    path[len] = 0;
+    backend_closedir(search);
+    return more;
+}
+
+typedef struct {
+    int depth;
+    int count;
+    char **dirs;
+} fh_warm_t;
+
+static void *fh_cache_warm(void *arg)
+{
+    fh_warm_t *warm = arg;
+    char path[NFS_MAXPATHLEN];
+    int i;
+
+    for (i = 0; i < warm->count; i++) {
+	if (strlen(warm->dirs[i]) < NFS_MAXPATHLEN) {
+	    strcpy(path, warm->dirs[i]);
+	    if (!fh_cache_walk(path, warm->depth))
+		break;
+	}
+    }
+
+    for (i = 0; i < warm->count; i++)
+	free(warm->dirs[i]);
+    free(warm->dirs);
+    free(warm);
+    return NULL;
+}
+
+/*
+ * fill the cache by walking the exported directories down to depth
+ * levels, in a thread of its own where possible
+ */
+void fh_cache_prewarm(int depth)
+{
+    fh_warm_t *warm;
+    exports list;
+    int n = 0;
+#ifdef WANT_WORKERS
+    pthread_t thread;
+#endif
+
+    warm = malloc(sizeof(fh_warm_t));
+    if (!warm)
+	return;
+    for (list = exports_nfslist; list; list = list->ex_next)
+	n++;
+    warm->depth = depth;
+    warm->count = 0;
+    warm->dirs = malloc((n + 1) * sizeof(char *));
+    if (!warm->dirs) {
+	free(warm);
+	return;
+    }
+    for (list = exports_nfslist; list; list = list->ex_next)
+	if ((warm->dirs[warm->count] = strdup(list->ex_dir)))
+	    warm->count++;
+
+#ifdef WANT_WORKERS
+    if (pthread_create(&thread, NULL, fh_cache_warm, warm) == 0) {
+	pthread_detach(thread);
+	return;
+    }
+#endif
+    fh_cache_warm(warm);
+}
+#endif				       /* WIN32 */
+
+/*
+ * lookup an entry in the cache given a device and inode number
+ * the path is copied to result, which must hold NFS_MAXPATHLEN bytes
+ */
+static char *fh_cache_lookup(uint32 dev, uint64 ino, char *result,
+			     unfs3_ctx_t * ctx)
 {
     int i, res;
     backend_statstruct buf;
+    fh_node_t *node = NULL;
+    fh_moved_t *moved = NULL;
+    uint32 epoch;
 
+    LOCK(fh_cache_lock);
+    fh_cache_use++;
     i = fh_cache_index(dev, ino);
-
     if (i != -1) {
-	/* check whether path to <dev,ino> relation still holds */
-	res = backend_lstat(fh_cache[i].path, &buf);
-	if (res == -1) {
-	    /* object does not exist any more */
-	    fh_cache_inval(i);
-	    return NULL;
+	node = fh_cache[i].node;
+	if (!fh_node_name(node, result))
+	    i = -1;
+    }
+
+    /* nothing changed since the last check, no need to look */
+    if (i != -1 && notify_enabled()) {
+	fh_cache_sync();
+	moved = fh_cache_take_moved();
+	if (fh_cache_trusted(i)) {
+	    fh_cache[i].ref = TRUE;
+	    fh_cache_hit++;
+	    fh_cache_trust++;
+	    ctx->st = *fh_cache[i].st;
+	    UNLOCK(fh_cache_lock);
+	    fh_cache_moved(moved);
+
+	    ctx->st_valid = TRUE;
+	    return result;
 	}
-	if (buf.st_dev == dev && buf.st_ino == ino) {
-	    /* cache hit, update time on cache entry */
-	    fh_cache[i].use = fh_cache_next();
+    }
+    epoch = fh_epoch;
+    UNLOCK(fh_cache_lock);
+    fh_cache_moved(moved);
 
-	    /* update stat cache */
-	    st_cache_valid = TRUE;
-	    st_cache = buf;
+    if (i == -1)
+	return NULL;
 
-	    /* prevent next fh_cache_add from overwriting entry */
-	    fh_last_entry = i;
+    /* check whether path to <dev,ino> relation still holds */
+    res = backend_lstat(result, &buf);
 
-	    return fh_cache[i].path;
-	} else {
-	    /* path to <dev,ino> relation has changed */
-	    fh_cache_inval(i);
-	    return NULL;
-	}
+    LOCK(fh_cache_lock);
+
+    /* entry may have been reused while we were not looking */
+    if (fh_cache[i].dev != dev || fh_cache[i].ino != ino ||
+	fh_cache[i].node != node) {
+	UNLOCK(fh_cache_lock);
+	return NULL;
     }
 
+    if (res != -1 && buf.st_dev == dev && buf.st_ino == ino) {
+	/* cache hit, keep entry on next pass of the clock */
+	fh_cache[i].ref = TRUE;
+	fh_cache_hit++;
+	if (notify_enabled())
+	    fh_cache_checked(i, &buf, epoch);
+	UNLOCK(fh_cache_lock);
+
+	/* update stat cache */
+	ctx->st_valid = TRUE;
+	ctx->st = buf;
+
+	return result;
+    }
+
+    /* object does not exist any more or path to <dev,ino> relation has
+       changed */
+    fh_cache_inval(i);
+    UNLOCK(fh_cache_lock);
     return NULL;
 }
 
@@ -202,15 +1261,16 @@ static char *fh_cache_lookup(uint32 dev, uint64 ino)
  * resolve a filename into a path
  * cache-using wrapper for fh_decomp_raw
  */
-char *fh_decomp(nfs_fh3 fh)
+char *fh_decomp(nfs_fh3 fh, unfs3_ctx_t * ctx)
 {
-    char *result;
+    char *result, *path;
     unfs3_fh_t obj = fh_decode(&fh);
     time_t *last_mtime;
     uint32 *dir_hash, new_dir_hash;
 
+    ctx->fh_busy = FALSE;
     if (!nfh_valid(fh)) {
-	st_cache_valid = FALSE;
+	ctx->st_valid = FALSE;
 	return NULL;
     }
 
@@ -220,36 +1280,36 @@ char *fh_decomp(nfs_fh3 fh)
 	if (obj.ino == 0x1) {
 	    /* This FH refers to the export point itself */
 	    /* Need to fill stat cache */
-	    st_cache_valid = TRUE;
+	    ctx->st_valid = TRUE;
 
-	    if (backend_lstat(result, &st_cache) == -1) {
+	    if (backend_lstat(result, &ctx->st) == -1) {
 		/* export point does not exist. This probably means that we
 		   are using autofs and no media is inserted. Fill stat cache 
 		   with dummy information */
-		st_cache.st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
-		st_cache.st_nlink = 2;
-		st_cache.st_uid = 0;
-		st_cache.st_gid = 0;
-		st_cache.st_rdev = 0;
-		st_cache.st_size = 4096;
-		st_cache.st_blksize = 512;
-		st_cache.st_blocks = 8;
+		ctx->st.st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+		ctx->st.st_nlink = 2;
+		ctx->st.st_uid = 0;
+		ctx->st.st_gid = 0;
+		ctx->st.st_rdev = 0;
+		ctx->st.st_size = 4096;
+		ctx->st.st_blksize = 512;
+		ctx->st.st_blocks = 8;
 	    } else {
 		/* Stat was OK, but make sure the values are sane. Supermount 
 		   returns insane values when no media is inserted, for
 		   example. */
-		if (st_cache.st_nlink == 0)
-		    st_cache.st_nlink = 1;
-		if (st_cache.st_size == 0)
-		    st_cache.st_size = 4096;
-		if (st_cache.st_blksize == 0)
-		    st_cache.st_blksize = 512;
-		if (st_cache.st_blocks == 0)
-		    st_cache.st_blocks = 8;
+		if (ctx->st.st_nlink == 0)
+		    ctx->st.st_nlink = 1;
+		if (ctx->st.st_size == 0)
+		    ctx->st.st_size = 4096;
+		if (ctx->st.st_blksize == 0)
+		    ctx->st.st_blksize = 512;
+		if (ctx->st.st_blocks == 0)
+		    ctx->st.st_blocks = 8;
 	    }
 
-	    st_cache.st_dev = obj.dev;
-	    st_cache.st_ino = 0x1;
+	    ctx->st.st_dev = obj.dev;
+	    ctx->st.st_ino = 0x1;
 
 	    /* It's very important that we get mtime correct, since it's used 
 	       as verifier in READDIR. The generation of mtime is tricky,
@@ -269,45 +1329,57 @@ char *fh_decomp(nfs_fh3 fh)
 	       returned, and the client has to retry the READDIR operation
 	       with a zero cookie */
 
-	    if (st_cache.st_mtime > *last_mtime) {
+	    if (ctx->st.st_mtime > *last_mtime) {
 		/* stat says our directory has changed */
-		*last_mtime = st_cache.st_mtime;
+		*last_mtime = ctx->st.st_mtime;
 	    } else if (*dir_hash != (new_dir_hash = directory_hash(result))) {
 		/* The names in the directory has changed. Return current
 		   time. */
-		st_cache.st_mtime = time(NULL);
-		*last_mtime = st_cache.st_mtime;
+		ctx->st.st_mtime = time(NULL);
+		*last_mtime = ctx->st.st_mtime;
 		*dir_hash = new_dir_hash;
 	    } else {
 		/* Hash unchanged. Returned stored mtime. */
-		st_cache.st_mtime = *last_mtime;
+		ctx->st.st_mtime = *last_mtime;
 	    }
 
 	    return result;
 	}
     }
 
-    /* try lookup in cache, increase cache usage counter */
-    result = fh_cache_lookup(obj.dev, obj.ino);
-    fh_cache_use++;
+    /* try lookup in cache */
+    path = ctx->path[ctx->path_slot];
+    ctx->path_slot = (ctx->path_slot + 1) % 2;
+    result = fh_cache_lookup(obj.dev, obj.ino, path, ctx);
+
+    if (!result && fh_stale_check(obj.dev, obj.ino, obj.gen)) {
+	/* known to be stale, do not search again */
+	ctx->st_valid = FALSE;
+	return NULL;
+    }
 
     if (!result) {
-	/* not found, resolve the hard way */
-	result = fh_decomp_raw(&obj);
+	/* not found, try the inode index */
+	result = index_lookup(obj.dev, obj.ino, path, ctx);
 
-	/* if still not found, do full recursive search) */
+	/* resolve the hard way */
 	if (!result)
-	    result = backend_locate_file(obj.dev, obj.ino);
+	    result = fh_decomp_raw(&obj, path, ctx);
+
+	/* if still not found, do full recursive search) */
+	if (!result && !ctx->fh_busy)
+	    result = backend_locate_file(obj.dev, obj.ino, path, ctx);
 
 	if (result)
 	    /* add to cache for later use if resolution ok */
-	    result = fh_cache_add(obj.dev, obj.ino, result);
-	else
+	    fh_cache_add(obj.dev, obj.ino, result);
+	else {
 	    /* could not resolve in any way */
-	    st_cache_valid = FALSE;
-    } else
-	/* found, update cache hit statistic */
-	fh_cache_hit++;
+	    ctx->st_valid = FALSE;
+	    if (!ctx->fh_busy)
+		fh_stale_add(obj.dev, obj.ino, obj.gen);
+	}
+    }
 
     return result;
 }
@@ -317,16 +1389,16 @@ char *fh_decomp(nfs_fh3 fh)
  * cache-using wrapper for fh_comp_raw
  * exports_options must be called before
  */
-unfs3_fh_t fh_comp(const char *path, struct svc_req * rqstp, int need_dir)
+unfs3_fh_t fh_comp(const char *path, unfs3_ctx_t * ctx, int need_dir)
 {
     unfs3_fh_t res;
 
-    res = fh_comp_raw(path, rqstp, need_dir);
+    res = fh_comp_raw(path, ctx, need_dir);
     if (fh_valid(res))
 	/* add to cache for later use */
 	fh_cache_add(res.dev, res.ino, path);
 
-    res.pwhash = export_password_hash;
+    res.pwhash = ctx->pwhash;
     return res;
 }
 
@@ -334,14 +1406,11 @@ unfs3_fh_t fh_comp(const char *path, struct svc_req * rqstp, int need_dir)
  * return pointer to composed filehandle
  * wrapper for fh_comp
  */
-unfs3_fh_t *fh_comp_ptr(const char *path, struct svc_req * rqstp,
-			int need_dir)
+unfs3_fh_t *fh_comp_ptr(const char *path, unfs3_ctx_t * ctx, int need_dir)
 {
-    static unfs3_fh_t res;
-
-    res = fh_comp(path, rqstp, need_dir);
-    if (fh_valid(res))
-	return &res;
+    ctx->fh = fh_comp(path, ctx, need_dir);
+    if (fh_valid(ctx->fh))
+	return &ctx->fh;
     else
 	return NULL;
 }
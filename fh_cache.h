@@ -11,13 +11,24 @@
 extern int fh_cache_max;
 extern int fh_cache_use;
 extern int fh_cache_hit;
+extern int fh_cache_evict;
+extern int fh_cache_trust;
+extern int fh_cache_stale;
 
-void fh_cache_init(void);
+/* default number of entries */
+#define FH_ENTRIES	4096
 
-char *fh_decomp(nfs_fh3 fh);
-unfs3_fh_t fh_comp(const char *path, struct svc_req *rqstp, int need_dir);
-unfs3_fh_t *fh_comp_ptr(const char *path, struct svc_req *rqstp, int need_dir);
+int fh_cache_init(int entries);
 
-char *fh_cache_add(uint32 dev, uint64 ino, const char *path);
+char *fh_decomp(nfs_fh3 fh, unfs3_ctx_t *ctx);
+unfs3_fh_t fh_comp(const char *path, unfs3_ctx_t *ctx, int need_dir);
+unfs3_fh_t *fh_comp_ptr(const char *path, unfs3_ctx_t *ctx, int need_dir);
+
+void fh_cache_add(uint32 dev, uint64 ino, const char *path);
+void fh_cache_rename(const char *from, const char *to);
+
+void fh_cache_restore(const char *file);
+void fh_cache_save(void);
+void fh_cache_prewarm(int depth);
 
 #endif
@@ -0,0 +1,242 @@
+/*
+ * UNFS3 flusher threads
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "mount.h"
+#include "xdr.h"
+#include "fh.h"
+#include "backend.h"
+#include "daemon.h"
+#include "error.h"
+#include "fd_cache.h"
+#include "worker.h"
+#include "event.h"
+#include "tcp.h"
+#include "udp.h"
+#include "context.h"
+#include "attr.h"
+#include "drc.h"
+#include "flush.h"
+
+#if defined(WANT_WORKERS) && defined(WANT_EPOLL)
+
+/*
+ * fsync() of a large file can take seconds; instead of holding up the
+ * thread that runs the request, COMMIT and stable WRITE hand the fsync
+ * and their reply to a flusher thread and return without replying
+ *
+ * this needs the native transports, which can keep a call alive after
+ * its dispatcher returns
+ */
+
+struct flush_job {
+    struct flush_job *next;
+    SVCXPRT *xprt;			/* detached call */
+    int drc;				/* duplicate cache entry */
+    int proc;
+    int fd;				/* WRITE */
+    nfs_fh3 fh;				/* COMMIT */
+    char fhbuf[FH_MAXBUF];
+    char path[NFS_MAXPATHLEN];
+    uint32 dev;
+    uint64 ino;
+    union {
+	COMMIT3res commit;
+	WRITE3res write;
+    } res;
+};
+
+static struct flush_job *queue_head = NULL;
+static struct flush_job **queue_tail = &queue_head;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static int flushers = 0;
+
+/*
+ * sync, then send the reply
+ */
+static void flush_run(struct flush_job *job)
+{
+    xdrproc_t xres;
+    char *res;
+
+    if (job->proc == NFSPROC3_COMMIT) {
+	if (fd_sync(job->fh) != -1)
+	    memcpy(job->res.commit.COMMIT3res_u.resok.verf, wverf,
+		   NFS3_WRITEVERFSIZE);
+	else
+	    /* error during fsync() or close() */
+	    job->res.commit.status = NFS3ERR_IO;
+	update_post_attr(&job->res.commit.COMMIT3res_u.resfail.file_wcc.after,
+			 job->path, job->dev, job->ino);
+	xres = (xdrproc_t) xdr_COMMIT3res;
+	res = (char *) &job->res.commit;
+    } else {
+	if (fd_close(job->fd, UNFS3_FD_WRITE, FD_CLOSE_REAL) != -1)
+	    memcpy(job->res.write.WRITE3res_u.resok.verf, wverf,
+		   NFS3_WRITEVERFSIZE);
+	else
+	    /* error during fsync() or close() */
+	    job->res.write.status = write_write_err();
+	xres = (xdrproc_t) xdr_WRITE3res;
+	res = (char *) &job->res.write;
+    }
+
+    drc_done(job->drc, xres, res);
+    if (!svc_sendreply(job->xprt, xres, res))
+	logmsg(LOG_CRIT, "unable to send RPC reply");
+
+    svc_destroy(job->xprt);
+    free(job);
+}
+
+/*
+ * flusher thread main loop
+ */
+static void *flush_main(U(void *arg))
+{
+    struct flush_job *job;
+    sigset_t set;
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+	pthread_mutex_lock(&queue_lock);
+	while (!queue_head)
+	    pthread_cond_wait(&queue_cond, &queue_lock);
+	job = queue_head;
+	queue_head = job->next;
+	if (!queue_head)
+	    queue_tail = &queue_head;
+	pthread_mutex_unlock(&queue_lock);
+
+	flush_run(job);
+    }
+
+    return NULL;
+}
+
+/*
+ * queue a job for the flushers
+ */
+static void flush_queue(struct flush_job *job)
+{
+    job->next = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    *queue_tail = job;
+    queue_tail = &job->next;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * start flusher threads
+ */
+int flush_start(int threads)
+{
+    pthread_t thread;
+    int i;
+
+    for (i = 0; i < threads; i++) {
+	if (pthread_create(&thread, NULL, flush_main, NULL) != 0) {
+	    logmsg(LOG_WARNING, "could not create flusher thread");
+	    break;
+	}
+	pthread_detach(thread);
+	flushers++;
+    }
+
+    return flushers > 0 ? 0 : -1;
+}
+
+struct flush_job *flush_job_new(unfs3_ctx_t * ctx)
+{
+    struct flush_job *job;
+
+    if (!flushers)
+	return NULL;
+
+    job = malloc(sizeof(struct flush_job));
+    if (!job)
+	return NULL;
+
+    job->xprt = tcp_detach(ctx->rqstp->rq_xprt);
+    if (!job->xprt)
+	job->xprt = udp_detach(ctx->rqstp->rq_xprt);
+    if (!job->xprt) {
+	free(job);
+	return NULL;
+    }
+    job->drc = ctx->drc;
+
+    return job;
+}
+
+void flush_commit(struct flush_job *job, nfs_fh3 fh, const char *path,
+		  unfs3_ctx_t * ctx, COMMIT3res * res)
+{
+    job->proc = NFSPROC3_COMMIT;
+    job->fh.data.data_len = fh.data.data_len;
+    job->fh.data.data_val = job->fhbuf;
+    memcpy(job->fhbuf, fh.data.data_val, fh.data.data_len);
+    strcpy(job->path, path);
+    job->dev = ctx->st.st_dev;
+    job->ino = ctx->st.st_ino;
+    job->res.commit = *res;
+
+    flush_queue(job);
+}
+
+void flush_write(struct flush_job *job, int fd, WRITE3res * res)
+{
+    job->proc = NFSPROC3_WRITE;
+    job->fd = fd;
+    job->res.write = *res;
+
+    flush_queue(job);
+}
+
+#else				       /* WANT_WORKERS && WANT_EPOLL */
+
+int flush_start(U(int threads))
+{
+    return -1;
+}
+
+struct flush_job *flush_job_new(U(unfs3_ctx_t * ctx))
+{
+    return NULL;
+}
+
+void flush_commit(U(struct flush_job *job), U(nfs_fh3 fh),
+		  U(const char *path), U(unfs3_ctx_t * ctx),
+		  U(COMMIT3res * res))
+{
+}
+
+void flush_write(U(struct flush_job *job), U(int fd), U(WRITE3res * res))
+{
+}
+
+#endif				       /* WANT_WORKERS && WANT_EPOLL */
@@ -0,0 +1,22 @@
+/*
+ * UNFS3 flusher threads
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_FLUSH_H
+#define UNFS3_FLUSH_H
+
+struct flush_job;
+
+int flush_start(int threads);
+
+/* take over the reply of a request, NULL if it must be answered now */
+struct flush_job *flush_job_new(unfs3_ctx_t * ctx);
+
+/* sync and reply from a flusher thread */
+void flush_commit(struct flush_job *job, nfs_fh3 fh, const char *path,
+		  unfs3_ctx_t * ctx, COMMIT3res * res);
+void flush_write(struct flush_job *job, int fd, WRITE3res * res);
+
+#endif
@@ -0,0 +1,729 @@
+/*
+ * UNFS3 inode index
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/rpc.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <syslog.h>
+#include <sys/mman.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "fh.h"
+#include "daemon.h"
+#include "backend.h"
+#include "worker.h"
+#include "context.h"
+#include "Config/exports.h"
+#include "user.h"
+#include "index.h"
+
+/* statistics */
+int index_hit = 0;
+int index_miss = 0;
+
+#ifndef WIN32
+
+/*
+ * the index maps device and inode of the objects below the exports to
+ * the inode of their directory and their name, so that a filehandle
+ * missing from the cache is resolved by a few lookups instead of a
+ * search, also after a restart and after renames
+ *
+ * it lives in a file mapped into memory: a hash table of records
+ * followed by the names; export roots have no directory and keep
+ * their full path as name
+ *
+ * a thread walks the exports at startup, after that requests, renames
+ * and change notifications keep it current; paths are checked with
+ * lstat before use and wrong records dropped, so a stale index costs
+ * nothing but the check; the file is only grown as root, by the walk
+ * or a timer, requests finding it full drop the record
+ */
+
+#define INDEX_MAGIC	"UNFS3IDX"
+#define INDEX_VERSION	1
+
+/* smallest sizes of the record table and the name area */
+#define INDEX_SLOTS	65536
+#define INDEX_HEAP	(1024 * 1024)
+
+/* largest name area */
+#define INDEX_HEAP_MAX	0x7fffffff
+
+/* maximum directory depth followed */
+#define INDEX_DEPTH	256
+
+/* name of removed records */
+#define INDEX_DEAD	0xffffffff
+
+typedef struct {
+    char magic[8];
+    uint32 version;
+    uint32 slots;			/* number of records, a power of two */
+    uint32 used;			/* records not free, removed ones too */
+    uint32 live;			/* records in use */
+    uint32 heap;			/* size of name area */
+    uint32 heap_used;
+} index_head_t;
+
+typedef struct {
+    uint64 ino;				/* 0 for free records */
+    uint64 parent;			/* inode of directory, 0 for roots */
+    uint32 dev;
+    uint32 name;			/* offset in name area */
+} index_rec_t;
+
+static char *index_file = NULL;
+static char *index_map = NULL;
+static size_t index_size = 0;
+static index_head_t *index_head;
+static index_rec_t *index_recs;
+static char *index_names;
+
+/* name bytes that did not fit, the index is grown by index_maintain */
+static size_t index_want = 0;
+
+/* protects the index */
+DEFINE_LOCK(index_lock);
+
+static size_t index_bytes(uint32 slots, uint32 heap)
+{
+    return sizeof(index_head_t) + (size_t) slots * sizeof(index_rec_t) +
+	heap;
+}
+
+static void index_attach(char *map, size_t size)
+{
+    index_map = map;
+    index_size = size;
+    index_head = (index_head_t *) map;
+    index_recs = (index_rec_t *) (map + sizeof(index_head_t));
+    index_names = (char *) (index_recs + index_head->slots);
+}
+
+static uint32 index_hash(uint32 dev, uint64 ino)
+{
+    uint64 h = (ino ^ ((uint64) dev << 40)) * 0x9e3779b97f4a7c15ULL;
+
+    return (uint32) (h >> 32);
+}
+
+/*
+ * find the record of an object in a table
+ * with insert, returns where to put it if it has none
+ */
+static index_rec_t *index_slot(index_rec_t * recs, uint32 slots, uint32 dev,
+			       uint64 ino, int insert)
+{
+    index_rec_t *r, *dead = NULL;
+    uint32 i, n;
+
+    i = index_hash(dev, ino) & (slots - 1);
+    for (n = 0; n < slots; n++, i = (i + 1) & (slots - 1)) {
+	r = &recs[i];
+	if (r->ino == 0)
+	    return insert ? (dead ? dead : r) : NULL;
+	if (r->name == INDEX_DEAD) {
+	    if (!dead)
+		dead = r;
+	} else if (r->ino == ino && r->dev == dev)
+	    return r;
+    }
+
+    return insert ? dead : NULL;
+}
+
+/*
+ * get the name of a record, NULL if the file is damaged
+ */
+static const char *index_name(index_rec_t * r)
+{
+    uint32 used = index_head->heap_used;
+
+    if (r->name >= used || !memchr(index_names + r->name, 0, used - r->name))
+	return NULL;
+
+    return index_names + r->name;
+}
+
+/*
+ * move the index to a larger file, dropping removed records and names
+ * no longer used; lock held, root credentials needed for the file
+ */
+static int index_grow(size_t need)
+{
+    index_head_t *head;
+    index_rec_t *recs, *r, *o;
+    const char *name;
+    char tmp[NFS_MAXPATHLEN + 8];
+    char *map, *names;
+    size_t heap = INDEX_HEAP, bytes = 0, size, len;
+    uint32 slots = INDEX_SLOTS, i;
+    int fd;
+
+    for (i = 0; i < index_head->slots; i++) {
+	o = &index_recs[i];
+	if (o->ino != 0 && o->name != INDEX_DEAD && (name = index_name(o)))
+	    bytes += strlen(name) + 1;
+    }
+    while (slots / 4 < index_head->live + 1)
+	slots *= 2;
+    while (heap < (bytes + need) * 2)
+	heap *= 2;
+    if (heap > INDEX_HEAP_MAX)
+	return FALSE;
+
+    size = index_bytes(slots, heap);
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", index_file) >=
+	(int) sizeof(tmp))
+	return FALSE;
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+	return FALSE;
+    if (ftruncate(fd, size) == -1) {
+	close(fd);
+	unlink(tmp);
+	return FALSE;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	unlink(tmp);
+	return FALSE;
+    }
+
+    head = (index_head_t *) map;
+    recs = (index_rec_t *) (map + sizeof(index_head_t));
+    names = (char *) (recs + slots);
+    memcpy(head->magic, INDEX_MAGIC, 8);
+    head->version = INDEX_VERSION;
+    head->slots = slots;
+    head->heap = heap;
+
+    for (i = 0; i < index_head->slots; i++) {
+	o = &index_recs[i];
+	if (o->ino == 0 || o->name == INDEX_DEAD || !(name = index_name(o)))
+	    continue;
+
+	r = index_slot(recs, slots, o->dev, o->ino, TRUE);
+	len = strlen(name) + 1;
+	*r = *o;
+	r->name = head->heap_used;
+	memcpy(names + head->heap_used, name, len);
+	head->heap_used += len;
+	head->used++;
+	head->live++;
+    }
+
+    if (rename(tmp, index_file) == -1) {
+	munmap(map, size);
+	unlink(tmp);
+	return FALSE;
+    }
+
+    munmap(index_map, index_size);
+    index_attach(map, size);
+    return TRUE;
+}
+
+/*
+ * remember the directory and name of an object, lock held
+ * grow is set for threads with root credentials, others leave a full
+ * index to index_maintain and drop the record
+ */
+static void index_put(uint32 dev, uint64 ino, uint64 parent,
+		      const char *name, int grow)
+{
+    index_rec_t *r;
+    const char *old;
+    size_t len = strlen(name) + 1;
+
+    if (!index_map || ino == 0)
+	return;
+
+    r = index_slot(index_recs, index_head->slots, dev, ino, FALSE);
+    if (r) {
+	/* export roots are only replaced by roots */
+	if (r->parent == 0 && parent != 0)
+	    return;
+	if (r->parent == parent && (old = index_name(r)) &&
+	    strcmp(old, name) == 0)
+	    return;
+    }
+
+    if (index_head->heap_used + len > index_head->heap ||
+	(!r && (index_head->used + 1) * 2 > index_head->slots)) {
+	if (!grow) {
+	    if (len > index_want)
+		index_want = len;
+	    return;
+	}
+	if (!index_grow(len))
+	    return;
+	index_want = 0;
+    }
+
+    r = index_slot(index_recs, index_head->slots, dev, ino, TRUE);
+    if (!r)
+	return;
+    if (r->ino == 0)
+	index_head->used++;
+    if (r->ino == 0 || r->name == INDEX_DEAD)
+	index_head->live++;
+
+    r->ino = ino;
+    r->dev = dev;
+    r->parent = parent;
+    r->name = index_head->heap_used;
+    memcpy(index_names + index_head->heap_used, name, len);
+    index_head->heap_used += len;
+}
+
+/*
+ * drop the record of an object, lock held
+ */
+static void index_forget(uint32 dev, uint64 ino)
+{
+    index_rec_t *r;
+
+    if (!index_map)
+	return;
+
+    r = index_slot(index_recs, index_head->slots, dev, ino, FALSE);
+    if (r) {
+	r->name = INDEX_DEAD;
+	index_head->live--;
+    }
+}
+
+/*
+ * remember the name of an object below its directory
+ */
+static void index_link(uint32 dev, uint64 ino, const char *path)
+{
+    backend_statstruct buf;
+    char dir[NFS_MAXPATHLEN];
+    const char *last;
+
+    last = strrchr(path, '/');
+    if (!last || !last[1])
+	return;
+
+    if (last == path)
+	strcpy(dir, "/");
+    else {
+	memcpy(dir, path, last - path);
+	dir[last - path] = 0;
+    }
+
+    if (backend_lstat(dir, &buf) == -1 || buf.st_dev != dev)
+	return;
+
+    LOCK(index_lock);
+    index_put(dev, ino, buf.st_ino, last + 1, FALSE);
+    UNLOCK(index_lock);
+}
+
+/*
+ * note the name of an object seen by a request
+ * only new names cost an lstat of the directory
+ */
+void index_add(uint32 dev, uint64 ino, const char *path)
+{
+    index_rec_t *r;
+    const char *name, *old;
+    int known = TRUE;
+
+    name = strrchr(path, '/');
+    if (!name || !name[1])
+	return;
+
+    LOCK(index_lock);
+    if (index_map) {
+	r = index_slot(index_recs, index_head->slots, dev, ino, FALSE);
+	known = r && (r->parent == 0 ||
+		      ((old = index_name(r)) && strcmp(old, name + 1) == 0));
+    }
+    UNLOCK(index_lock);
+
+    if (!known)
+	index_link(dev, ino, path);
+}
+
+/*
+ * note an object that has been renamed, or created or removed
+ */
+void index_moved(const char *path)
+{
+    backend_statstruct buf;
+
+    if (index_map && backend_lstat(path, &buf) != -1)
+	index_link(buf.st_dev, buf.st_ino, path);
+}
+
+/*
+ * resolve device and inode into a path through the index
+ * the path is stored in result, which must hold NFS_MAXPATHLEN bytes
+ */
+char *index_lookup(uint32 dev, uint64 ino, char *result, unfs3_ctx_t * ctx)
+{
+    const char *names[INDEX_DEPTH];
+    uint64 inos[INDEX_DEPTH];
+    size_t ends[INDEX_DEPTH];
+    backend_statstruct buf;
+    index_rec_t *r;
+    uint64 cur = ino;
+    size_t len = 0, n;
+    int i, depth = 0, found = FALSE;
+    char c;
+
+    LOCK(index_lock);
+    while (index_map && depth < INDEX_DEPTH) {
+	r = index_slot(index_recs, index_head->slots, dev, cur, FALSE);
+	if (!r || !(names[depth] = index_name(r)))
+	    break;
+	inos[depth++] = cur;
+	if (r->parent == 0) {
+	    found = names[depth - 1][0] == '/';
+	    break;
+	}
+	cur = r->parent;
+    }
+
+    /* root path, then the names below it */
+    for (i = depth - 1; found && i >= 0; i--) {
+	n = strlen(names[i]);
+	if (len + n + 2 > NFS_MAXPATHLEN)
+	    found = FALSE;
+	else if (i == depth - 1) {
+	    memcpy(result, names[i], n + 1);
+	    len = (n == 1) ? 0 : n;
+	    ends[i] = n;
+	} else {
+	    result[len++] = '/';
+	    memcpy(result + len, names[i], n + 1);
+	    len += n;
+	    ends[i] = len;
+	}
+    }
+
+    if (found)
+	index_hit++;
+    else if (index_map)
+	index_miss++;
+    UNLOCK(index_lock);
+
+    if (!found)
+	return NULL;
+
+    if (backend_lstat(result, &ctx->st) != -1 && ctx->st.st_dev == dev &&
+	ctx->st.st_ino == ino) {
+	ctx->st_valid = TRUE;
+	return result;
+    }
+
+    /* drop the topmost wrong record, those below it may still be right */
+    for (i = depth - 1; i > 0; i--) {
+	c = result[ends[i]];
+	result[ends[i]] = 0;
+	n = backend_lstat(result, &buf) != -1 && buf.st_dev == dev &&
+	    buf.st_ino == inos[i];
+	result[ends[i]] = c;
+	if (!n)
+	    break;
+    }
+
+    LOCK(index_lock);
+    index_forget(dev, inos[i]);
+    UNLOCK(index_lock);
+    ctx->st_valid = FALSE;
+    return NULL;
+}
+
+/*
+ * write the index to disk
+ */
+void index_sync(void)
+{
+    LOCK(index_lock);
+    if (index_map)
+	msync(index_map, index_size, MS_SYNC);
+    UNLOCK(index_lock);
+}
+
+/*
+ * grow the index when requests found it full, run by a timer
+ */
+void index_maintain(void)
+{
+    uid_t euid;
+    gid_t egid;
+
+    LOCK(index_lock);
+    if (index_map && index_want > 0) {
+	switch_save(&euid, &egid);
+	if (index_grow(index_want))
+	    index_want = 0;
+	switch_restore(euid, egid);
+    }
+    UNLOCK(index_lock);
+}
+
+#ifdef WANT_WORKERS
+
+/* directory still to be indexed */
+typedef struct index_dir {
+    struct index_dir *next;
+    uint64 ino;
+    char path[1];
+} index_dir_t;
+
+static int index_push(index_dir_t ** stack, const char *path, uint64 ino)
+{
+    index_dir_t *d;
+
+    d = malloc(sizeof(index_dir_t) + strlen(path));
+    if (!d)
+	return FALSE;
+
+    d->ino = ino;
+    strcpy(d->path, path);
+    d->next = *stack;
+    *stack = d;
+    return TRUE;
+}
+
+/*
+ * index an export and everything below it on the same file system
+ */
+static void index_walk(const char *root)
+{
+    index_dir_t *stack = NULL, *d;
+    backend_statstruct buf;
+    struct dirent *entry;
+    DIR *dir;
+    char path[NFS_MAXPATHLEN];
+    uint64 ino;
+    uint32 dev;
+    int fd;
+
+    if (backend_lstat(root, &buf) == -1 || !S_ISDIR(buf.st_mode))
+	return;
+    dev = buf.st_dev;
+
+    LOCK(index_lock);
+    index_put(dev, buf.st_ino, 0, root, TRUE);
+    UNLOCK(index_lock);
+
+    index_push(&stack, root, buf.st_ino);
+    while ((d = stack) != NULL) {
+	stack = d->next;
+
+	fd = open(d->path, O_RDONLY | O_DIRECTORY);
+	dir = (fd != -1) ? fdopendir(fd) : NULL;
+	if (!dir) {
+	    if (fd != -1)
+		close(fd);
+	    free(d);
+	    continue;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+	    if (strcmp(entry->d_name, ".") == 0 ||
+		strcmp(entry->d_name, "..") == 0)
+		continue;
+
+	    /* only directories need a stat */
+	    ino = entry->d_ino;
+	    if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) {
+		if (fstatat(fd, entry->d_name, &buf, AT_SYMLINK_NOFOLLOW) ==
+		    -1 || buf.st_dev != dev)
+		    continue;
+		ino = buf.st_ino;
+
+		if (S_ISDIR(buf.st_mode) &&
+		    snprintf(path, sizeof(path), "%s/%s",
+			     strcmp(d->path, "/") ? d->path : "",
+			     entry->d_name) < (int) sizeof(path))
+		    index_push(&stack, path, ino);
+	    }
+
+	    LOCK(index_lock);
+	    index_put(dev, ino, d->ino, entry->d_name, TRUE);
+	    UNLOCK(index_lock);
+	}
+
+	closedir(dir);
+	free(d);
+    }
+}
+
+static void *index_build(void *arg)
+{
+    char **dirs = arg;
+    sigset_t set;
+    int i;
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (i = 0; dirs[i]; i++) {
+	index_walk(dirs[i]);
+	free(dirs[i]);
+    }
+    free(dirs);
+
+    LOCK(index_lock);
+    logmsg(LOG_INFO, "inode index has %u entries", index_head->live);
+    UNLOCK(index_lock);
+
+    return NULL;
+}
+
+/*
+ * walk the exports in a thread of its own
+ */
+static void index_start(void)
+{
+    pthread_t thread;
+    exports list;
+    char **dirs;
+    int n = 0;
+
+    for (list = exports_nfslist; list; list = list->ex_next)
+	n++;
+    dirs = calloc(n + 1, sizeof(char *));
+    if (!dirs)
+	return;
+    n = 0;
+    for (list = exports_nfslist; list; list = list->ex_next)
+	if ((dirs[n] = strdup(list->ex_dir)))
+	    n++;
+
+    if (pthread_create(&thread, NULL, index_build, dirs) == 0) {
+	pthread_detach(thread);
+	return;
+    }
+
+    for (n = 0; dirs[n]; n++)
+	free(dirs[n]);
+    free(dirs);
+}
+
+#else				       /* WANT_WORKERS */
+
+/* without threads, the index is only filled by requests */
+static void index_start(void)
+{
+}
+
+#endif				       /* WANT_WORKERS */
+
+/*
+ * open or create the index file and start indexing the exports
+ * exports_parse must be called before
+ */
+int index_init(const char *file)
+{
+    index_head_t head;
+    struct stat st;
+    size_t size;
+    char *map;
+    int fd;
+
+    index_file = strdup(file);
+    if (!index_file)
+	return -1;
+
+    fd = open(file, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+	return -1;
+
+    if (fstat(fd, &st) == -1) {
+	close(fd);
+	return -1;
+    }
+
+    if (st.st_size < (off_t) sizeof(head) ||
+	pread(fd, &head, sizeof(head), 0) != sizeof(head) ||
+	memcmp(head.magic, INDEX_MAGIC, 8) != 0 ||
+	head.version != INDEX_VERSION || head.slots == 0 ||
+	(head.slots & (head.slots - 1)) != 0 ||
+	head.heap_used > head.heap ||
+	st.st_size != (off_t) index_bytes(head.slots, head.heap)) {
+	if (st.st_size > 0)
+	    logmsg(LOG_WARNING, "rebuilding invalid inode index %s", file);
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, INDEX_MAGIC, 8);
+	head.version = INDEX_VERSION;
+	head.slots = INDEX_SLOTS;
+	head.heap = INDEX_HEAP;
+	if (ftruncate(fd, 0) == -1 ||
+	    ftruncate(fd, index_bytes(head.slots, head.heap)) == -1 ||
+	    pwrite(fd, &head, sizeof(head), 0) != sizeof(head)) {
+	    close(fd);
+	    return -1;
+	}
+    }
+
+    size = index_bytes(head.slots, head.heap);
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return -1;
+
+    LOCK(index_lock);
+    index_attach(map, size);
+    UNLOCK(index_lock);
+
+    index_start();
+    return 0;
+}
+
+#else				       /* WIN32 */
+
+int index_init(U(const char *file))
+{
+    return -1;
+}
+
+void index_sync(void)
+{
+}
+
+char *index_lookup(U(uint32 dev), U(uint64 ino), U(char *result),
+		   U(unfs3_ctx_t * ctx))
+{
+    return NULL;
+}
+
+void index_add(U(uint32 dev), U(uint64 ino), U(const char *path))
+{
+}
+
+void index_moved(U(const char *path))
+{
+}
+
+void index_maintain(void)
+{
+}
+
+#endif				       /* WIN32 */
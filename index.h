@@ -0,0 +1,24 @@
+/*
+ * UNFS3 inode index
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_INDEX_H
+#define UNFS3_INDEX_H
+
+/* statistics */
+extern int index_hit;
+extern int index_miss;
+
+int index_init(const char *file);
+void index_sync(void);
+void index_maintain(void);
+
+char *index_lookup(uint32 dev, uint64 ino, char *result, unfs3_ctx_t *ctx);
+
+/* names seen by requests and notifications */
+void index_add(uint32 dev, uint64 ino, const char *path);
+void index_moved(const char *path);
+
+#endif
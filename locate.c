@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #ifdef HAVE_MNTENT_H
 #include <mntent.h>
@@ -27,6 +28,9 @@
 #include "nfs.h"
 #include "fh.h"
 #include "daemon.h"
+#include "context.h"
+#include "worker.h"
+#include "resolve.h"
 
 /*
  * these are the brute-force file searching routines that are used
@@ -44,7 +48,8 @@
 /*
  * locate file given prefix, device, and inode number
  */
-static int locate_pfx(const char *pfx, uint32 dev, uint64 ino, char *result)
+static int locate_pfx(const char *pfx, uint32 dev, uint64 ino, char *result,
+		      unfs3_ctx_t * ctx)
 {
     char path[NFS_MAXPATHLEN];
     backend_dirstream *search;
@@ -69,8 +74,8 @@ static int locate_pfx(const char *pfx, uint32 dev, uint64 ino, char *result)
 	/* check for matching object */
 	if (buf.st_dev == dev && buf.st_ino == ino) {
 	    strcpy(result, path);
-	    st_cache = buf;
-	    st_cache_valid = TRUE;
+	    ctx->st = buf;
+	    ctx->st_valid = TRUE;
 	    closedir(search);
 	    return TRUE;
 	}
@@ -78,7 +83,7 @@ static int locate_pfx(const char *pfx, uint32 dev, uint64 ino, char *result)
 	/* descend into directories with same dev */
 	if (buf.st_dev == dev && S_ISDIR(buf.st_mode) &&
 	    strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-	    res = locate_pfx(path, dev, ino, result);
+	    res = locate_pfx(path, dev, ino, result, ctx);
 	    if (res == TRUE) {
 		closedir(search);
 		return TRUE;
@@ -91,19 +96,47 @@ static int locate_pfx(const char *pfx, uint32 dev, uint64 ino, char *result)
 }
 #endif
 
+#if HAVE_MNTENT_H == 1 || HAVE_SYS_MNTTAB_H == 1
+
 /*
- * locate file given device and inode number
- *
- * slow fallback in case other filehandle resolution functions fail
+ * mount points are remembered by device; the table is read again when
+ * a device is missing or its mount point has changed, at most once a
+ * second
  */
-char *locate_file(U(uint32 dev), U(uint64 ino))
+
+/* number of mount points remembered */
+#define LOCATE_MOUNTS	256
+
+static struct {
+    uint32 dev;
+    char *dir;
+} locate_mounts[LOCATE_MOUNTS];
+static int locate_mount_count = 0;
+static time_t locate_mount_read = 0;
+
+/* protects the mount table */
+DEFINE_LOCK(locate_lock);
+
+static void locate_mount_add(const char *dir)
 {
-#if HAVE_MNTENT_H == 1 || HAVE_SYS_MNTTAB_H == 1
-    static char path[NFS_MAXPATHLEN];
-    FILE *mtab;
     struct stat buf;
-    int res;
-#endif
+
+    if (locate_mount_count == LOCATE_MOUNTS || lstat(dir, &buf) != 0)
+	return;
+
+    locate_mounts[locate_mount_count].dir = strdup(dir);
+    if (locate_mounts[locate_mount_count].dir) {
+	locate_mounts[locate_mount_count].dev = buf.st_dev;
+	locate_mount_count++;
+    }
+}
+
+/*
+ * read the mount table, lock held
+ */
+static void locate_mount_table(void)
+{
+    FILE *mtab;
 
 #ifdef HAVE_MNTENT_H
     struct mntent *ent;
@@ -111,60 +144,94 @@ char *locate_file(U(uint32 dev), U(uint64 ino))
 
 #ifdef HAVE_SYS_MNTTAB_H
     struct mnttab ent;
-    int found = FALSE;
 #endif
 
-    if (!opt_brute_force)
-	return NULL;
+    while (locate_mount_count > 0)
+	free(locate_mounts[--locate_mount_count].dir);
+    locate_mount_read = time(NULL);
 
 #ifdef HAVE_MNTENT_H
     mtab = setmntent("/etc/mtab", "r");
     if (!mtab)
-	return NULL;
+	return;
 
-    /* 
-     * look for mtab entry with matching device
-     */
-    while ((ent = getmntent(mtab))) {
-	res = lstat(ent->mnt_dir, &buf);
-
-	if (res == 0 && buf.st_dev == dev)
-	    break;
-    }
+    while ((ent = getmntent(mtab)))
+	locate_mount_add(ent->mnt_dir);
     endmntent(mtab);
-
-    /* found matching entry? */
-    if (ent) {
-	res = locate_pfx(ent->mnt_dir, dev, ino, path);
-	if (res == TRUE)
-	    return path;
-    }
 #endif
 
 #ifdef HAVE_SYS_MNTTAB_H
     mtab = fopen("/etc/mnttab", "r");
     if (!mtab)
-	return NULL;
+	return;
+
+    while (getmntent(mtab, &ent) == 0)
+	locate_mount_add(ent.mnt_mountp);
+    fclose(mtab);
+#endif
+}
+
+/*
+ * get the mount point of a device
+ */
+static int locate_mount(uint32 dev, char *dir)
+{
+    struct stat buf;
+    int i, pass, found = FALSE;
+
+    LOCK(locate_lock);
+    for (pass = 0; pass < 2 && !found; pass++) {
+	if (pass == 1) {
+	    if (locate_mount_read == time(NULL))
+		break;
+	    locate_mount_table();
+	}
 
-    /* 
-     * look for mnttab entry with matching device
-     */
-    while (getmntent(mtab, &ent) == 0) {
-	res = lstat(ent.mnt_mountp, &buf);
+	for (i = 0; i < locate_mount_count; i++)
+	    if (locate_mounts[i].dev == dev)
+		break;
 
-	if (res == 0 && buf.st_dev == dev) {
+	/* the same directory may have something else mounted now */
+	if (i < locate_mount_count &&
+	    lstat(locate_mounts[i].dir, &buf) == 0 && buf.st_dev == dev) {
+	    strcpy(dir, locate_mounts[i].dir);
 	    found = TRUE;
-	    break;
 	}
     }
-    fclose(mtab);
+    UNLOCK(locate_lock);
 
-    /* found matching entry? */
-    if (found) {
-	res = locate_pfx(ent.mnt_mountp, dev, ino, path);
-	if (res == TRUE)
-	    return path;
+    return found;
+}
+#endif
+
+/*
+ * locate file given device and inode number
+ *
+ * slow fallback in case other filehandle resolution functions fail
+ * the path is stored in result, which must hold NFS_MAXPATHLEN bytes
+ * ctx->fh_busy is set if the search goes on in the background
+ */
+char *locate_file(U(uint32 dev), U(uint64 ino), U(char *result),
+		  U(unfs3_ctx_t * ctx))
+{
+#if HAVE_MNTENT_H == 1 || HAVE_SYS_MNTTAB_H == 1
+    char dir[NFS_MAXPATHLEN];
+
+    if (!opt_brute_force || !locate_mount(dev, dir))
+	return NULL;
+
+    switch (resolve_locate(dev, ino, dir, result, ctx)) {
+	case RESOLVE_FOUND:
+	    return result;
+	case RESOLVE_NONE:
+	    return NULL;
+	case RESOLVE_BUSY:
+	    ctx->fh_busy = TRUE;
+	    return NULL;
     }
+
+    if (locate_pfx(dir, dev, ino, result, ctx) == TRUE)
+	return result;
 #endif
 
     return NULL;
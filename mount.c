@@ -30,6 +30,8 @@
 #include "Config/exports.h"
 #include "password.h"
 #include "backend.h"
+#include "worker.h"
+#include "context.h"
 
 #ifndef PATH_MAX
 # define PATH_MAX	4096
@@ -49,6 +51,9 @@ static mountlist mount_list = NULL;
 
 static char nonce[32] = "";
 
+/* protects mount list, mount count, and nonce */
+DEFINE_LOCK(mount_lock);
+
 /*
  * add entry to mount list
  */
@@ -85,6 +90,7 @@ static void add_mount(const char *path, struct svc_req *rqstp)
     strcpy(new->ml_hostname, host);
     strcpy(new->ml_directory, path);
 
+    LOCK(mount_lock);
     iter = mount_list;
     if (iter) {
 	while (iter->ml_next)
@@ -94,18 +100,38 @@ static void add_mount(const char *path, struct svc_req *rqstp)
 	mount_list = new;
 
     mount_cnt++;
+    UNLOCK(mount_lock);
+}
+
+/*
+ * free a mount list
+ */
+static void free_mounts(mountlist list)
+{
+    mountlist next;
+
+    while (list) {
+	next = list->ml_next;
+	free(list->ml_hostname);
+	free(list->ml_directory);
+	free(list);
+	list = next;
+    }
 }
 
 /*
  * remove entries from mount list
+ * returns number of mounts still active
  */
-static void remove_mount(const char *path, struct svc_req *rqstp)
+static int remove_mount(const char *path, struct svc_req *rqstp)
 {
     mountlist iter, next, prev = NULL;
     char *host;
+    int cnt;
 
     host = inet_ntoa(get_remote(rqstp));
 
+    LOCK(mount_lock);
     iter = mount_list;
     while (iter) {
 	if (strcmp(iter->ml_hostname, host) == 0 &&
@@ -131,24 +157,29 @@ static void remove_mount(const char *path, struct svc_req *rqstp)
 	    iter = iter->ml_next;
 	}
     }
+    cnt = mount_cnt;
+    UNLOCK(mount_lock);
+
+    return cnt;
 }
 
-void *mountproc_null_3_svc(U(void *argp), U(struct svc_req *rqstp))
+void *mountproc_null_3_svc(U(void *argp), U(unfs3_ctx_t * ctx))
 {
     static void *result = NULL;
 
     return &result;
 }
 
-mountres3 *mountproc_mnt_3_svc(dirpath * argp, struct svc_req * rqstp)
+mountres3 *mountproc_mnt_3_svc(dirpath * argp, unfs3_ctx_t * ctx)
 {
     char buf[PATH_MAX];
     unfs3_fh_t fh;
     nfs_fh3 nfh;
-    static char fhbuf[FH_MAXBUF];
-    static mountres3 result;
+    mountres3 *result = &ctx->res.mnt;
+    struct svc_req *rqstp = ctx->rqstp;
     static int auth = AUTH_UNIX;
     int authenticated = 0;
+    int res;
     char *password;
 
     /* We need to modify the *argp pointer. Make a copy. */
@@ -159,28 +190,32 @@ mountres3 *mountproc_mnt_3_svc(dirpath * argp, struct svc_req * rqstp)
 	logmsg(LOG_INFO,
 	       "%s attempted mount with unsupported protocol version",
 	       inet_ntoa(get_remote(rqstp)));
-	result.fhs_status = MNT3ERR_INVAL;
-	return &result;
+	result->fhs_status = MNT3ERR_INVAL;
+	return result;
     }
 
     /* Check for "mount commands" */
     if (strncmp(dpath, "@getnonce", sizeof("@getnonce") - 1) == 0) {
-	if (backend_gen_nonce(nonce) < 0) {
-	    result.fhs_status = MNT3ERR_IO;
+	LOCK(mount_lock);
+	res = backend_gen_nonce(nonce);
+	memcpy(ctx->nonce, nonce, 32);
+	UNLOCK(mount_lock);
+	if (res < 0) {
+	    result->fhs_status = MNT3ERR_IO;
 	} else {
-	    result.fhs_status = MNT3_OK;
-	    result.mountres3_u.mountinfo.fhandle.fhandle3_len = 32;
-	    result.mountres3_u.mountinfo.fhandle.fhandle3_val = nonce;
-	    result.mountres3_u.mountinfo.auth_flavors.auth_flavors_len = 1;
-	    result.mountres3_u.mountinfo.auth_flavors.auth_flavors_val =
+	    result->fhs_status = MNT3_OK;
+	    result->mountres3_u.mountinfo.fhandle.fhandle3_len = 32;
+	    result->mountres3_u.mountinfo.fhandle.fhandle3_val = ctx->nonce;
+	    result->mountres3_u.mountinfo.auth_flavors.auth_flavors_len = 1;
+	    result->mountres3_u.mountinfo.auth_flavors.auth_flavors_val =
 		&auth;
 	}
-	return &result;
+	return result;
     } else if (strncmp(dpath, "@password:", sizeof("@password:") - 1) == 0) {
 	char pw[PASSWORD_MAXLEN + 1];
 
 	mnt_cmd_argument(&dpath, "@password:", pw, PASSWORD_MAXLEN);
-	if (exports_options(dpath, rqstp, &password, NULL) != -1) {
+	if (exports_options(dpath, ctx, &password, NULL) != -1) {
 	    authenticated = !strcmp(password, pw);
 	}
 	/* else leave authenticated unchanged */
@@ -192,7 +227,8 @@ mountres3 *mountproc_mnt_3_svc(dirpath * argp, struct svc_req * rqstp)
 	char hexdigest[32];
 
 	mnt_cmd_argument(&dpath, "@otp:", otp, PASSWORD_MAXLEN);
-	if (exports_options(dpath, rqstp, &password, NULL) != -1) {
+	if (exports_options(dpath, ctx, &password, NULL) != -1) {
+	    LOCK(mount_lock);
 	    otp_digest(nonce, password, hexdigest);
 
 	    /* Compare our calculated digest with what the client submitted */
@@ -200,94 +236,117 @@ mountres3 *mountproc_mnt_3_svc(dirpath * argp, struct svc_req * rqstp)
 
 	    /* Change nonce */
 	    backend_gen_nonce(nonce);
+	    UNLOCK(mount_lock);
 	}
 	/* else leave authenticated unchanged */
     }
 
-    if ((exports_opts & OPT_REMOVABLE) && export_point(dpath)) {
+    if ((ctx->opts & OPT_REMOVABLE) && export_point(dpath)) {
 	/* Removable media export point. Do not call realpath; simply copy
 	   path */
 	strncpy(buf, dpath, PATH_MAX);
     } else if (!backend_realpath(dpath, buf)) {
 	/* the given path does not exist */
-	result.fhs_status = MNT3ERR_NOENT;
-	return &result;
+	result->fhs_status = MNT3ERR_NOENT;
+	return result;
     }
 
     if (strlen(buf) + 1 > NFS_MAXPATHLEN) {
 	logmsg(LOG_INFO, "%s attempted to mount jumbo path",
 	       inet_ntoa(get_remote(rqstp)));
-	result.fhs_status = MNT3ERR_NAMETOOLONG;
-	return &result;
+	result->fhs_status = MNT3ERR_NAMETOOLONG;
+	return result;
     }
 
-    if ((exports_options(buf, rqstp, &password, NULL) == -1)
+    if ((exports_options(buf, ctx, &password, NULL) == -1)
 	|| (!authenticated && password[0])
-	|| (!(exports_opts & OPT_INSECURE) &&
+	|| (!(ctx->opts & OPT_INSECURE) &&
 	    !IS_SECURE(ntohs(get_port(rqstp))))
 	) {
 	/* not exported to this host or at all, or a password defined and not 
 	   authenticated */
-	result.fhs_status = MNT3ERR_ACCES;
-	return &result;
+	result->fhs_status = MNT3ERR_ACCES;
+	return result;
     }
 
-    fh = fh_comp(buf, rqstp, FH_DIR);
+    fh = fh_comp(buf, ctx, FH_DIR);
 
     if (!fh_valid(fh)) {
 	logmsg(LOG_INFO, "%s attempted to mount non-directory",
 	       inet_ntoa(get_remote(rqstp)));
-	result.fhs_status = MNT3ERR_NOTDIR;
-	return &result;
+	result->fhs_status = MNT3ERR_NOTDIR;
+	return result;
     }
 
     add_mount(dpath, rqstp);
 
-    nfh = fh_encode(&fh, fhbuf);
+    nfh = fh_encode(&fh, ctx->fhbuf);
 
-    result.fhs_status = MNT3_OK;
-    result.mountres3_u.mountinfo.fhandle.fhandle3_len = nfh.data.data_len;
-    result.mountres3_u.mountinfo.fhandle.fhandle3_val = nfh.data.data_val;
-    result.mountres3_u.mountinfo.auth_flavors.auth_flavors_len = 1;
-    result.mountres3_u.mountinfo.auth_flavors.auth_flavors_val = &auth;
+    result->fhs_status = MNT3_OK;
+    result->mountres3_u.mountinfo.fhandle.fhandle3_len = nfh.data.data_len;
+    result->mountres3_u.mountinfo.fhandle.fhandle3_val = nfh.data.data_val;
+    result->mountres3_u.mountinfo.auth_flavors.auth_flavors_len = 1;
+    result->mountres3_u.mountinfo.auth_flavors.auth_flavors_val = &auth;
 
-    return &result;
+    return result;
 }
 
-mountlist *mountproc_dump_3_svc(U(void *argp), U(struct svc_req *rqstp))
+mountlist *mountproc_dump_3_svc(U(void *argp), unfs3_ctx_t * ctx)
 {
-    return &mount_list;
+    mountlist iter, new, *tail;
+
+    /* reply with a copy, the list may change while it is being sent */
+    free_mounts(ctx->dump);
+    ctx->dump = NULL;
+    tail = &ctx->dump;
+
+    LOCK(mount_lock);
+    for (iter = mount_list; iter; iter = iter->ml_next) {
+	new = malloc(sizeof(struct mountbody));
+	if (!new)
+	    break;
+	new->ml_hostname = strdup(iter->ml_hostname);
+	new->ml_directory = strdup(iter->ml_directory);
+	new->ml_next = NULL;
+	if (!new->ml_hostname || !new->ml_directory) {
+	    free(new->ml_hostname);
+	    free(new->ml_directory);
+	    free(new);
+	    break;
+	}
+	*tail = new;
+	tail = &new->ml_next;
+    }
+    UNLOCK(mount_lock);
+
+    return &ctx->dump;
 }
 
-void *mountproc_umnt_3_svc(dirpath * argp, struct svc_req *rqstp)
+void *mountproc_umnt_3_svc(dirpath * argp, unfs3_ctx_t * ctx)
 {
     /* RPC times out if we use a NULL pointer */
     static void *result = NULL;
 
-    remove_mount(*argp, rqstp);
-
     /* if no more mounts are active, flush all open file descriptors */
-    if (mount_cnt == 0)
+    if (remove_mount(*argp, ctx->rqstp) == 0)
 	fd_cache_purge();
 
     return &result;
 }
 
-void *mountproc_umntall_3_svc(U(void *argp), struct svc_req *rqstp)
+void *mountproc_umntall_3_svc(U(void *argp), unfs3_ctx_t * ctx)
 {
     /* RPC times out if we use a NULL pointer */
     static void *result = NULL;
 
-    remove_mount(NULL, rqstp);
-
     /* if no more mounts are active, flush all open file descriptors */
-    if (mount_cnt == 0)
+    if (remove_mount(NULL, ctx->rqstp) == 0)
 	fd_cache_purge();
 
     return &result;
 }
 
-exports *mountproc_export_3_svc(U(void *argp), U(struct svc_req *rqstp))
+exports *mountproc_export_3_svc(U(void *argp), U(unfs3_ctx_t * ctx))
 {
     return &exports_nfslist;
 }
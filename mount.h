@@ -81,17 +81,17 @@ typedef struct exportnode exportnode;
 #define MOUNTVERS3 3
 
 #define MOUNTPROC_NULL 0
-extern  void * mountproc_null_3_svc(void *, struct svc_req *);
+extern  void * mountproc_null_3_svc(void *, unfs3_ctx_t *);
 #define MOUNTPROC_MNT 1
-extern  mountres3 * mountproc_mnt_3_svc(dirpath *, struct svc_req *);
+extern  mountres3 * mountproc_mnt_3_svc(dirpath *, unfs3_ctx_t *);
 #define MOUNTPROC_DUMP 2
-extern  mountlist * mountproc_dump_3_svc(void *, struct svc_req *);
+extern  mountlist * mountproc_dump_3_svc(void *, unfs3_ctx_t *);
 #define MOUNTPROC_UMNT 3
-extern  void * mountproc_umnt_3_svc(dirpath *, struct svc_req *);
+extern  void * mountproc_umnt_3_svc(dirpath *, unfs3_ctx_t *);
 #define MOUNTPROC_UMNTALL 4
-extern  void * mountproc_umntall_3_svc(void *, struct svc_req *);
+extern  void * mountproc_umntall_3_svc(void *, unfs3_ctx_t *);
 #define MOUNTPROC_EXPORT 5
-extern  exports * mountproc_export_3_svc(void *, struct svc_req *);
+extern  exports * mountproc_export_3_svc(void *, unfs3_ctx_t *);
 extern int mountprog_3_freeresult (SVCXPRT *, xdrproc_t, caddr_t);
 
 #endif /* !_MOUNT_H_RPCGEN */
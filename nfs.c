@@ -28,6 +28,7 @@
 #ifndef WIN32
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <syslog.h>
 #endif				       /* WIN32 */
 
 #if HAVE_STATVFS == 1
@@ -49,6 +50,18 @@
 #include "backend.h"
 #include "Config/exports.h"
 #include "Extras/cluster.h"
+#include "worker.h"
+#include "context.h"
+#include "flush.h"
+#include "xdr.h"
+#include "tcp.h"
+#include "index.h"
+
+/*
+ * the umask is per process; creating operations hold this shared,
+ * SYMLINK and socket creation hold it exclusively while they change it
+ */
+DEFINE_RWLOCK(umask_lock);
 
 /*
  * decompose filehandle and switch user if permitted access
@@ -57,21 +70,23 @@
 #define PREP(p,f) do {						\
                       unfs3_fh_t fh = fh_decode(&f); \
                       switch_to_root();				\
-                      p = fh_decomp(f);				\
-                      if (exports_options(p, rqstp, NULL, NULL) == -1) { \
-                          memset(&result, 0, sizeof(result));	\
+                      p = fh_decomp(f, ctx);			\
+                      if (exports_options(p, ctx, NULL, NULL) == -1) { \
+                          memset(result, 0, sizeof(*result));	\
                           if (p)				\
-                              result.status = NFS3ERR_ACCES;	\
+                              result->status = NFS3ERR_ACCES;	\
+                          else if (ctx->fh_busy)		\
+                              result->status = NFS3ERR_JUKEBOX;	\
                           else					\
-                              result.status = NFS3ERR_STALE;	\
-                          return &result;			\
+                              result->status = NFS3ERR_STALE;	\
+                          return result;			\
+                      }						\
+                      if (fh.pwhash != ctx->pwhash) {		\
+                          memset(result, 0, sizeof(*result));	\
+                          result->status = NFS3ERR_STALE;	\
+                          return result;			\
                       }						\
-                      if (fh.pwhash != export_password_hash) { \
-                          memset(&result, 0, sizeof(result));	\
-                          result.status = NFS3ERR_STALE;        \
-                          return &result;                       \
-                      }                                         \
-                      switch_user(rqstp);			\
+                      switch_user(ctx);				\
                   } while (0)
 
 /*
@@ -110,9 +125,9 @@ nfsstat3 cat_name(const char *path, const char *name, char *result)
 	if (!last || last == path)
 	    strcpy(result, "/");
 	else {
-	    *last = 0;
-	    strcpy(result, path);
-	    *last = '/';
+	    /* path may be shared with other threads, do not modify it */
+	    memcpy(result, path, last - path);
+	    result[last - path] = 0;
 	}
 	return NFS3_OK;
     }
@@ -121,7 +136,7 @@ nfsstat3 cat_name(const char *path, const char *name, char *result)
     return NFS3_OK;
 }
 
-void *nfsproc3_null_3_svc(U(void *argp), U(struct svc_req *rqstp))
+void *nfsproc3_null_3_svc(U(void *argp), U(unfs3_ctx_t * ctx))
 {
     static void *result = NULL;
 
@@ -129,20 +144,20 @@ void *nfsproc3_null_3_svc(U(void *argp), U(struct svc_req *rqstp))
 }
 
 GETATTR3res *nfsproc3_getattr_3_svc(GETATTR3args * argp,
-				    struct svc_req * rqstp)
+				    unfs3_ctx_t * ctx)
 {
-    static GETATTR3res result;
+    GETATTR3res *result = &ctx->res.getattr;
     char *path;
     post_op_attr post;
 
     PREP(path, argp->object);
-    post = get_post_cached(rqstp);
+    post = get_post_cached(ctx);
 
-    result.status = NFS3_OK;
-    result.GETATTR3res_u.resok.obj_attributes =
+    result->status = NFS3_OK;
+    result->GETATTR3res_u.resok.obj_attributes =
 	post.post_op_attr_u.attributes;
 
-    return &result;
+    return result;
 }
 
 /*
@@ -164,31 +179,30 @@ static nfsstat3 in_sync(sattrguard3 guard, pre_op_attr pre)
 }
 
 SETATTR3res *nfsproc3_setattr_3_svc(SETATTR3args * argp,
-				    struct svc_req * rqstp)
+				    unfs3_ctx_t * ctx)
 {
-    static SETATTR3res result;
+    SETATTR3res *result = &ctx->res.setattr;
     pre_op_attr pre;
     char *path;
 
     PREP(path, argp->object);
-    pre = get_pre_cached();
-    result.status = join(in_sync(argp->guard, pre), exports_rw());
+    pre = get_pre_cached(ctx);
+    result->status = join(in_sync(argp->guard, pre), exports_rw(ctx));
 
-    if (result.status == NFS3_OK)
-	result.status = set_attr(path, argp->object, argp->new_attributes);
+    if (result->status == NFS3_OK)
+	result->status = set_attr(path, argp->object, argp->new_attributes);
 
     /* overlaps with resfail */
-    result.SETATTR3res_u.resok.obj_wcc.before = pre;
-    result.SETATTR3res_u.resok.obj_wcc.after = get_post_stat(path, rqstp);
+    result->SETATTR3res_u.resok.obj_wcc.before = pre;
+    result->SETATTR3res_u.resok.obj_wcc.after = get_post_stat(path, ctx);
 
-    return &result;
+    return result;
 }
 
-LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
+LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, unfs3_ctx_t * ctx)
 {
-    static LOOKUP3res result;
+    LOOKUP3res *result = &ctx->res.lookup;
     unfs3_fh_t *fh;
-    static char fhbuf[FH_MAXBUF];
     char *path;
     char obj[NFS_MAXPATHLEN];
     backend_statstruct buf;
@@ -196,51 +210,51 @@ LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
     uint32 gen;
 
     PREP(path, argp->what.dir);
-    result.status = cat_name(path, argp->what.name, obj);
+    result->status = cat_name(path, argp->what.name, obj);
 
-    cluster_lookup(obj, rqstp, &result.status);
+    cluster_lookup(obj, ctx->rqstp, &result->status);
 
-    if (result.status == NFS3_OK) {
+    if (result->status == NFS3_OK) {
 	res = backend_lstat(obj, &buf);
 	if (res == -1)
-	    result.status = lookup_err();
+	    result->status = lookup_err();
 	else {
 	    if (strcmp(argp->what.name, ".") == 0 ||
 		strcmp(argp->what.name, "..") == 0) {
-		fh = fh_comp_ptr(obj, rqstp, 0);
+		fh = fh_comp_ptr(obj, ctx, 0);
 	    } else {
 		gen = backend_get_gen(buf, FD_NONE, obj);
-		fh = fh_extend(argp->what.dir, buf.st_dev, buf.st_ino, gen);
+		fh = fh_extend(argp->what.dir, obj, &buf, gen, ctx);
 		fh_cache_add(buf.st_dev, buf.st_ino, obj);
 	    }
 
 	    if (fh) {
-		result.LOOKUP3res_u.resok.object = fh_encode(fh, fhbuf);
-		result.LOOKUP3res_u.resok.obj_attributes =
-		    get_post_buf(buf, rqstp);
+		result->LOOKUP3res_u.resok.object = fh_encode(fh, ctx->fhbuf);
+		result->LOOKUP3res_u.resok.obj_attributes =
+		    get_post_buf(buf, ctx);
 	    } else {
 		/* path was too long */
-		result.status = NFS3ERR_NAMETOOLONG;
+		result->status = NFS3ERR_NAMETOOLONG;
 	    }
 	}
     }
 
     /* overlaps with resfail */
-    result.LOOKUP3res_u.resok.dir_attributes = get_post_stat(path, rqstp);
+    result->LOOKUP3res_u.resok.dir_attributes = get_post_stat(path, ctx);
 
-    return &result;
+    return result;
 }
 
-ACCESS3res *nfsproc3_access_3_svc(ACCESS3args * argp, struct svc_req * rqstp)
+ACCESS3res *nfsproc3_access_3_svc(ACCESS3args * argp, unfs3_ctx_t * ctx)
 {
-    static ACCESS3res result;
+    ACCESS3res *result = &ctx->res.access;
     char *path;
     post_op_attr post;
     mode_t mode;
     int newaccess = 0;
 
     PREP(path, argp->object);
-    post = get_post_cached(rqstp);
+    post = get_post_cached(ctx);
     mode = post.post_op_attr_u.attributes.mode;
 
     if (access(path, R_OK) != -1)
@@ -256,7 +270,7 @@ ACCESS3res *nfsproc3_access_3_svc(ACCESS3args * argp, struct svc_req * rqstp)
     }
 
     /* root is allowed everything */
-    if (get_uid(rqstp) == 0)
+    if (get_uid(ctx) == 0)
 	newaccess |= ACCESS3_READ | ACCESS3_MODIFY | ACCESS3_EXTEND;
 
     /* adjust if directory */
@@ -268,78 +282,133 @@ ACCESS3res *nfsproc3_access_3_svc(ACCESS3args * argp, struct svc_req * rqstp)
 	newaccess &= ~ACCESS3_EXECUTE;
     }
 
-    result.status = NFS3_OK;
-    result.ACCESS3res_u.resok.access = newaccess & argp->access;
-    result.ACCESS3res_u.resok.obj_attributes = post;
+    result->status = NFS3_OK;
+    result->ACCESS3res_u.resok.access = newaccess & argp->access;
+    result->ACCESS3res_u.resok.obj_attributes = post;
 
-    return &result;
+    return result;
 }
 
 READLINK3res *nfsproc3_readlink_3_svc(READLINK3args * argp,
-				      struct svc_req * rqstp)
+				      unfs3_ctx_t * ctx)
 {
-    static READLINK3res result;
-    char *path;
-    static char buf[NFS_MAXPATHLEN];
-    int res;
+    READLINK3res *result = &ctx->res.readlink;
+    char *path, *buf;
+    int res = -1;
 
     PREP(path, argp->symlink);
 
-    res = backend_readlink(path, buf, NFS_MAXPATHLEN - 1);
+    buf = ctx_data(ctx);
+    if (buf)
+	res = backend_readlink(path, buf, NFS_MAXPATHLEN - 1);
     if (res == -1)
-	result.status = readlink_err();
+	result->status = readlink_err();
     else {
 	/* readlink does not NULL-terminate */
 	buf[res] = 0;
 
-	result.status = NFS3_OK;
-	result.READLINK3res_u.resok.data = buf;
+	result->status = NFS3_OK;
+	result->READLINK3res_u.resok.data = buf;
     }
 
     /* overlaps with resfail */
-    result.READLINK3res_u.resok.symlink_attributes =
-	get_post_stat(path, rqstp);
+    result->READLINK3res_u.resok.symlink_attributes =
+	get_post_stat(path, ctx);
 
-    return &result;
+    return result;
 }
 
-READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
+/*
+ * answer a READ over the native TCP transport, the data goes from the
+ * file to the socket without a copy; eof is found from the file size
+ * returns FALSE if the transport cannot do this
+ */
+static int read_splice(READ3args * argp, unfs3_ctx_t * ctx, int fd)
 {
-    static READ3res result;
-    char *path;
+    READ3res *result = &ctx->res.read;
+    backend_statstruct buf;
+    uint64 count = 0;
+    int eof;
+
+    if (backend_fstat(fd, &buf) == -1)
+	return FALSE;
+
+    if (argp->offset < (uint64) buf.st_size)
+	count = buf.st_size - argp->offset;
+    if (count > argp->count)
+	count = argp->count;
+    eof = (argp->offset + count >= (uint64) buf.st_size);
+
+    if (!tcp_splice(ctx->rqstp->rq_xprt, fd, (off64_t) argp->offset, count))
+	return FALSE;
+
+    /* the data is left empty here and sent by the transport */
+    result->status = NFS3_OK;
+    result->READ3res_u.resok.file_attributes = get_post_buf(buf, ctx);
+    result->READ3res_u.resok.count = count;
+    result->READ3res_u.resok.eof = eof;
+    result->READ3res_u.resok.data.data_len = 0;
+    result->READ3res_u.resok.data.data_val = NULL;
+
+    if (!svc_sendreply(ctx->rqstp->rq_xprt, (xdrproc_t) xdr_READ3res,
+		       (caddr_t) result))
+	logmsg(LOG_CRIT, "unable to send RPC reply");
+
+    /* close for real when hitting eof */
+    fd_close(fd, UNFS3_FD_READ, eof ? FD_CLOSE_REAL : FD_CLOSE_VIRT);
+
+    return TRUE;
+}
+
+READ3res *nfsproc3_read_3_svc(READ3args * argp, unfs3_ctx_t * ctx)
+{
+    READ3res *result = &ctx->res.read;
+    char *path, *buf = NULL;
     int fd, res;
-    static char buf[NFS_MAXDATA_TCP + 1];
     unsigned int maxdata;
 
-    if (get_socket_type(rqstp) == SOCK_STREAM)
+    if (get_socket_type(ctx->rqstp) == SOCK_STREAM)
 	maxdata = NFS_MAXDATA_TCP;
     else
 	maxdata = NFS_MAXDATA_UDP;
 
     PREP(path, argp->file);
-    result.status = is_reg();
+    result->status = is_reg(ctx);
 
     /* handle reading of executables */
-    read_executable(rqstp, st_cache);
+    read_executable(ctx, ctx->st);
 
     /* handle read of owned files */
-    read_by_owner(rqstp, st_cache);
+    read_by_owner(ctx, ctx->st);
 
     /* if bigger than rtmax, truncate length */
     if (argp->count > maxdata)
 	argp->count = maxdata;
 
-    if (result.status == NFS3_OK) {
+    if (result->status == NFS3_OK && !(buf = ctx_data(ctx)))
+	result->status = NFS3ERR_IO;
+
+    if (result->status == NFS3_OK) {
 	fd = fd_open(path, argp->file, UNFS3_FD_READ, TRUE);
+	if (fd != -1) {
+	    fd_flush_behind(argp->file);
+	    fd_readahead(fd, argp->offset, argp->count);
+	}
+
+	/* the reply has been sent if this works */
+	if (fd != -1 && maxdata == NFS_MAXDATA_TCP &&
+	    read_splice(argp, ctx, fd))
+	    return NULL;
+
 	if (fd != -1) {
 	    /* read one more to check for eof */
 	    res = backend_pread(fd, buf, argp->count + 1, (off64_t)argp->offset);
 
 	    /* eof if we could not read one more */
-	    result.READ3res_u.resok.eof = (res <= (int64) argp->count);
+	    result->READ3res_u.resok.eof = (res <= (int64) argp->count);
 
 	    /* close for real when hitting eof */
-	    if (result.READ3res_u.resok.eof)
+	    if (result->READ3res_u.resok.eof)
 		fd_close(fd, UNFS3_FD_READ, FD_CLOSE_REAL);
 	    else {
 		fd_close(fd, UNFS3_FD_READ, FD_CLOSE_VIRT);
@@ -347,42 +416,45 @@ READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
 	    }
 
 	    if (res >= 0) {
-		result.READ3res_u.resok.count = res;
-		result.READ3res_u.resok.data.data_len = res;
-		result.READ3res_u.resok.data.data_val = buf;
+		result->READ3res_u.resok.count = res;
+		result->READ3res_u.resok.data.data_len = res;
+		result->READ3res_u.resok.data.data_val = buf;
 	    } else {
 		/* error during read() */
 
 		/* EINVAL means unreadable object */
 		if (errno == EINVAL)
-		    result.status = NFS3ERR_INVAL;
+		    result->status = NFS3ERR_INVAL;
 		else
-		    result.status = NFS3ERR_IO;
+		    result->status = NFS3ERR_IO;
 	    }
 	} else
 	    /* opening for read failed */
-	    result.status = read_err();
+	    result->status = read_err();
     }
 
     /* overlaps with resfail */
-    result.READ3res_u.resok.file_attributes = get_post_stat(path, rqstp);
+    result->READ3res_u.resok.file_attributes = get_post_stat(path, ctx);
 
-    return &result;
+    return result;
 }
 
-WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
+WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, unfs3_ctx_t * ctx)
 {
-    static WRITE3res result;
+    WRITE3res *result = &ctx->res.write;
+    struct flush_job *job = NULL;
+    post_op_attr *after;
+    uint64 end;
     char *path;
     int fd, res, res_close;
 
     PREP(path, argp->file);
-    result.status = join(is_reg(), exports_rw());
+    result->status = join(is_reg(ctx), exports_rw(ctx));
 
     /* handle write of owned files */
-    write_by_owner(rqstp, st_cache);
+    write_by_owner(ctx, ctx->st);
 
-    if (result.status == NFS3_OK) {
+    if (result->status == NFS3_OK) {
 	/* We allow caching of the fd only for unstable writes. This is to
 	   prevent generating a new write verifier for failed stable writes,
 	   when the fd was not in the cache. Besides, for stable writes, the
@@ -392,13 +464,14 @@ WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
 	fd = fd_open(path, argp->file, UNFS3_FD_WRITE,
 		     (argp->stable == UNSTABLE));
 	if (fd != -1) {
-	    res =
-		backend_pwrite(fd, argp->data.data_val, argp->data.data_len,
-			       (off64_t)argp->offset);
+	    res = fd_pwrite(fd, argp->data.data_val, argp->data.data_len,
+			    argp->offset, argp->stable);
 
-	    /* close for real if not UNSTABLE write */
+	    /* close for real if not UNSTABLE write, maybe on a flusher */
 	    if (argp->stable == UNSTABLE)
 		res_close = fd_close(fd, UNFS3_FD_WRITE, FD_CLOSE_VIRT);
+	    else if (res != -1 && (job = flush_job_new(ctx)))
+		res_close = 0;
 	    else
 		res_close = fd_close(fd, UNFS3_FD_WRITE, FD_CLOSE_REAL);
 
@@ -407,24 +480,37 @@ WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
 		argp->stable = FILE_SYNC;
 
 	    if (res != -1 && res_close != -1) {
-		result.WRITE3res_u.resok.count = res;
-		result.WRITE3res_u.resok.committed = argp->stable;
-		memcpy(result.WRITE3res_u.resok.verf, wverf,
+		result->WRITE3res_u.resok.count = res;
+		result->WRITE3res_u.resok.committed = argp->stable;
+		memcpy(result->WRITE3res_u.resok.verf, wverf,
 		       NFS3_WRITEVERFSIZE);
 	    } else {
 		/* error during write or close */
-		result.status = write_write_err();
+		result->status = write_write_err();
 	    }
 	} else
 	    /* could not open for writing */
-	    result.status = write_open_err();
+	    result->status = write_open_err();
     }
 
     /* overlaps with resfail */
-    result.WRITE3res_u.resok.file_wcc.before = get_pre_cached();
-    result.WRITE3res_u.resok.file_wcc.after = get_post_stat(path, rqstp);
+    result->WRITE3res_u.resok.file_wcc.before = get_pre_cached(ctx);
+    result->WRITE3res_u.resok.file_wcc.after = get_post_stat(path, ctx);
+
+    /* kept WRITEs are not in the file yet, report the size written */
+    after = &result->WRITE3res_u.resok.file_wcc.after;
+    end = argp->offset + result->WRITE3res_u.resok.count;
+    if (result->status == NFS3_OK && after->attributes_follow &&
+	after->post_op_attr_u.attributes.size < end)
+	after->post_op_attr_u.attributes.size = end;
+
+    /* the flusher closes the fd and replies */
+    if (job) {
+	flush_write(job, fd, result);
+	return NULL;
+    }
 
-    return &result;
+    return result;
 }
 
 #ifndef WIN32
@@ -454,9 +540,9 @@ static int check_create_verifier(backend_statstruct * buf, createverf3 verf)
 }
 #endif				       /* WIN32 */
 
-CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
+CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, unfs3_ctx_t * ctx)
 {
-    static CREATE3res result;
+    CREATE3res *result = &ctx->res.create;
     char *path;
     char obj[NFS_MAXPATHLEN];
     sattr3 new_attr;
@@ -466,9 +552,9 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
     int flags = O_RDWR | O_CREAT | O_TRUNC | O_NONBLOCK;
 
     PREP(path, argp->where.dir);
-    result.status = join(cat_name(path, argp->where.name, obj), exports_rw());
+    result->status = join(cat_name(path, argp->where.name, obj), exports_rw(ctx));
 
-    cluster_create(obj, rqstp, &result.status);
+    cluster_create(obj, ctx->rqstp, &result->status);
 
     /* GUARDED and EXCLUSIVE maps to Unix exclusive create */
     if (argp->how.mode != UNCHECKED)
@@ -476,16 +562,18 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
 
     if (argp->how.mode != EXCLUSIVE) {
 	new_attr = argp->how.createhow3_u.obj_attributes;
-	result.status = join(result.status, atomic_attr(new_attr));
+	result->status = join(result->status, atomic_attr(new_attr, ctx));
     }
 
     /* Try to open the file */
-    if (result.status == NFS3_OK) {
+    if (result->status == NFS3_OK) {
+	RDLOCK(umask_lock);
 	if (argp->how.mode != EXCLUSIVE) {
 	    fd = backend_open_create(obj, flags, create_mode(new_attr));
 	} else {
 	    fd = backend_open_create(obj, flags, create_mode(new_attr));
 	}
+	RWUNLOCK(umask_lock);
     }
 
     if (fd != -1) {
@@ -508,19 +596,19 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
 	    fh_cache_add(buf.st_dev, buf.st_ino, obj);
 	    backend_close(fd);
 
-	    result.CREATE3res_u.resok.obj =
-		fh_extend_post(argp->where.dir, buf.st_dev, buf.st_ino, gen);
-	    result.CREATE3res_u.resok.obj_attributes =
-		get_post_buf(buf, rqstp);
+	    result->CREATE3res_u.resok.obj =
+		fh_extend_post(argp->where.dir, obj, &buf, gen, ctx);
+	    result->CREATE3res_u.resok.obj_attributes =
+		get_post_buf(buf, ctx);
 	}
 
 	if (res == -1) {
 	    /* backend_fstat() or backend_store_create_verifier() failed */
 	    backend_close(fd);
-	    result.status = NFS3ERR_IO;
+	    result->status = NFS3ERR_IO;
 	}
 
-    } else if (result.status == NFS3_OK) {
+    } else if (result->status == NFS3_OK) {
 	/* open() failed */
 	if (argp->how.mode == EXCLUSIVE && errno == EEXIST) {
 	    /* Check if verifier matches */
@@ -537,32 +625,32 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
 		    fh_cache_add(buf.st_dev, buf.st_ino, obj);
 		    backend_close(fd);
 
-		    result.CREATE3res_u.resok.obj =
-			fh_extend_post(argp->where.dir, buf.st_dev,
-				       buf.st_ino, gen);
-		    result.CREATE3res_u.resok.obj_attributes =
-			get_post_buf(buf, rqstp);
+		    result->CREATE3res_u.resok.obj =
+			fh_extend_post(argp->where.dir, obj, &buf, gen,
+				       ctx);
+		    result->CREATE3res_u.resok.obj_attributes =
+			get_post_buf(buf, ctx);
 		} else {
 		    /* The verifier doesn't match */
-		    result.status = NFS3ERR_EXIST;
+		    result->status = NFS3ERR_EXIST;
 		}
 	    }
 	}
 	if (res == -1) {
-	    result.status = create_err();
+	    result->status = create_err();
 	}
     }
 
     /* overlaps with resfail */
-    result.CREATE3res_u.resok.dir_wcc.before = get_pre_cached();
-    result.CREATE3res_u.resok.dir_wcc.after = get_post_stat(path, rqstp);
+    result->CREATE3res_u.resok.dir_wcc.before = get_pre_cached(ctx);
+    result->CREATE3res_u.resok.dir_wcc.after = get_post_stat(path, ctx);
 
-    return &result;
+    return result;
 }
 
-MKDIR3res *nfsproc3_mkdir_3_svc(MKDIR3args * argp, struct svc_req * rqstp)
+MKDIR3res *nfsproc3_mkdir_3_svc(MKDIR3args * argp, unfs3_ctx_t * ctx)
 {
-    static MKDIR3res result;
+    MKDIR3res *result = &ctx->res.mkdir;
     char *path;
     pre_op_attr pre;
     post_op_attr post;
@@ -570,37 +658,39 @@ MKDIR3res *nfsproc3_mkdir_3_svc(MKDIR3args * argp, struct svc_req * rqstp)
     int res;
 
     PREP(path, argp->where.dir);
-    pre = get_pre_cached();
-    result.status =
+    pre = get_pre_cached(ctx);
+    result->status =
 	join3(cat_name(path, argp->where.name, obj),
-	      atomic_attr(argp->attributes), exports_rw());
+	      atomic_attr(argp->attributes, ctx), exports_rw(ctx));
 
-    cluster_create(obj, rqstp, &result.status);
+    cluster_create(obj, ctx->rqstp, &result->status);
 
-    if (result.status == NFS3_OK) {
+    if (result->status == NFS3_OK) {
+	RDLOCK(umask_lock);
 	res = backend_mkdir(obj, create_mode(argp->attributes));
+	RWUNLOCK(umask_lock);
 	if (res == -1)
-	    result.status = mkdir_err();
+	    result->status = mkdir_err();
 	else {
-	    result.MKDIR3res_u.resok.obj =
-		fh_extend_type(argp->where.dir, obj, S_IFDIR);
-	    result.MKDIR3res_u.resok.obj_attributes = get_post_cached(rqstp);
+	    result->MKDIR3res_u.resok.obj =
+		fh_extend_type(argp->where.dir, obj, S_IFDIR, ctx);
+	    result->MKDIR3res_u.resok.obj_attributes = get_post_cached(ctx);
 	}
     }
 
-    post = get_post_attr(path, argp->where.dir, rqstp);
+    post = get_post_attr(path, argp->where.dir, ctx);
 
     /* overlaps with resfail */
-    result.MKDIR3res_u.resok.dir_wcc.before = pre;
-    result.MKDIR3res_u.resok.dir_wcc.after = post;
+    result->MKDIR3res_u.resok.dir_wcc.before = pre;
+    result->MKDIR3res_u.resok.dir_wcc.after = post;
 
-    return &result;
+    return result;
 }
 
 SYMLINK3res *nfsproc3_symlink_3_svc(SYMLINK3args * argp,
-				    struct svc_req * rqstp)
+				    unfs3_ctx_t * ctx)
 {
-    static SYMLINK3res result;
+    SYMLINK3res *result = &ctx->res.symlink;
     char *path;
     pre_op_attr pre;
     post_op_attr post;
@@ -609,12 +699,12 @@ SYMLINK3res *nfsproc3_symlink_3_svc(SYMLINK3args * argp,
     mode_t new_mode;
 
     PREP(path, argp->where.dir);
-    pre = get_pre_cached();
-    result.status =
+    pre = get_pre_cached(ctx);
+    result->status =
 	join3(cat_name(path, argp->where.name, obj),
-	      atomic_attr(argp->symlink.symlink_attributes), exports_rw());
+	      atomic_attr(argp->symlink.symlink_attributes, ctx), exports_rw(ctx));
 
-    cluster_create(obj, rqstp, &result.status);
+    cluster_create(obj, ctx->rqstp, &result->status);
 
     if (argp->symlink.symlink_attributes.mode.set_it == TRUE)
 	new_mode = create_mode(argp->symlink.symlink_attributes);
@@ -625,27 +715,29 @@ SYMLINK3res *nfsproc3_symlink_3_svc(SYMLINK3args * argp,
 	    S_IROTH | S_IWOTH | S_IXOTH;
     }
 
-    if (result.status == NFS3_OK) {
+    if (result->status == NFS3_OK) {
+	WRLOCK(umask_lock);
 	umask(~new_mode);
 	res = backend_symlink(argp->symlink.symlink_data, obj);
 	umask(0);
+	RWUNLOCK(umask_lock);
 	if (res == -1)
-	    result.status = symlink_err();
+	    result->status = symlink_err();
 	else {
-	    result.SYMLINK3res_u.resok.obj =
-		fh_extend_type(argp->where.dir, obj, S_IFLNK);
-	    result.SYMLINK3res_u.resok.obj_attributes =
-		get_post_cached(rqstp);
+	    result->SYMLINK3res_u.resok.obj =
+		fh_extend_type(argp->where.dir, obj, S_IFLNK, ctx);
+	    result->SYMLINK3res_u.resok.obj_attributes =
+		get_post_cached(ctx);
 	}
     }
 
-    post = get_post_attr(path, argp->where.dir, rqstp);
+    post = get_post_attr(path, argp->where.dir, ctx);
 
     /* overlaps with resfail */
-    result.SYMLINK3res_u.resok.dir_wcc.before = pre;
-    result.SYMLINK3res_u.resok.dir_wcc.after = post;
+    result->SYMLINK3res_u.resok.dir_wcc.before = pre;
+    result->SYMLINK3res_u.resok.dir_wcc.after = post;
 
-    return &result;
+    return result;
 }
 
 #ifndef WIN32
@@ -663,11 +755,13 @@ static int mksocket(const char *path, mode_t mode)
     strcpy(addr.sun_path, path);
     res = sock;
     if (res != -1) {
+	WRLOCK(umask_lock);
 	umask(~mode);
 	res =
 	    bind(sock, (struct sockaddr *) &addr,
 		 sizeof(addr.sun_family) + strlen(addr.sun_path));
 	umask(0);
+	RWUNLOCK(umask_lock);
 	close(sock);
     }
     return res;
@@ -679,7 +773,7 @@ static int mksocket(const char *path, mode_t mode)
  * check and process arguments to MKNOD procedure
  */
 static nfsstat3 mknod_args(mknoddata3 what, const char *obj, mode_t * mode,
-			   dev_t * dev)
+			   dev_t * dev, unfs3_ctx_t * ctx)
 {
     sattr3 attr;
 
@@ -718,12 +812,12 @@ static nfsstat3 mknod_args(mknoddata3 what, const char *obj, mode_t * mode,
 	    break;
     }
 
-    return atomic_attr(attr);
+    return atomic_attr(attr, ctx);
 }
 
-MKNOD3res *nfsproc3_mknod_3_svc(MKNOD3args * argp, struct svc_req * rqstp)
+MKNOD3res *nfsproc3_mknod_3_svc(MKNOD3args * argp, unfs3_ctx_t * ctx)
 {
-    static MKNOD3res result;
+    MKNOD3res *result = &ctx->res.mknod;
     char *path;
     pre_op_attr pre;
     post_op_attr post;
@@ -733,97 +827,101 @@ MKNOD3res *nfsproc3_mknod_3_svc(MKNOD3args * argp, struct svc_req * rqstp)
     dev_t dev = 0;
 
     PREP(path, argp->where.dir);
-    pre = get_pre_cached();
-    result.status =
+    pre = get_pre_cached(ctx);
+    result->status =
 	join3(cat_name(path, argp->where.name, obj),
-	      mknod_args(argp->what, obj, &new_mode, &dev), exports_rw());
+	      mknod_args(argp->what, obj, &new_mode, &dev, ctx), exports_rw(ctx));
 
-    cluster_create(obj, rqstp, &result.status);
+    cluster_create(obj, ctx->rqstp, &result->status);
 
-    if (result.status == NFS3_OK) {
-	if (argp->what.type == NF3CHR || argp->what.type == NF3BLK)
+    if (result->status == NFS3_OK) {
+	if (argp->what.type == NF3CHR || argp->what.type == NF3BLK) {
+	    RDLOCK(umask_lock);
 	    res = backend_mknod(obj, new_mode, dev);	/* device */
-	else if (argp->what.type == NF3FIFO)
+	    RWUNLOCK(umask_lock);
+	} else if (argp->what.type == NF3FIFO) {
+	    RDLOCK(umask_lock);
 	    res = backend_mkfifo(obj, new_mode);	/* FIFO */
-	else
+	    RWUNLOCK(umask_lock);
+	} else
 	    res = backend_mksocket(obj, new_mode);	/* socket */
 
 	if (res == -1) {
-	    result.status = mknod_err();
+	    result->status = mknod_err();
 	} else {
-	    result.MKNOD3res_u.resok.obj =
+	    result->MKNOD3res_u.resok.obj =
 		fh_extend_type(argp->where.dir, obj,
-			       type_to_mode(argp->what.type));
-	    result.MKNOD3res_u.resok.obj_attributes = get_post_cached(rqstp);
+			       type_to_mode(argp->what.type), ctx);
+	    result->MKNOD3res_u.resok.obj_attributes = get_post_cached(ctx);
 	}
     }
 
-    post = get_post_attr(path, argp->where.dir, rqstp);
+    post = get_post_attr(path, argp->where.dir, ctx);
 
     /* overlaps with resfail */
-    result.MKNOD3res_u.resok.dir_wcc.before = pre;
-    result.MKNOD3res_u.resok.dir_wcc.after = post;
+    result->MKNOD3res_u.resok.dir_wcc.before = pre;
+    result->MKNOD3res_u.resok.dir_wcc.after = post;
 
-    return &result;
+    return result;
 }
 
-REMOVE3res *nfsproc3_remove_3_svc(REMOVE3args * argp, struct svc_req * rqstp)
+REMOVE3res *nfsproc3_remove_3_svc(REMOVE3args * argp, unfs3_ctx_t * ctx)
 {
-    static REMOVE3res result;
+    REMOVE3res *result = &ctx->res.remove;
     char *path;
     char obj[NFS_MAXPATHLEN];
     int res;
 
     PREP(path, argp->object.dir);
-    result.status =
-	join(cat_name(path, argp->object.name, obj), exports_rw());
+    result->status =
+	join(cat_name(path, argp->object.name, obj), exports_rw(ctx));
 
-    cluster_lookup(obj, rqstp, &result.status);
+    cluster_lookup(obj, ctx->rqstp, &result->status);
 
-    if (result.status == NFS3_OK) {
+    if (result->status == NFS3_OK) {
         change_readdir_cookie();
 	res = backend_remove(obj);
 	if (res == -1)
-	    result.status = remove_err();
+	    result->status = remove_err();
     }
 
     /* overlaps with resfail */
-    result.REMOVE3res_u.resok.dir_wcc.before = get_pre_cached();
-    result.REMOVE3res_u.resok.dir_wcc.after = get_post_stat(path, rqstp);
+    result->REMOVE3res_u.resok.dir_wcc.before = get_pre_cached(ctx);
+    result->REMOVE3res_u.resok.dir_wcc.after = get_post_stat(path, ctx);
 
-    return &result;
+    return result;
 }
 
-RMDIR3res *nfsproc3_rmdir_3_svc(RMDIR3args * argp, struct svc_req * rqstp)
+RMDIR3res *nfsproc3_rmdir_3_svc(RMDIR3args * argp, unfs3_ctx_t * ctx)
 {
-    static RMDIR3res result;
+    RMDIR3res *result = &ctx->res.rmdir;
     char *path;
     char obj[NFS_MAXPATHLEN];
     int res;
 
     PREP(path, argp->object.dir);
-    result.status =
-	join(cat_name(path, argp->object.name, obj), exports_rw());
+    result->status =
+	join(cat_name(path, argp->object.name, obj), exports_rw(ctx));
 
-    cluster_lookup(obj, rqstp, &result.status);
+    cluster_lookup(obj, ctx->rqstp, &result->status);
 
-    if (result.status == NFS3_OK) {
+    if (result->status == NFS3_OK) {
         change_readdir_cookie();
 	res = backend_rmdir(obj);
 	if (res == -1)
-	    result.status = rmdir_err();
+	    result->status = rmdir_err();
     }
 
     /* overlaps with resfail */
-    result.RMDIR3res_u.resok.dir_wcc.before = get_pre_cached();
-    result.RMDIR3res_u.resok.dir_wcc.after = get_post_stat(path, rqstp);
+    result->RMDIR3res_u.resok.dir_wcc.before = get_pre_cached(ctx);
+    result->RMDIR3res_u.resok.dir_wcc.after = get_post_stat(path, ctx);
 
-    return &result;
+    return result;
 }
 
-RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
+RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, unfs3_ctx_t * ctx)
 {
-    static RENAME3res result;
+    RENAME3res *result = &ctx->res.rename;
     char *from;
     char *to;
     char from_obj[NFS_MAXPATHLEN];
@@ -833,43 +931,49 @@ RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
     int res;
 
     PREP(from, argp->from.dir);
-    pre = get_pre_cached();
-    result.status =
-	join(cat_name(from, argp->from.name, from_obj), exports_rw());
+    pre = get_pre_cached(ctx);
+    result->status =
+	join(cat_name(from, argp->from.name, from_obj), exports_rw(ctx));
 
-    cluster_lookup(from_obj, rqstp, &result.status);
+    cluster_lookup(from_obj, ctx->rqstp, &result->status);
 
-    to = fh_decomp(argp->to.dir);
+    to = fh_decomp(argp->to.dir, ctx);
 
-    if (result.status == NFS3_OK) {
-	result.status =
+    if (result->status == NFS3_OK) {
+	result->status =
 	    join(cat_name(to, argp->to.name, to_obj),
-		 exports_compat(to, rqstp));
+		 exports_compat(to, ctx));
+	if (!to && ctx->fh_busy)
+	    result->status = NFS3ERR_JUKEBOX;
 
-	cluster_create(to_obj, rqstp, &result.status);
+	cluster_create(to_obj, ctx->rqstp, &result->status);
 
-	if (result.status == NFS3_OK) {
+	if (result->status == NFS3_OK) {
 	    change_readdir_cookie();
 	    res = backend_rename(from_obj, to_obj);
 	    if (res == -1)
-		result.status = rename_err();
+		result->status = rename_err();
+	    else {
+		fh_cache_rename(from_obj, to_obj);
+		index_moved(to_obj);
+	    }
 	}
     }
 
-    post = get_post_attr(from, argp->from.dir, rqstp);
+    post = get_post_attr(from, argp->from.dir, ctx);
 
     /* overlaps with resfail */
-    result.RENAME3res_u.resok.fromdir_wcc.before = pre;
-    result.RENAME3res_u.resok.fromdir_wcc.after = post;
-    result.RENAME3res_u.resok.todir_wcc.before = get_pre_cached();
-    result.RENAME3res_u.resok.todir_wcc.after = get_post_stat(to, rqstp);
+    result->RENAME3res_u.resok.fromdir_wcc.before = pre;
+    result->RENAME3res_u.resok.fromdir_wcc.after = post;
+    result->RENAME3res_u.resok.todir_wcc.before = get_pre_cached(ctx);
+    result->RENAME3res_u.resok.todir_wcc.after = get_post_stat(to, ctx);
 
-    return &result;
+    return result;
 }
 
-LINK3res *nfsproc3_link_3_svc(LINK3args * argp, struct svc_req * rqstp)
+LINK3res *nfsproc3_link_3_svc(LINK3args * argp, unfs3_ctx_t * ctx)
 {
-    static LINK3res result;
+    LINK3res *result = &ctx->res.link;
     char *path, *old;
     pre_op_attr pre;
     post_op_attr post;
@@ -877,67 +981,68 @@ LINK3res *nfsproc3_link_3_svc(LINK3args * argp, struct svc_req * rqstp)
     int res;
 
     PREP(path, argp->link.dir);
-    pre = get_pre_cached();
-    result.status = join(cat_name(path, argp->link.name, obj), exports_rw());
+    pre = get_pre_cached(ctx);
+    result->status = join(cat_name(path, argp->link.name, obj), exports_rw(ctx));
 
-    cluster_create(obj, rqstp, &result.status);
+    cluster_create(obj, ctx->rqstp, &result->status);
 
-    old = fh_decomp(argp->file);
+    old = fh_decomp(argp->file, ctx);
 
-    if (old && result.status == NFS3_OK) {
-	result.status = exports_compat(old, rqstp);
+    if (old && result->status == NFS3_OK) {
+	result->status = exports_compat(old, ctx);
 
-	if (result.status == NFS3_OK) {
+	if (result->status == NFS3_OK) {
 	    res = backend_link(old, obj);
 	    if (res == -1)
-		result.status = link_err();
+		result->status = link_err();
 	}
     } else if (!old)
-	result.status = NFS3ERR_STALE;
+	result->status = ctx->fh_busy ? NFS3ERR_JUKEBOX : NFS3ERR_STALE;
 
-    post = get_post_attr(path, argp->link.dir, rqstp);
+    post = get_post_attr(path, argp->link.dir, ctx);
 
     /* overlaps with resfail */
-    result.LINK3res_u.resok.file_attributes = get_post_stat(old, rqstp);
-    result.LINK3res_u.resok.linkdir_wcc.before = pre;
-    result.LINK3res_u.resok.linkdir_wcc.after = post;
+    result->LINK3res_u.resok.file_attributes = get_post_stat(old, ctx);
+    result->LINK3res_u.resok.linkdir_wcc.before = pre;
+    result->LINK3res_u.resok.linkdir_wcc.after = post;
 
-    return &result;
+    return result;
 }
 
 READDIR3res *nfsproc3_readdir_3_svc(READDIR3args * argp,
-				    struct svc_req * rqstp)
+				    unfs3_ctx_t * ctx)
 {
-    static READDIR3res result;
+    READDIR3res *result = &ctx->res.readdir;
     char *path;
 
     PREP(path, argp->dir);
 
-    result = read_dir(path, argp->cookie, argp->cookieverf, argp->count);
-    result.READDIR3res_u.resok.dir_attributes = get_post_stat(path, rqstp);
+    *result = read_dir(path, argp->cookie, argp->cookieverf, argp->count,
+		       ctx);
+    result->READDIR3res_u.resok.dir_attributes = get_post_stat(path, ctx);
 
-    return &result;
+    return result;
 }
 
 READDIRPLUS3res *nfsproc3_readdirplus_3_svc(U(READDIRPLUS3args * argp),
-					    U(struct svc_req * rqstp))
+					    U(unfs3_ctx_t * ctx))
 {
-    static READDIRPLUS3res result;
+    READDIRPLUS3res *result = &ctx->res.readdirplus;
 
     /* 
      * we don't do READDIRPLUS since it involves filehandle and
      * attribute getting which is impossible to do atomically
      * from user-space
      */
-    result.status = NFS3ERR_NOTSUPP;
-    result.READDIRPLUS3res_u.resfail.dir_attributes.attributes_follow = FALSE;
+    result->status = NFS3ERR_NOTSUPP;
+    result->READDIRPLUS3res_u.resfail.dir_attributes.attributes_follow = FALSE;
 
-    return &result;
+    return result;
 }
 
-FSSTAT3res *nfsproc3_fsstat_3_svc(FSSTAT3args * argp, struct svc_req * rqstp)
+FSSTAT3res *nfsproc3_fsstat_3_svc(FSSTAT3args * argp, unfs3_ctx_t * ctx)
 {
-    static FSSTAT3res result;
+    FSSTAT3res *result = &ctx->res.fsstat;
     char *path;
     backend_statvfsstruct buf;
     int res;
@@ -945,116 +1050,128 @@ FSSTAT3res *nfsproc3_fsstat_3_svc(FSSTAT3args * argp, struct svc_req * rqstp)
     PREP(path, argp->fsroot);
 
     /* overlaps with resfail */
-    result.FSSTAT3res_u.resok.obj_attributes = get_post_cached(rqstp);
+    result->FSSTAT3res_u.resok.obj_attributes = get_post_cached(ctx);
 
     res = backend_statvfs(path, &buf);
     if (res == -1) {
 	/* statvfs fell on its nose */
-	if ((exports_opts & OPT_REMOVABLE) && export_point(path)) {
+	if ((ctx->opts & OPT_REMOVABLE) && export_point(path)) {
 	    /* Removable media export point; probably no media inserted.
 	       Return dummy values. */
-	    result.status = NFS3_OK;
-	    result.FSSTAT3res_u.resok.tbytes = 0;
-	    result.FSSTAT3res_u.resok.fbytes = 0;
-	    result.FSSTAT3res_u.resok.abytes = 0;
-	    result.FSSTAT3res_u.resok.tfiles = 0;
-	    result.FSSTAT3res_u.resok.ffiles = 0;
-	    result.FSSTAT3res_u.resok.afiles = 0;
-	    result.FSSTAT3res_u.resok.invarsec = 0;
+	    result->status = NFS3_OK;
+	    result->FSSTAT3res_u.resok.tbytes = 0;
+	    result->FSSTAT3res_u.resok.fbytes = 0;
+	    result->FSSTAT3res_u.resok.abytes = 0;
+	    result->FSSTAT3res_u.resok.tfiles = 0;
+	    result->FSSTAT3res_u.resok.ffiles = 0;
+	    result->FSSTAT3res_u.resok.afiles = 0;
+	    result->FSSTAT3res_u.resok.invarsec = 0;
 	} else {
-	    result.status = NFS3ERR_IO;
+	    result->status = NFS3ERR_IO;
 	}
     } else {
-	result.status = NFS3_OK;
-	result.FSSTAT3res_u.resok.tbytes =
+	result->status = NFS3_OK;
+	result->FSSTAT3res_u.resok.tbytes =
 	    (uint64) buf.f_blocks * buf.f_frsize;
-	result.FSSTAT3res_u.resok.fbytes = 
+	result->FSSTAT3res_u.resok.fbytes = 
 	    (uint64) buf.f_bfree * buf.f_frsize;
-	result.FSSTAT3res_u.resok.abytes =
+	result->FSSTAT3res_u.resok.abytes =
 	    (uint64) buf.f_bavail * buf.f_frsize;
-	result.FSSTAT3res_u.resok.tfiles = buf.f_files;
-	result.FSSTAT3res_u.resok.ffiles = buf.f_ffree;
-	result.FSSTAT3res_u.resok.afiles = buf.f_ffree;
-	result.FSSTAT3res_u.resok.invarsec = 0;
+	result->FSSTAT3res_u.resok.tfiles = buf.f_files;
+	result->FSSTAT3res_u.resok.ffiles = buf.f_ffree;
+	result->FSSTAT3res_u.resok.afiles = buf.f_ffree;
+	result->FSSTAT3res_u.resok.invarsec = 0;
     }
 
-    return &result;
+    return result;
 }
 
-FSINFO3res *nfsproc3_fsinfo_3_svc(FSINFO3args * argp, struct svc_req * rqstp)
+FSINFO3res *nfsproc3_fsinfo_3_svc(FSINFO3args * argp, unfs3_ctx_t * ctx)
 {
-    static FSINFO3res result;
+    FSINFO3res *result = &ctx->res.fsinfo;
     char *path;
     unsigned int maxdata;
 
-    if (get_socket_type(rqstp) == SOCK_STREAM)
+    if (get_socket_type(ctx->rqstp) == SOCK_STREAM)
 	maxdata = NFS_MAXDATA_TCP;
     else
 	maxdata = NFS_MAXDATA_UDP;
 
     PREP(path, argp->fsroot);
 
-    result.FSINFO3res_u.resok.obj_attributes = get_post_cached(rqstp);
-
-    result.status = NFS3_OK;
-    result.FSINFO3res_u.resok.rtmax = maxdata;
-    result.FSINFO3res_u.resok.rtpref = maxdata;
-    result.FSINFO3res_u.resok.rtmult = 4096;
-    result.FSINFO3res_u.resok.wtmax = maxdata;
-    result.FSINFO3res_u.resok.wtpref = maxdata;
-    result.FSINFO3res_u.resok.wtmult = 4096;
-    result.FSINFO3res_u.resok.dtpref = 4096;
-    result.FSINFO3res_u.resok.maxfilesize = ~0ULL;
-    result.FSINFO3res_u.resok.time_delta.seconds = backend_time_delta_seconds;
-    result.FSINFO3res_u.resok.time_delta.nseconds = 0;
-    result.FSINFO3res_u.resok.properties = backend_fsinfo_properties;
-
-    return &result;
+    result->FSINFO3res_u.resok.obj_attributes = get_post_cached(ctx);
+
+    result->status = NFS3_OK;
+    result->FSINFO3res_u.resok.rtmax = maxdata;
+    result->FSINFO3res_u.resok.rtpref = maxdata;
+    result->FSINFO3res_u.resok.rtmult = 4096;
+    result->FSINFO3res_u.resok.wtmax = maxdata;
+    result->FSINFO3res_u.resok.wtpref = maxdata;
+    result->FSINFO3res_u.resok.wtmult = 4096;
+    result->FSINFO3res_u.resok.dtpref = 4096;
+    result->FSINFO3res_u.resok.maxfilesize = ~0ULL;
+    result->FSINFO3res_u.resok.time_delta.seconds = backend_time_delta_seconds;
+    result->FSINFO3res_u.resok.time_delta.nseconds = 0;
+    result->FSINFO3res_u.resok.properties = backend_fsinfo_properties;
+
+    return result;
 }
 
 PATHCONF3res *nfsproc3_pathconf_3_svc(PATHCONF3args * argp,
-				      struct svc_req * rqstp)
+				      unfs3_ctx_t * ctx)
 {
-    static PATHCONF3res result;
+    PATHCONF3res *result = &ctx->res.pathconf;
     char *path;
 
     PREP(path, argp->object);
 
-    result.PATHCONF3res_u.resok.obj_attributes = get_post_cached(rqstp);
+    result->PATHCONF3res_u.resok.obj_attributes = get_post_cached(ctx);
 
-    result.status = NFS3_OK;
-    result.PATHCONF3res_u.resok.linkmax = 0xFFFFFFFF;
-    result.PATHCONF3res_u.resok.name_max = NFS_MAXPATHLEN;
-    result.PATHCONF3res_u.resok.no_trunc = TRUE;
-    result.PATHCONF3res_u.resok.chown_restricted = FALSE;
-    result.PATHCONF3res_u.resok.case_insensitive =
+    result->status = NFS3_OK;
+    result->PATHCONF3res_u.resok.linkmax = 0xFFFFFFFF;
+    result->PATHCONF3res_u.resok.name_max = NFS_MAXPATHLEN;
+    result->PATHCONF3res_u.resok.no_trunc = TRUE;
+    result->PATHCONF3res_u.resok.chown_restricted = FALSE;
+    result->PATHCONF3res_u.resok.case_insensitive =
 	backend_pathconf_case_insensitive;
-    result.PATHCONF3res_u.resok.case_preserving = TRUE;
+    result->PATHCONF3res_u.resok.case_preserving = TRUE;
 
-    return &result;
+    return result;
 }
 
-COMMIT3res *nfsproc3_commit_3_svc(COMMIT3args * argp, struct svc_req * rqstp)
+COMMIT3res *nfsproc3_commit_3_svc(COMMIT3args * argp, unfs3_ctx_t * ctx)
 {
-    static COMMIT3res result;
+    COMMIT3res *result = &ctx->res.commit;
+    struct flush_job *job;
     char *path;
     int res;
 
     PREP(path, argp->file);
-    result.status = join(is_reg(), exports_rw());
+    result->status = join(is_reg(ctx), exports_rw(ctx));
+
+    /* overlaps with resfail */
+    result->COMMIT3res_u.resfail.file_wcc.before = get_pre_cached(ctx);
+
+    if (result->status == NFS3_OK) {
+	/* a flusher thread syncs, updates the attributes and replies */
+	job = flush_job_new(ctx);
+	if (job) {
+	    result->COMMIT3res_u.resfail.file_wcc.after =
+		get_post_cached(ctx);
+	    flush_commit(job, argp->file, path, ctx, result);
+	    return NULL;
+	}
 
-    if (result.status == NFS3_OK) {
 	res = fd_sync(argp->file);
 	if (res != -1)
-	    memcpy(result.COMMIT3res_u.resok.verf, wverf, NFS3_WRITEVERFSIZE);
+	    memcpy(result->COMMIT3res_u.resok.verf, wverf, NFS3_WRITEVERFSIZE);
 	else
 	    /* error during fsync() or close() */
-	    result.status = NFS3ERR_IO;
+	    result->status = NFS3ERR_IO;
     }
 
-    /* overlaps with resfail */
-    result.COMMIT3res_u.resfail.file_wcc.before = get_pre_cached();
-    result.COMMIT3res_u.resfail.file_wcc.after = get_post_stat(path, rqstp);
+    /* writing out kept WRITEs changes size and times */
+    result->COMMIT3res_u.resfail.file_wcc.after = get_post_stat(path, ctx);
 
-    return &result;
+    return result;
 }
@@ -13,6 +13,16 @@
 #define U(x) x
 #endif
 
+/* per-thread storage */
+#if defined(__GNUC__) && HAVE_PTHREAD_H == 1
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+/* request context, see context.h */
+typedef struct unfs3_ctx unfs3_ctx_t;
+
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
 #endif
@@ -957,49 +967,49 @@ typedef struct COMMIT3res COMMIT3res;
 #define NFS_V3 3
 
 #define NFSPROC3_NULL 0
-extern  void * nfsproc3_null_3_svc(void *, struct svc_req *);
+extern  void * nfsproc3_null_3_svc(void *, unfs3_ctx_t *);
 #define NFSPROC3_GETATTR 1
-extern  GETATTR3res * nfsproc3_getattr_3_svc(GETATTR3args *, struct svc_req *);
+extern  GETATTR3res * nfsproc3_getattr_3_svc(GETATTR3args *, unfs3_ctx_t *);
 #define NFSPROC3_SETATTR 2
-extern  SETATTR3res * nfsproc3_setattr_3_svc(SETATTR3args *, struct svc_req *);
+extern  SETATTR3res * nfsproc3_setattr_3_svc(SETATTR3args *, unfs3_ctx_t *);
 #define NFSPROC3_LOOKUP 3
-extern  LOOKUP3res * nfsproc3_lookup_3_svc(LOOKUP3args *, struct svc_req *);
+extern  LOOKUP3res * nfsproc3_lookup_3_svc(LOOKUP3args *, unfs3_ctx_t *);
 #define NFSPROC3_ACCESS 4
-extern  ACCESS3res * nfsproc3_access_3_svc(ACCESS3args *, struct svc_req *);
+extern  ACCESS3res * nfsproc3_access_3_svc(ACCESS3args *, unfs3_ctx_t *);
 #define NFSPROC3_READLINK 5
-extern  READLINK3res * nfsproc3_readlink_3_svc(READLINK3args *, struct svc_req *);
+extern  READLINK3res * nfsproc3_readlink_3_svc(READLINK3args *, unfs3_ctx_t *);
 #define NFSPROC3_READ 6
-extern  READ3res * nfsproc3_read_3_svc(READ3args *, struct svc_req *);
+extern  READ3res * nfsproc3_read_3_svc(READ3args *, unfs3_ctx_t *);
 #define NFSPROC3_WRITE 7
-extern  WRITE3res * nfsproc3_write_3_svc(WRITE3args *, struct svc_req *);
+extern  WRITE3res * nfsproc3_write_3_svc(WRITE3args *, unfs3_ctx_t *);
 #define NFSPROC3_CREATE 8
-extern  CREATE3res * nfsproc3_create_3_svc(CREATE3args *, struct svc_req *);
+extern  CREATE3res * nfsproc3_create_3_svc(CREATE3args *, unfs3_ctx_t *);
 #define NFSPROC3_MKDIR 9
-extern  MKDIR3res * nfsproc3_mkdir_3_svc(MKDIR3args *, struct svc_req *);
+extern  MKDIR3res * nfsproc3_mkdir_3_svc(MKDIR3args *, unfs3_ctx_t *);
 #define NFSPROC3_SYMLINK 10
-extern  SYMLINK3res * nfsproc3_symlink_3_svc(SYMLINK3args *, struct svc_req *);
+extern  SYMLINK3res * nfsproc3_symlink_3_svc(SYMLINK3args *, unfs3_ctx_t *);
 #define NFSPROC3_MKNOD 11
-extern  MKNOD3res * nfsproc3_mknod_3_svc(MKNOD3args *, struct svc_req *);
+extern  MKNOD3res * nfsproc3_mknod_3_svc(MKNOD3args *, unfs3_ctx_t *);
 #define NFSPROC3_REMOVE 12
-extern  REMOVE3res * nfsproc3_remove_3_svc(REMOVE3args *, struct svc_req *);
+extern  REMOVE3res * nfsproc3_remove_3_svc(REMOVE3args *, unfs3_ctx_t *);
 #define NFSPROC3_RMDIR 13
-extern  RMDIR3res * nfsproc3_rmdir_3_svc(RMDIR3args *, struct svc_req *);
+extern  RMDIR3res * nfsproc3_rmdir_3_svc(RMDIR3args *, unfs3_ctx_t *);
 #define NFSPROC3_RENAME 14
-extern  RENAME3res * nfsproc3_rename_3_svc(RENAME3args *, struct svc_req *);
+extern  RENAME3res * nfsproc3_rename_3_svc(RENAME3args *, unfs3_ctx_t *);
 #define NFSPROC3_LINK 15
-extern  LINK3res * nfsproc3_link_3_svc(LINK3args *, struct svc_req *);
+extern  LINK3res * nfsproc3_link_3_svc(LINK3args *, unfs3_ctx_t *);
 #define NFSPROC3_READDIR 16
-extern  READDIR3res * nfsproc3_readdir_3_svc(READDIR3args *, struct svc_req *);
+extern  READDIR3res * nfsproc3_readdir_3_svc(READDIR3args *, unfs3_ctx_t *);
 #define NFSPROC3_READDIRPLUS 17
-extern  READDIRPLUS3res * nfsproc3_readdirplus_3_svc(READDIRPLUS3args *, struct svc_req *);
+extern  READDIRPLUS3res * nfsproc3_readdirplus_3_svc(READDIRPLUS3args *, unfs3_ctx_t *);
 #define NFSPROC3_FSSTAT 18
-extern  FSSTAT3res * nfsproc3_fsstat_3_svc(FSSTAT3args *, struct svc_req *);
+extern  FSSTAT3res * nfsproc3_fsstat_3_svc(FSSTAT3args *, unfs3_ctx_t *);
 #define NFSPROC3_FSINFO 19
-extern  FSINFO3res * nfsproc3_fsinfo_3_svc(FSINFO3args *, struct svc_req *);
+extern  FSINFO3res * nfsproc3_fsinfo_3_svc(FSINFO3args *, unfs3_ctx_t *);
 #define NFSPROC3_PATHCONF 20
-extern  PATHCONF3res * nfsproc3_pathconf_3_svc(PATHCONF3args *, struct svc_req *);
+extern  PATHCONF3res * nfsproc3_pathconf_3_svc(PATHCONF3args *, unfs3_ctx_t *);
 #define NFSPROC3_COMMIT 21
-extern  COMMIT3res * nfsproc3_commit_3_svc(COMMIT3args *, struct svc_req *);
+extern  COMMIT3res * nfsproc3_commit_3_svc(COMMIT3args *, unfs3_ctx_t *);
 extern int nfs3_program_3_freeresult (SVCXPRT *, xdrproc_t, caddr_t);
 
 #endif /* !_NFS_PROT_H_RPCGEN */
@@ -0,0 +1,163 @@
+/*
+ * UNFS3 change notification
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "daemon.h"
+#include "notify.h"
+
+#ifdef WANT_NOTIFY
+
+#include <sys/inotify.h>
+
+/*
+ * directories are watched with inotify so that caches can trust what
+ * they hold until told otherwise; events are read when a cache is about
+ * to be trusted, so no thread waits for them
+ *
+ * changes made by requests reach the inotify queue before the request
+ * finishes; requests count them, and a count different from the last
+ * read means the queue must be read before trusting anything
+ */
+
+/* events a watch reports */
+#define NOTIFY_MASK	(IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | \
+			 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+			 IN_MOVE_SELF | IN_ONLYDIR)
+
+static int notify_fd = -1;
+
+static unsigned int notify_count = 0;
+
+/*
+ * start notification
+ * returns -1 if not available
+ */
+int notify_init(void)
+{
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return notify_fd == -1 ? -1 : 0;
+}
+
+int notify_enabled(void)
+{
+    return notify_fd != -1;
+}
+
+/*
+ * watch a directory
+ * returns the watch descriptor, -1 if it cannot be watched
+ */
+int notify_add(U(const char *path))
+{
+    static int warned = FALSE;
+    int wd;
+
+    wd = inotify_add_watch(notify_fd, path, NOTIFY_MASK);
+    if (wd == -1 && errno == ENOSPC && !warned) {
+	warned = TRUE;
+	logmsg(LOG_WARNING,
+	       "inotify watches exhausted, checking cached paths instead");
+    }
+
+    return wd;
+}
+
+void notify_rm(U(int wd))
+{
+    inotify_rm_watch(notify_fd, wd);
+}
+
+/*
+ * read all queued events
+ * an overflow of the queue is reported as lost watch -1
+ */
+void notify_read(U(notify_fn fn))
+{
+    char buf[16384]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+    int kind;
+
+    while ((len = read(notify_fd, buf, sizeof(buf))) > 0)
+	for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+	    ev = (struct inotify_event *) p;
+
+	    if (ev->mask & IN_Q_OVERFLOW) {
+		kind = NOTIFY_LOST;
+		ev->wd = -1;
+	    } else if (ev->mask & IN_IGNORED)
+		kind = NOTIFY_LOST;
+	    else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+		kind = NOTIFY_GONE;
+	    else if (ev->mask & (IN_CREATE | IN_DELETE |
+				 IN_MOVED_FROM | IN_MOVED_TO))
+		kind = NOTIFY_NAME;
+	    else
+		kind = NOTIFY_ATTR;
+
+	    fn(ev->wd, kind, ev->len ? ev->name : NULL);
+	}
+}
+
+void notify_changed(void)
+{
+    if (notify_fd != -1)
+	__atomic_fetch_add(&notify_count, 1, __ATOMIC_RELEASE);
+}
+
+unsigned int notify_changes(void)
+{
+    return __atomic_load_n(&notify_count, __ATOMIC_ACQUIRE);
+}
+
+#else				       /* WANT_NOTIFY */
+
+int notify_init(void)
+{
+    return -1;
+}
+
+int notify_enabled(void)
+{
+    return FALSE;
+}
+
+int notify_add(U(const char *path))
+{
+    return -1;
+}
+
+void notify_rm(U(int wd))
+{
+}
+
+void notify_read(U(notify_fn fn))
+{
+}
+
+void notify_changed(void)
+{
+}
+
+unsigned int notify_changes(void)
+{
+    return 0;
+}
+
+#endif				       /* WANT_NOTIFY */
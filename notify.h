@@ -0,0 +1,33 @@
+/*
+ * UNFS3 change notification
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_NOTIFY_H
+#define UNFS3_NOTIFY_H
+
+#if HAVE_SYS_INOTIFY_H == 1 && !defined(WIN32)
+#define WANT_NOTIFY 1
+#endif
+
+/* kinds of events */
+#define NOTIFY_ATTR	1		/* attributes or data changed */
+#define NOTIFY_NAME	2		/* name created, removed or moved */
+#define NOTIFY_GONE	4		/* watched directory removed or moved */
+#define NOTIFY_LOST	8		/* watch removed, events were lost */
+
+typedef void (*notify_fn) (int wd, int kind, const char *name);
+
+int notify_init(void);
+int notify_enabled(void);
+
+int notify_add(const char *path);
+void notify_rm(int wd);
+void notify_read(notify_fn fn);
+
+/* changes made by requests, to be seen before trusting caches */
+void notify_changed(void);
+unsigned int notify_changes(void);
+
+#endif
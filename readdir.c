@@ -11,11 +11,15 @@
 #include <sys/stat.h>
 #include <rpc/rpc.h>
 #include <dirent.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
 
 #include "nfs.h"
 #include "mount.h"
@@ -25,6 +29,8 @@
 #include "Config/exports.h"
 #include "daemon.h"
 #include "error.h"
+#include "context.h"
+#include "uring.h"
 
 /*
  * maximum number of entries in readdir results
@@ -74,25 +80,57 @@ uint32 directory_hash(const char *path)
     return hval;
 }
 
+/*
+ * allocate entry and name buffers of a request context
+ */
+static int read_dir_buffers(unfs3_ctx_t * ctx)
+{
+    if (ctx->entries)
+	return TRUE;
+
+    ctx->entries = malloc(sizeof(entry3) * MAX_ENTRIES);
+    ctx->names = malloc(NFS_MAXPATHLEN * MAX_ENTRIES);
+    if (!ctx->entries || !ctx->names) {
+	logmsg(LOG_CRIT, "read_dir: Unable to allocate memory");
+	free(ctx->entries);
+	free(ctx->names);
+	ctx->entries = NULL;
+	ctx->names = NULL;
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
 /*
  * perform a READDIR operation
  *
  * fh_decomp must be called directly before to fill the stat cache
+ * the reply points into buffers owned by the request context
  */
 READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
-		     count3 count)
+		     count3 count, unfs3_ctx_t * ctx)
 {
     READDIR3res result;
     READDIR3resok resok;
     cookie3 upper;
-    static entry3 entry[MAX_ENTRIES];
-    backend_statstruct buf;
-    int res;
+    entry3 *entry;
+    backend_statstruct bufs[MAX_ENTRIES];
+    char *paths[MAX_ENTRIES];
+    int errs[MAX_ENTRIES];
+    entry3 **last;
     backend_dirstream *search;
     struct dirent *this;
-    count3 i, real_count;
-    static char obj[NFS_MAXPATHLEN * MAX_ENTRIES];
-    char scratch[NFS_MAXPATHLEN];
+    count3 i, j, real_count;
+    size_t prefix;
+    char *obj;
+
+    if (!read_dir_buffers(ctx)) {
+	result.status = NFS3ERR_IO;
+	return result;
+    }
+    entry = ctx->entries;
+    obj = ctx->names;
 
     /* check upper part of cookie */
     upper = cookie & 0xFFFFFFFF00000000ULL;
@@ -122,7 +160,7 @@ READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
 
     search = backend_opendir(path);
     if (!search) {
-	if ((exports_opts & OPT_REMOVABLE) && (export_point(path))) {
+	if ((ctx->opts & OPT_REMOVABLE) && (export_point(path))) {
 	    /* Removable media export point; probably no media inserted.
 	       Return empty directory. */
 	    memset(resok.cookieverf, 0, NFS3_COOKIEVERFSIZE);
@@ -144,62 +182,66 @@ READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
 	if (this)
 	    this = backend_readdir(search);
 
+    /* names go behind the path of the directory, to stat them together */
+    if (strcmp(path, "/") == 0)
+	prefix = 1;
+    else
+	prefix = strlen(path) + 1;
+
     i = 0;
-    entry[0].name = NULL;
     while (this && real_count < count && i < MAX_ENTRIES) {
-	if (i > 0)
-	    entry[i - 1].nextentry = &entry[i];
+	if (prefix + strlen(this->d_name) >= NFS_MAXPATHLEN) {
+	    result.status = NFS3ERR_IO;
+	    backend_closedir(search);
+	    return result;
+	}
 
-	if (strlen(path) + strlen(this->d_name) + 1 < NFS_MAXPATHLEN) {
+	/* account for entry size */
+	real_count += ENTRY_SIZE + NAME_SIZE(this->d_name);
 
-	    if (strcmp(path, "/") == 0)
-		sprintf(scratch, "/%s", this->d_name);
-	    else
-		sprintf(scratch, "%s/%s", path, this->d_name);
+	/* whoops, overflowed the maximum size */
+	if (real_count > count && i > 0)
+	    break;
 
-	    res = backend_lstat(scratch, &buf);
-	    if (res == -1) {
-		result.status = readdir_err();
-		backend_closedir(search);
-		return result;
-	    }
+	paths[i] = &obj[i * NFS_MAXPATHLEN];
+	memcpy(paths[i], path, prefix - 1);
+	paths[i][prefix - 1] = '/';
+	strcpy(paths[i] + prefix, this->d_name);
 
-	    strcpy(&obj[i * NFS_MAXPATHLEN], this->d_name);
+	entry[i].name = paths[i] + prefix;
+	entry[i].cookie = (cookie + 1 + i) | rcookie;
+	entry[i].nextentry = NULL;
+
+	/* advance to next entry */
+	this = backend_readdir(search);
+	i++;
+    }
+    backend_closedir(search);
+
+    backend_lstat_many(paths, bufs, errs, i);
+
+    resok.reply.entries = NULL;
+    last = &resok.reply.entries;
+    for (j = 0; j < i; j++) {
+	/* removed since it was read, leave it out */
+	if (errs[j] == ENOENT)
+	    continue;
+	if (errs[j] != 0) {
+	    errno = errs[j];
+	    result.status = readdir_err();
+	    return result;
+	}
 
 #if defined(WIN32) || defined(AFS_SUPPORT)
-	    /* See comment in attr.c:get_post_buf */
-	    entry[i].fileid = (buf.st_ino >> 32) ^ (buf.st_ino & 0xffffffff);
+	/* See comment in attr.c:get_post_buf */
+	entry[j].fileid =
+	    (bufs[j].st_ino >> 32) ^ (bufs[j].st_ino & 0xffffffff);
 #else
-	    entry[i].fileid = buf.st_ino;
+	entry[j].fileid = bufs[j].st_ino;
 #endif
-	    entry[i].name = &obj[i * NFS_MAXPATHLEN];
-	    entry[i].cookie = (cookie + 1 + i) | rcookie;
-	    entry[i].nextentry = NULL;
-
-	    /* account for entry size */
-	    real_count += ENTRY_SIZE + NAME_SIZE(this->d_name);
-
-	    /* whoops, overflowed the maximum size */
-	    if (real_count > count && i > 0)
-		entry[i - 1].nextentry = NULL;
-	    else {
-		/* advance to next entry */
-		this = backend_readdir(search);
-	    }
-
-	    i++;
-	} else {
-	    result.status = NFS3ERR_IO;
-	    backend_closedir(search);
-	    return result;
-	}
+	*last = &entry[j];
+	last = &entry[j].nextentry;
     }
-    backend_closedir(search);
-
-    if (entry[0].name)
-	resok.reply.entries = &entry[0];
-    else
-	resok.reply.entries = NULL;
 
     if (this)
 	resok.reply.eof = FALSE;
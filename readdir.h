@@ -8,7 +8,8 @@
 #define UNFS3_READDIR_H
 
 READDIR3res
-read_dir(const char *path, cookie3 cookie, cookieverf3 verf, count3 count);
+read_dir(const char *path, cookie3 cookie, cookieverf3 verf, count3 count,
+	 unfs3_ctx_t *ctx);
 uint32 directory_hash(const char *path);
 
 #endif
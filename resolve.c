@@ -0,0 +1,532 @@
+/*
+ * UNFS3 filehandle resolver threads
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/rpc.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "fh.h"
+#include "fh_cache.h"
+#include "daemon.h"
+#include "backend.h"
+#include "worker.h"
+#include "context.h"
+#include "resolve.h"
+
+/* statistics */
+int resolve_searches = 0;
+int resolve_deferred = 0;
+int resolve_cancelled = 0;
+
+#ifdef WANT_WORKERS
+
+/*
+ * a filehandle missing from the cache is found by reading every
+ * directory along its path whose inode hash matches; in large trees
+ * with many hash matches that takes seconds
+ *
+ * matching directories are kept on a stack per search and read by the
+ * requesting thread and the resolver threads at the same time; once
+ * the request has used up its budget it is answered with
+ * NFS3ERR_JUKEBOX and the resolvers finish the search alone, putting
+ * the result into the filehandle cache for the client's retry
+ *
+ * the brute force search of locate_file runs the same way, reading
+ * every directory of the file system, the most recently changed first;
+ * renames change the directory they move an object into
+ *
+ * a search no client has asked about for a while is given up
+ */
+
+/* budget of a request: milliseconds and lstat calls */
+#define RESOLVE_WAIT	250
+#define RESOLVE_IO	4096
+
+/* seconds a finished search is kept for the retry */
+#define RESOLVE_KEEP	60
+
+/* seconds without a retry after which a search is given up */
+#define RESOLVE_GIVEUP	60
+
+/* kinds of searches */
+#define SEARCH_HASHED	0		/* by inode hashes of the path */
+#define SEARCH_LOCATE	1		/* whole file system */
+
+/* search states */
+#define SEARCH_BUSY	0
+#define SEARCH_FOUND	1
+#define SEARCH_NONE	2
+
+/* directory still to be read */
+struct branch {
+    struct branch *next;
+    int pos;				/* position in inos array */
+    time_t mtime;
+    char path[1];
+};
+
+struct search {
+    struct search *next;
+    int kind;				/* SEARCH_HASHED or SEARCH_LOCATE */
+    unfs3_fh_t fh;
+    struct branch *branches;		/* stack of directories to read */
+    int running;			/* directories being read */
+    int waiting;			/* requests waiting for the result */
+    int io;				/* lstat calls so far */
+    int state;
+    time_t done;			/* when the state was decided */
+    time_t asked;			/* when a request last waited */
+    char result[NFS_MAXPATHLEN];
+};
+
+static struct search *searches = NULL;
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resolve_done = PTHREAD_COND_INITIALIZER;
+
+static int resolvers = 0;
+
+/*
+ * make a directory to be read
+ */
+static struct branch *resolve_branch(int pos, const char *path, time_t mtime)
+{
+    struct branch *b;
+
+    b = malloc(sizeof(struct branch) + strlen(path));
+    if (!b)
+	return NULL;
+
+    b->pos = pos;
+    b->mtime = mtime;
+    strcpy(b->path, path);
+    return b;
+}
+
+/*
+ * push a directory onto the stack of a search, lock held
+ */
+static void resolve_push(struct search *s, struct branch *b)
+{
+    b->next = s->branches;
+    s->branches = b;
+
+    pthread_cond_signal(&resolve_work);
+    if (s->waiting)
+	pthread_cond_broadcast(&resolve_done);
+}
+
+/*
+ * decide the state of a search, lock held
+ */
+static void resolve_decide(struct search *s, int state)
+{
+    struct branch *b;
+
+    __atomic_store_n(&s->state, state, __ATOMIC_RELAXED);
+    s->done = time(NULL);
+
+    while ((b = s->branches) != NULL) {
+	s->branches = b->next;
+	free(b);
+    }
+
+    pthread_cond_broadcast(&resolve_done);
+}
+
+/*
+ * join a name onto a directory path, FALSE if too long
+ */
+static int resolve_join(char *dst, const char *dir, const char *name)
+{
+    if (strcmp(dir, "/") == 0)
+	dir = "";
+
+    return snprintf(dst, NFS_MAXPATHLEN, "%s/%s", dir, name) <
+	NFS_MAXPATHLEN;
+}
+
+/*
+ * order directories by change time
+ */
+static int resolve_older(const void *a, const void *b)
+{
+    time_t ma = (*(struct branch * const *) a)->mtime;
+    time_t mb = (*(struct branch * const *) b)->mtime;
+
+    return ma < mb ? -1 : ma > mb;
+}
+
+/*
+ * does the search continue below a directory?
+ */
+static int resolve_wanted(struct search *s, struct branch *b,
+			  backend_statstruct * buf)
+{
+    if (s->kind == SEARCH_LOCATE)
+	return buf->st_dev == s->fh.dev;
+
+    return b->pos + 1 < s->fh.len &&
+	FH_HASH(buf->st_ino) == s->fh.inos[b->pos];
+}
+
+/*
+ * read one directory of a search, lock not held
+ * returns the number of stat calls made
+ */
+static int resolve_dir(struct search *s, struct branch *b)
+{
+    DIR *dir;
+    struct dirent *entry;
+    backend_statstruct buf;
+    struct branch **subdirs = NULL, **more, *sub;
+    char obj[NFS_MAXPATHLEN];
+    int fd, i, count = 0, room = 0, io = 0;
+
+    fd = open(b->path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+	return 0;
+    dir = fdopendir(fd);
+    if (!dir) {
+	close(fd);
+	return 0;
+    }
+
+    /* the state is read without the lock, a late stop is harmless */
+    while (__atomic_load_n(&s->state, __ATOMIC_RELAXED) == SEARCH_BUSY &&
+	   (entry = readdir(dir)) != NULL) {
+	if (strcmp(entry->d_name, ".") == 0 ||
+	    strcmp(entry->d_name, "..") == 0)
+	    continue;
+
+	/* only directories and possible matches are looked at closer */
+	if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN &&
+	    entry->d_ino != s->fh.ino)
+	    continue;
+
+	if (!resolve_join(obj, b->path, entry->d_name))
+	    continue;
+
+	io++;
+	if (fstatat(fd, entry->d_name, &buf, AT_SYMLINK_NOFOLLOW) == -1)
+	    continue;
+
+	if (buf.st_dev == s->fh.dev && buf.st_ino == s->fh.ino) {
+	    /* found the object */
+	    pthread_mutex_lock(&resolve_lock);
+	    if (s->state == SEARCH_BUSY) {
+		strcpy(s->result, obj);
+		resolve_decide(s, SEARCH_FOUND);
+	    }
+	    pthread_mutex_unlock(&resolve_lock);
+
+	    /* for the retry of a request that has given up */
+	    fh_cache_add(s->fh.dev, s->fh.ino, obj);
+	    break;
+	}
+
+	if (!S_ISDIR(buf.st_mode) || !resolve_wanted(s, b, &buf))
+	    continue;
+
+	if (count == room) {
+	    room = room ? room * 2 : 16;
+	    more = realloc(subdirs, room * sizeof(struct branch *));
+	    if (!more)
+		break;
+	    subdirs = more;
+	}
+	sub = resolve_branch(b->pos + 1, obj, buf.st_mtime);
+	if (sub)
+	    subdirs[count++] = sub;
+    }
+
+    closedir(dir);
+
+    /* pushed last, the most recently changed are read first */
+    if (count > 1)
+	qsort(subdirs, count, sizeof(struct branch *), resolve_older);
+
+    pthread_mutex_lock(&resolve_lock);
+    for (i = 0; i < count; i++)
+	if (s->state == SEARCH_BUSY)
+	    resolve_push(s, subdirs[i]);
+	else
+	    free(subdirs[i]);
+    pthread_mutex_unlock(&resolve_lock);
+
+    free(subdirs);
+    return io;
+}
+
+/*
+ * read the directory on top of the stack of a search
+ * called and returns with the lock held
+ */
+static void resolve_step(struct search *s)
+{
+    struct branch *b = s->branches;
+    int io;
+
+    s->branches = b->next;
+    s->running++;
+    pthread_mutex_unlock(&resolve_lock);
+
+    io = resolve_dir(s, b);
+    free(b);
+
+    pthread_mutex_lock(&resolve_lock);
+    s->running--;
+    s->io += io;
+    if (s->state == SEARCH_BUSY && !s->branches && !s->running)
+	resolve_decide(s, SEARCH_NONE);
+}
+
+/*
+ * unlink and free a search, lock held
+ */
+static void resolve_free(struct search *s)
+{
+    struct search **link = &searches;
+
+    while (*link != s)
+	link = &(*link)->next;
+    *link = s->next;
+
+    free(s);
+}
+
+/*
+ * give up searches the client no longer asks about and forget
+ * finished ones nobody came back for, lock held
+ */
+static void resolve_expire(void)
+{
+    struct search *s, *next;
+    time_t now = time(NULL);
+
+    for (s = searches; s; s = next) {
+	next = s->next;
+	if (s->state == SEARCH_BUSY && !s->waiting &&
+	    s->asked + RESOLVE_GIVEUP < now) {
+	    resolve_decide(s, SEARCH_NONE);
+	    s->done = 0;
+	    resolve_cancelled++;
+	}
+	if (s->state != SEARCH_BUSY && !s->running && !s->waiting &&
+	    s->done + RESOLVE_KEEP < now)
+	    resolve_free(s);
+    }
+}
+
+/*
+ * resolver thread main loop
+ */
+static void *resolve_main(U(void *arg))
+{
+    struct search *s;
+    sigset_t set;
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&resolve_lock);
+    for (;;) {
+	resolve_expire();
+	for (s = searches; s && !s->branches; s = s->next) ;
+
+	if (s)
+	    resolve_step(s);
+	else
+	    pthread_cond_wait(&resolve_work, &resolve_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * start resolver threads
+ */
+int resolve_start(int threads)
+{
+    pthread_t thread;
+    int i;
+
+    for (i = 0; i < threads; i++) {
+	if (pthread_create(&thread, NULL, resolve_main, NULL) != 0) {
+	    logmsg(LOG_WARNING, "could not create resolver thread");
+	    break;
+	}
+	pthread_detach(thread);
+	resolvers++;
+    }
+
+    return resolvers > 0 ? 0 : -1;
+}
+
+/*
+ * milliseconds from now on the clock used by condition variables
+ */
+static void resolve_deadline(struct timespec *ts, int ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long) (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+	ts->tv_sec++;
+	ts->tv_nsec -= 1000000000;
+    }
+}
+
+static int resolve_expired(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec ||
+	(now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/*
+ * search for an object within the budget of a request, starting at
+ * directory root; a search already running for it is joined
+ */
+static int resolve_run(const unfs3_fh_t * fh, int kind, const char *root,
+		       char *result, unfs3_ctx_t * ctx)
+{
+    struct search *s;
+    struct branch *b;
+    struct timespec deadline;
+    int state;
+
+    if (!resolvers)
+	return RESOLVE_OFF;
+
+    resolve_deadline(&deadline, RESOLVE_WAIT);
+
+    pthread_mutex_lock(&resolve_lock);
+    resolve_expire();
+
+    for (s = searches; s; s = s->next)
+	if (s->kind == kind && s->fh.dev == fh->dev && s->fh.ino == fh->ino)
+	    break;
+
+    if (!s) {
+	s = calloc(1, sizeof(struct search));
+	b = resolve_branch(0, root, 0);
+	if (!s || !b) {
+	    pthread_mutex_unlock(&resolve_lock);
+	    free(s);
+	    free(b);
+	    return RESOLVE_OFF;
+	}
+	s->kind = kind;
+	s->fh = *fh;
+	s->state = SEARCH_BUSY;
+	s->next = searches;
+	searches = s;
+	resolve_searches++;
+	resolve_push(s, b);
+    }
+
+    /* help with the search until it is decided or the budget is gone */
+    s->asked = time(NULL);
+    s->waiting++;
+    while (s->state == SEARCH_BUSY && s->io < RESOLVE_IO &&
+	   !resolve_expired(&deadline)) {
+	if (s->branches)
+	    resolve_step(s);
+	else if (pthread_cond_timedwait(&resolve_done, &resolve_lock,
+					&deadline) == ETIMEDOUT)
+	    break;
+    }
+    s->waiting--;
+
+    state = s->state;
+    if (state == SEARCH_FOUND)
+	strcpy(result, s->result);
+
+    if (state != SEARCH_BUSY) {
+	if (!s->running && !s->waiting)
+	    resolve_free(s);
+    } else
+	resolve_deferred++;
+    pthread_mutex_unlock(&resolve_lock);
+
+    if (state == SEARCH_BUSY)
+	return RESOLVE_BUSY;
+    if (state == SEARCH_NONE)
+	return RESOLVE_NONE;
+
+    /* the object may have moved since it was found */
+    if (backend_lstat(result, &ctx->st) == -1 ||
+	ctx->st.st_dev != fh->dev || ctx->st.st_ino != fh->ino) {
+	ctx->st_valid = FALSE;
+	return RESOLVE_NONE;
+    }
+    ctx->st_valid = TRUE;
+    return RESOLVE_FOUND;
+}
+
+/*
+ * resolve a filehandle into a path by its inode hashes
+ */
+int resolve_fh(const unfs3_fh_t * fh, char *result, unfs3_ctx_t * ctx)
+{
+    return resolve_run(fh, SEARCH_HASHED, "/", result, ctx);
+}
+
+/*
+ * find an object by device and inode below the mount point dir
+ */
+int resolve_locate(uint32 dev, uint64 ino, const char *dir, char *result,
+		   unfs3_ctx_t * ctx)
+{
+    unfs3_fh_t fh;
+
+    memset(&fh, 0, sizeof(fh));
+    fh.dev = dev;
+    fh.ino = ino;
+
+    return resolve_run(&fh, SEARCH_LOCATE, dir, result, ctx);
+}
+
+#else				       /* WANT_WORKERS */
+
+int resolve_start(U(int threads))
+{
+    return -1;
+}
+
+int resolve_fh(U(const unfs3_fh_t * fh), U(char *result),
+	       U(unfs3_ctx_t * ctx))
+{
+    return RESOLVE_OFF;
+}
+
+int resolve_locate(U(uint32 dev), U(uint64 ino), U(const char *dir),
+		   U(char *result), U(unfs3_ctx_t * ctx))
+{
+    return RESOLVE_OFF;
+}
+
+#endif				       /* WANT_WORKERS */
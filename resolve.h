@@ -0,0 +1,26 @@
+/*
+ * UNFS3 filehandle resolver threads
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_RESOLVE_H
+#define UNFS3_RESOLVE_H
+
+/* resolve_fh results */
+#define RESOLVE_OFF	-1		/* no resolvers, search serially */
+#define RESOLVE_NONE	0		/* object not found */
+#define RESOLVE_FOUND	1		/* path stored in result */
+#define RESOLVE_BUSY	2		/* search goes on in the background */
+
+/* statistics */
+extern int resolve_searches;
+extern int resolve_deferred;
+extern int resolve_cancelled;
+
+int resolve_start(int threads);
+int resolve_fh(const unfs3_fh_t *fh, char *result, unfs3_ctx_t *ctx);
+int resolve_locate(uint32 dev, uint64 ino, const char *dir, char *result,
+		   unfs3_ctx_t *ctx);
+
+#endif
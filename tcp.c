@@ -0,0 +1,964 @@
+/*
+ * UNFS3 native TCP transport
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "mount.h"
+#include "daemon.h"
+#include "worker.h"
+#include "event.h"
+#include "xdr.h"
+#include "tcp.h"
+
+/* registered services */
+#define TCP_SERVICES 8
+
+static struct {
+    unsigned long prog;
+    unsigned long vers;
+    void (*dispatch) (struct svc_req *, SVCXPRT *);
+} services[TCP_SERVICES];
+static int service_count = 0;
+
+/*
+ * make a service reachable over the native transport
+ */
+void tcp_register(unsigned long prog, unsigned long vers,
+		  void (*dispatch) (struct svc_req *, SVCXPRT *))
+{
+    if (service_count == TCP_SERVICES) {
+	logmsg(LOG_CRIT, "tcp_register: too many services");
+	return;
+    }
+
+    services[service_count].prog = prog;
+    services[service_count].vers = vers;
+    services[service_count].dispatch = dispatch;
+    service_count++;
+}
+
+#ifdef WANT_EPOLL
+
+#include <sys/poll.h>
+#ifdef HAVE_RPC_SVC_MT_H
+# include <rpc/svc_mt.h>
+#endif
+#if HAVE_SYS_SENDFILE_H == 1
+# include <sys/sendfile.h>
+#endif
+
+/*
+ * connections are read by whichever thread gets their epoll event; the
+ * reader splits the stream into records and every record becomes a
+ * call of its own, so the calls of one connection run in parallel and
+ * each reply is written as soon as it is ready
+ */
+
+/* largest record accepted, same allowance for the header as for UDP */
+#define TCP_MAXREC (NFS_MAXDATA_TCP + 4096)
+
+/* read size for small records, larger fragments are read in place */
+#define TCP_CHUNK 65536
+
+/* calls in flight per connection before reading pauses */
+#define TCP_MAXCALLS 128
+
+/* milliseconds to wait for a client to take a reply */
+#define TCP_SENDWAIT 35000
+
+/* free page-aligned WRITE buffers kept for reuse */
+#define TCP_POOL 32
+
+struct tcp_conn {
+    int fd;
+    struct sockaddr_storage peer;
+    socklen_t peerlen;
+
+    /* protected by lock */
+    LOCK_T lock;
+    int refs;				/* registration and calls */
+    int paused;				/* too many calls in flight */
+    int dead;				/* sending failed */
+
+    /* serializes replies */
+    LOCK_T send_lock;
+
+    /* input state, owned by the thread holding the read event */
+    unsigned char hdr[4];		/* record mark */
+    int hdr_len;
+    uint32 frag_left;			/* bytes missing from fragment */
+    int frag_last;
+    struct tcp_call *rec;		/* record being assembled */
+};
+
+struct tcp_call {
+    SVCXPRT xprt;			/* handed to the dispatcher */
+    struct tcp_call *next;
+    struct tcp_conn *conn;
+    uint32 xid;
+    char *data;				/* the record */
+    char *pool;				/* pool buffer holding data */
+    uint32 len;
+    int refs;				/* dispatcher and detached reply */
+    int splice_fd;			/* file data ending the reply */
+    off64_t splice_off;
+    uint32 splice_len;
+    XDR xdrs;				/* decodes the record */
+    char cred_area[TCP_CRED_AREA];
+#if HAVE_SVC_TLI_CREATE == 1
+    SVCXPRT_EXT ext;
+#endif
+};
+
+/* input is staged per thread, every read is split up completely */
+static THREAD_LOCAL char *stage = NULL;
+
+/*
+ * records of large WRITEs go into page-aligned buffers, placed so that
+ * the data starts on a page, which are kept in a pool
+ */
+static char *pool[TCP_POOL];
+static int pool_count = 0;
+static size_t pool_page = 0;
+DEFINE_LOCK(pool_lock);
+
+/* calls waiting for a worker */
+static struct tcp_call *queue_head = NULL;
+static struct tcp_call **queue_tail = &queue_head;
+DEFINE_LOCK(queue_lock);
+
+/*
+ * drop a reference to a connection
+ */
+static void tcp_put(struct tcp_conn *conn)
+{
+    int refs, resume, fd = conn->fd;
+
+    LOCK(conn->lock);
+    refs = --conn->refs;
+    resume = conn->paused && (refs <= TCP_MAXCALLS || conn->dead);
+    if (resume)
+	conn->paused = FALSE;
+    UNLOCK(conn->lock);
+
+    if (refs == 0) {
+	close(conn->fd);
+	LOCK_FREE(conn->lock);
+	LOCK_FREE(conn->send_lock);
+	free(conn);
+    } else if (resume)
+	event_rearm(fd);
+}
+
+/*
+ * give up on a connection whose output is broken
+ * the reader notices and closes it
+ */
+static void tcp_kill(struct tcp_conn *conn)
+{
+    LOCK(conn->lock);
+    conn->dead = TRUE;
+    UNLOCK(conn->lock);
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ * wait until a connection can take more output
+ * returns FALSE if the client does not take it in time
+ */
+static int tcp_wait(struct tcp_conn *conn)
+{
+    struct pollfd pfd;
+    int res;
+
+    pfd.fd = conn->fd;
+    pfd.events = POLLOUT;
+    res = poll(&pfd, 1, TCP_SENDWAIT);
+
+    return res > 0 || (res == -1 && errno == EINTR);
+}
+
+/*
+ * write a buffer, send_lock must be held
+ */
+static void tcp_write(struct tcp_conn *conn, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0 && !conn->dead) {
+	n = send(conn->fd, buf, len, MSG_NOSIGNAL);
+	if (n > 0) {
+	    buf += n;
+	    len -= n;
+	    continue;
+	}
+	if (n == -1 && errno == EINTR)
+	    continue;
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+	    tcp_wait(conn))
+	    continue;
+
+	tcp_kill(conn);
+    }
+}
+
+/*
+ * write a complete reply, in one piece with respect to other replies
+ */
+static void tcp_send(struct tcp_conn *conn, const char *buf, size_t len)
+{
+    LOCK(conn->send_lock);
+    tcp_write(conn, buf, len);
+    UNLOCK(conn->send_lock);
+}
+
+#if HAVE_SYS_SENDFILE_H == 1
+/*
+ * write a reply whose last len bytes come from a file, plus padding
+ */
+static void tcp_send_file(struct tcp_conn *conn, const char *buf,
+			  size_t size, int fd, off_t off, size_t len)
+{
+    static const char zero[4] = { 0, 0, 0, 0 };
+    size_t pad = (4 - (len & 3)) & 3;
+    ssize_t n;
+
+    LOCK(conn->send_lock);
+    tcp_write(conn, buf, size);
+
+    while (len > 0 && !conn->dead) {
+	n = sendfile(conn->fd, fd, &off, len);
+	if (n > 0) {
+	    len -= n;
+	    continue;
+	}
+	if (n == -1 && errno == EINTR)
+	    continue;
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+	    tcp_wait(conn))
+	    continue;
+
+	/*
+	 * the record length has been sent; if the file shrank or
+	 * cannot be read, the only way out is to drop the connection,
+	 * the client will send the READ again
+	 */
+	tcp_kill(conn);
+    }
+
+    tcp_write(conn, zero, pad);
+    UNLOCK(conn->send_lock);
+}
+#endif
+
+static bool_t tcp_recv(U(SVCXPRT * xprt), U(struct rpc_msg *msg))
+{
+    return FALSE;
+}
+
+static enum xprt_stat tcp_stat(U(SVCXPRT * xprt))
+{
+    return XPRT_IDLE;
+}
+
+/*
+ * decode WRITE arguments, leaving the data in the record
+ */
+static bool_t tcp_write_args(XDR * xdrs, WRITE3args * objp)
+{
+    if (!xdr_nfs_fh3(xdrs, &objp->file))
+	return FALSE;
+    if (!xdr_offset3(xdrs, &objp->offset))
+	return FALSE;
+    if (!xdr_count3(xdrs, &objp->count))
+	return FALSE;
+    if (!xdr_stable_how(xdrs, &objp->stable))
+	return FALSE;
+    if (!xdr_u_int(xdrs, &objp->data.data_len))
+	return FALSE;
+
+    objp->data.data_val =
+	(char *) XDR_INLINE(xdrs, RNDUP(objp->data.data_len));
+    return objp->data.data_val != NULL;
+}
+
+static bool_t tcp_getargs(SVCXPRT * xprt, xdrproc_t xargs, tcp_args_t args)
+{
+    struct tcp_call *call = xprt->xp_p1;
+
+    if (xargs == (xdrproc_t) xdr_WRITE3args)
+	return tcp_write_args(&call->xdrs, (WRITE3args *) args);
+
+    return (*xargs) (&call->xdrs, args);
+}
+
+/*
+ * encode reply with record mark and send it
+ */
+static bool_t tcp_reply(SVCXPRT * xprt, struct rpc_msg *msg)
+{
+    struct tcp_call *call = xprt->xp_p1;
+    XDR xdrs;
+    char *buf;
+    u_int size;
+    uint32 mark, len;
+
+    msg->rm_xid = call->xid;
+
+    size = xdr_sizeof((xdrproc_t) xdr_replymsg, msg);
+    buf = malloc(size + 4);
+    if (!buf)
+	return FALSE;
+
+    xdrmem_create(&xdrs, buf + 4, size, XDR_ENCODE);
+    if (!xdr_replymsg(&xdrs, msg)) {
+	free(buf);
+	return FALSE;
+    }
+    size = XDR_GETPOS(&xdrs);
+
+#if HAVE_SYS_SENDFILE_H == 1
+    if (call->splice_fd != -1) {
+	/* the empty opaque at the end gets the file data */
+	len = htonl(call->splice_len);
+	memcpy(buf + size, &len, 4);
+	mark = htonl(0x80000000 |
+		     (size + call->splice_len + ((4 - (call->splice_len & 3)) & 3)));
+	memcpy(buf, &mark, 4);
+
+	tcp_send_file(call->conn, buf, size + 4, call->splice_fd,
+		      call->splice_off, call->splice_len);
+	call->splice_fd = -1;
+	free(buf);
+	return TRUE;
+    }
+#endif
+
+    mark = htonl(0x80000000 | size);
+    memcpy(buf, &mark, 4);
+
+    tcp_send(call->conn, buf, size + 4);
+    free(buf);
+
+    /* a reply for a closed connection is simply dropped */
+    return TRUE;
+}
+
+static bool_t tcp_freeargs(U(SVCXPRT * xprt), xdrproc_t xargs,
+			   tcp_args_t args)
+{
+    XDR xdrs;
+
+    /* WRITE data belongs to the record */
+    if (xargs == (xdrproc_t) xdr_WRITE3args)
+	((WRITE3args *) args)->data.data_val = NULL;
+
+    xdrs.x_op = XDR_FREE;
+    return (*xargs) (&xdrs, args);
+}
+
+static void tcp_call_put(struct tcp_call *call);
+
+/*
+ * a detached call has been answered
+ */
+static void tcp_destroy(SVCXPRT * xprt)
+{
+    tcp_call_put(xprt->xp_p1);
+}
+
+static const struct xp_ops tcp_ops = {
+    tcp_recv,
+    tcp_stat,
+    tcp_getargs,
+    tcp_reply,
+    tcp_freeargs,
+    tcp_destroy
+};
+
+#if HAVE_SVC_TLI_CREATE == 1
+static bool_t tcp_control(U(SVCXPRT * xprt), U(const u_int rq),
+			  U(void *in))
+{
+    return FALSE;
+}
+
+static const struct xp_ops2 tcp_ops2 = {
+    tcp_control
+};
+#endif
+
+/*
+ * set up a new connection, fd must be non-blocking
+ */
+struct tcp_conn *tcp_open(int fd)
+{
+    struct tcp_conn *conn;
+
+    conn = malloc(sizeof(struct tcp_conn));
+    if (!conn)
+	return NULL;
+
+    memset(conn, 0, sizeof(struct tcp_conn));
+    conn->fd = fd;
+    conn->refs = 1;
+    conn->peerlen = sizeof(conn->peer);
+    if (getpeername(fd, (struct sockaddr *) &conn->peer,
+		    &conn->peerlen) == -1)
+	conn->peerlen = 0;
+
+    LOCK_INIT(conn->lock);
+    LOCK_INIT(conn->send_lock);
+
+    return conn;
+}
+
+/*
+ * take a buffer from the pool, room for a record plus a page
+ */
+static char *tcp_pool_get(void)
+{
+    void *buf = NULL;
+
+    LOCK(pool_lock);
+    if (pool_count > 0)
+	buf = pool[--pool_count];
+    if (!pool_page)
+	pool_page = sysconf(_SC_PAGESIZE);
+    UNLOCK(pool_lock);
+
+    if (!buf && posix_memalign(&buf, pool_page, TCP_MAXREC + pool_page) != 0)
+	return NULL;
+
+    return buf;
+}
+
+static void tcp_pool_put(char *buf)
+{
+    LOCK(pool_lock);
+    if (pool_count < TCP_POOL) {
+	pool[pool_count++] = buf;
+	buf = NULL;
+    }
+    UNLOCK(pool_lock);
+
+    free(buf);
+}
+
+/*
+ * read an XDR word at *pos of the first len bytes of a record
+ */
+static int tcp_peek(const char *buf, size_t len, size_t *pos, uint32 *word)
+{
+    if (*pos + 4 > len)
+	return FALSE;
+
+    memcpy(word, buf + *pos, 4);
+    *word = ntohl(*word);
+    *pos += 4;
+    return TRUE;
+}
+
+/*
+ * offset of the data of an NFS WRITE call from the first len bytes of
+ * its record, -1 for other calls or if the header is not all there
+ */
+static long tcp_write_offset(const char *buf, size_t len)
+{
+    size_t pos = 4;			/* xid */
+    uint32 word, i;
+
+    /* direction, RPC version, program, version, procedure */
+    if (!tcp_peek(buf, len, &pos, &word) || word != CALL ||
+	!tcp_peek(buf, len, &pos, &word) || word != RPC_MSG_VERSION ||
+	!tcp_peek(buf, len, &pos, &word) || word != NFS3_PROGRAM ||
+	!tcp_peek(buf, len, &pos, &word) || word != NFS_V3 ||
+	!tcp_peek(buf, len, &pos, &word) || word != NFSPROC3_WRITE)
+	return -1;
+
+    /* credentials and verifier */
+    for (i = 0; i < 2; i++) {
+	if (!tcp_peek(buf, len, &pos, &word) ||
+	    !tcp_peek(buf, len, &pos, &word) || word > MAX_AUTH_BYTES)
+	    return -1;
+	pos += RNDUP(word);
+    }
+
+    /* filehandle, then offset, count, stable and data length */
+    if (!tcp_peek(buf, len, &pos, &word) || word > NFS3_FHSIZE)
+	return -1;
+    pos += RNDUP(word) + 20;
+
+    return pos <= len ? (long) pos : -1;
+}
+
+/*
+ * start a new call on a connection
+ */
+static struct tcp_call *tcp_call_new(struct tcp_conn *conn)
+{
+    struct tcp_call *call;
+    SVCXPRT *xprt;
+
+    call = malloc(sizeof(struct tcp_call));
+    if (!call)
+	return NULL;
+
+    memset(call, 0, sizeof(struct tcp_call));
+    call->conn = conn;
+    call->refs = 1;
+    call->splice_fd = -1;
+
+    xprt = &call->xprt;
+    xprt->xp_sock = conn->fd;
+    xprt->xp_ops = &tcp_ops;
+    xprt->xp_p1 = call;
+    xprt->xp_addrlen = conn->peerlen;
+    memcpy(&xprt->xp_raddr, &conn->peer,
+	   conn->peerlen < sizeof(xprt->xp_raddr) ?
+	   conn->peerlen : sizeof(xprt->xp_raddr));
+#if HAVE_SVC_TLI_CREATE == 1
+    xprt->xp_ops2 = &tcp_ops2;
+    xprt->xp_rtaddr.buf = &conn->peer;
+    xprt->xp_rtaddr.len = conn->peerlen;
+    xprt->xp_rtaddr.maxlen = sizeof(conn->peer);
+    xprt->xp_p3 = &call->ext;
+#endif
+
+    LOCK(conn->lock);
+    conn->refs++;
+    UNLOCK(conn->lock);
+
+    return call;
+}
+
+/*
+ * release the record of a call
+ */
+static void tcp_call_data_free(struct tcp_call *call)
+{
+    if (call->pool)
+	tcp_pool_put(call->pool);
+    else
+	free(call->data);
+
+    call->pool = NULL;
+    call->data = NULL;
+}
+
+/*
+ * release a call and its reference to the connection
+ */
+static void tcp_call_free(struct tcp_call *call)
+{
+    struct tcp_conn *conn = call->conn;
+
+    tcp_call_data_free(call);
+    free(call);
+    tcp_put(conn);
+}
+
+/*
+ * drop a reference to a call, the last one frees it
+ */
+static void tcp_call_put(struct tcp_call *call)
+{
+    int refs;
+
+    LOCK(call->conn->lock);
+    refs = --call->refs;
+    UNLOCK(call->conn->lock);
+
+    if (refs == 0)
+	tcp_call_free(call);
+}
+
+/*
+ * the epoll registration is gone, release the connection
+ */
+void tcp_close(struct tcp_conn *conn)
+{
+    struct tcp_call *rec = conn->rec;
+
+    /* a partial record holds a reference, too */
+    conn->rec = NULL;
+    if (rec)
+	tcp_call_free(rec);
+
+    tcp_put(conn);
+}
+
+/*
+ * a record mark has been read, followed by len bytes at next
+ */
+static int tcp_fragment(struct tcp_conn *conn, const char *next, size_t len)
+{
+    uint32 mark, size;
+    long off;
+    char *data;
+
+    memcpy(&mark, conn->hdr, 4);
+    mark = ntohl(mark);
+    conn->frag_last = (mark & 0x80000000) != 0;
+    conn->frag_left = mark & 0x7FFFFFFF;
+
+    if (!conn->rec) {
+	conn->rec = tcp_call_new(conn);
+	if (!conn->rec)
+	    return -1;
+    }
+
+    if (conn->frag_left > TCP_MAXREC - conn->rec->len) {
+	logmsg(LOG_WARNING, "tcp record too large, closing connection");
+	return -1;
+    }
+
+    /* a large WRITE in one fragment goes into a pool buffer */
+    if (conn->rec->len == 0 && conn->frag_last &&
+	conn->frag_left >= TCP_CHUNK &&
+	(off = tcp_write_offset(next, len)) != -1 &&
+	(conn->rec->pool = tcp_pool_get())) {
+	conn->rec->data = conn->rec->pool +
+	    (pool_page - off % pool_page) % pool_page;
+	return 0;
+    }
+
+    /* the whole record ends up in one buffer */
+    size = conn->rec->len + conn->frag_left;
+    if (size > 0) {
+	data = realloc(conn->rec->data, size);
+	if (!data)
+	    return -1;
+	conn->rec->data = data;
+    }
+
+    return 0;
+}
+
+/*
+ * a fragment is complete, queue the record if it was the last one
+ */
+static void tcp_fragment_done(struct tcp_conn *conn,
+			      struct tcp_call ***tail)
+{
+    conn->hdr_len = 0;
+    if (!conn->frag_last)
+	return;
+
+    **tail = conn->rec;
+    *tail = &conn->rec->next;
+    conn->rec = NULL;
+}
+
+/*
+ * free calls that will not be run
+ */
+static void tcp_discard(struct tcp_call *calls)
+{
+    struct tcp_call *next;
+
+    while (calls) {
+	next = calls->next;
+	tcp_call_free(calls);
+	calls = next;
+    }
+}
+
+/*
+ * read from a connection and split the input into calls
+ */
+int tcp_input(struct tcp_conn *conn, struct tcp_call **calls)
+{
+    struct tcp_call *rec;
+    struct tcp_call **tail = calls;
+    ssize_t n;
+    int pos = 0, end = 0, paused;
+
+    *calls = NULL;
+
+    if (!stage) {
+	stage = malloc(TCP_CHUNK);
+	if (!stage) {
+	    logmsg(LOG_CRIT, "tcp_input: Unable to allocate memory");
+	    return TCP_CLOSED;
+	}
+    }
+
+    for (;;) {
+	/* split staged input into records */
+	while (pos < end) {
+	    if (conn->hdr_len < 4) {
+		conn->hdr[conn->hdr_len++] = stage[pos++];
+		if (conn->hdr_len == 4) {
+		    if (tcp_fragment(conn, stage + pos, end - pos) == -1) {
+			tcp_discard(*calls);
+			*calls = NULL;
+			return TCP_CLOSED;
+		    }
+		    if (conn->frag_left == 0)
+			tcp_fragment_done(conn, &tail);
+		}
+		continue;
+	    }
+
+	    rec = conn->rec;
+	    n = end - pos;
+	    if (n > (ssize_t) conn->frag_left)
+		n = conn->frag_left;
+	    memcpy(rec->data + rec->len, stage + pos, n);
+	    pos += n;
+	    rec->len += n;
+	    conn->frag_left -= n;
+	    if (conn->frag_left == 0)
+		tcp_fragment_done(conn, &tail);
+	}
+	pos = end = 0;
+
+	LOCK(conn->lock);
+	if (conn->dead) {
+	    UNLOCK(conn->lock);
+	    tcp_discard(*calls);
+	    *calls = NULL;
+	    return TCP_CLOSED;
+	}
+	paused = conn->refs > TCP_MAXCALLS;
+	conn->paused = paused;
+	UNLOCK(conn->lock);
+	if (paused)
+	    return TCP_PAUSED;
+
+	/* large fragments go straight into the record */
+	if (conn->hdr_len == 4 && conn->frag_left >= TCP_CHUNK) {
+	    rec = conn->rec;
+	    n = read(conn->fd, rec->data + rec->len, conn->frag_left);
+	    if (n > 0) {
+		rec->len += n;
+		conn->frag_left -= n;
+		if (conn->frag_left == 0)
+		    tcp_fragment_done(conn, &tail);
+		continue;
+	    }
+	} else {
+	    n = read(conn->fd, stage, TCP_CHUNK);
+	    if (n > 0) {
+		end = n;
+		continue;
+	    }
+	}
+
+	if (n == -1 && errno == EINTR)
+	    continue;
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return TCP_REARM;
+
+	/* end of file or error */
+	tcp_discard(*calls);
+	*calls = NULL;
+	return TCP_CLOSED;
+    }
+}
+
+struct tcp_call *tcp_next(struct tcp_call *call)
+{
+    return call->next;
+}
+
+/*
+ * find the service for a call and dispatch it
+ */
+static void tcp_dispatch(struct svc_req *req, SVCXPRT * xprt)
+{
+    unsigned long low = ~0UL, high = 0;
+    int i, found = FALSE;
+
+    for (i = 0; i < service_count; i++) {
+	if (services[i].prog != req->rq_prog)
+	    continue;
+	if (services[i].vers == req->rq_vers) {
+	    services[i].dispatch(req, xprt);
+	    return;
+	}
+	found = TRUE;
+	if (services[i].vers < low)
+	    low = services[i].vers;
+	if (services[i].vers > high)
+	    high = services[i].vers;
+    }
+
+    if (found)
+	svcerr_progvers(xprt, low, high);
+    else
+	svcerr_noprog(xprt);
+}
+
+/*
+ * decode, authenticate and dispatch the call in xdrs, also used by
+ * the native UDP transport
+ */
+void tcp_serve(SVCXPRT * xprt, XDR * xdrs, char *cred_area, uint32 * xid)
+{
+    struct rpc_msg msg;
+    struct svc_req req;
+    enum auth_stat why;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.rm_call.cb_cred.oa_base = cred_area;
+    msg.rm_call.cb_verf.oa_base = &cred_area[MAX_AUTH_BYTES];
+
+    /* garbage is dropped without a reply, like the RPC library does */
+    if (!xdr_callmsg(xdrs, &msg) || msg.rm_direction != CALL)
+	return;
+
+    *xid = msg.rm_xid;
+
+    memset(&req, 0, sizeof(req));
+    req.rq_xprt = xprt;
+    req.rq_prog = msg.rm_call.cb_prog;
+    req.rq_vers = msg.rm_call.cb_vers;
+    req.rq_proc = msg.rm_call.cb_proc;
+    req.rq_cred = msg.rm_call.cb_cred;
+    req.rq_clntcred = &cred_area[2 * MAX_AUTH_BYTES];
+
+    why = _authenticate(&req, &msg);
+    if (why != AUTH_OK)
+	svcerr_auth(xprt, why);
+    else
+	tcp_dispatch(&req, xprt);
+}
+
+/*
+ * run a call, then release it
+ */
+void tcp_run(struct tcp_call *call)
+{
+    call->next = NULL;
+    xdrmem_create(&call->xdrs, call->data, call->len, XDR_DECODE);
+
+    if (call->len > 0)
+	tcp_serve(&call->xprt, &call->xdrs, call->cred_area, &call->xid);
+
+    /* a detached call only needs its connection from now on */
+    tcp_call_data_free(call);
+    tcp_call_put(call);
+}
+
+/*
+ * keep a call alive after its dispatcher returns, so that it can be
+ * answered later; svc_destroy() releases it after the reply
+ * returns NULL for calls of other transports
+ */
+SVCXPRT *tcp_detach(SVCXPRT * xprt)
+{
+    struct tcp_call *call;
+
+    if (xprt->xp_ops != &tcp_ops)
+	return NULL;
+
+    call = xprt->xp_p1;
+    LOCK(call->conn->lock);
+    call->refs++;
+    UNLOCK(call->conn->lock);
+
+    return xprt;
+}
+
+/*
+ * return the xid of a call, FALSE for calls of other transports
+ */
+int tcp_xid(SVCXPRT * xprt, uint32 * xid)
+{
+    struct tcp_call *call;
+
+    if (xprt->xp_ops != &tcp_ops)
+	return FALSE;
+
+    call = xprt->xp_p1;
+    *xid = call->xid;
+    return TRUE;
+}
+
+/*
+ * have the data of the next reply sent straight from a file
+ * the reply must end in an empty opaque, which is sent as len bytes
+ * of fd from offset off; returns FALSE if the transport cannot do it
+ */
+int tcp_splice(SVCXPRT * xprt, int fd, off64_t off, uint32 len)
+{
+#if HAVE_SYS_SENDFILE_H == 1
+    struct tcp_call *call;
+
+    if (xprt->xp_ops != &tcp_ops)
+	return FALSE;
+
+    call = xprt->xp_p1;
+    call->splice_fd = fd;
+    call->splice_off = off;
+    call->splice_len = len;
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/*
+ * hand calls to the workers
+ */
+void tcp_queue(struct tcp_call *calls)
+{
+    int count = 0;
+
+    LOCK(queue_lock);
+    *queue_tail = calls;
+    while (calls) {
+	queue_tail = &calls->next;
+	calls = calls->next;
+	count++;
+    }
+    UNLOCK(queue_lock);
+
+    event_wake(count);
+}
+
+/*
+ * take a call from the queue
+ */
+struct tcp_call *tcp_dequeue(void)
+{
+    struct tcp_call *call;
+
+    LOCK(queue_lock);
+    call = queue_head;
+    if (call) {
+	queue_head = call->next;
+	if (!queue_head)
+	    queue_tail = &queue_head;
+    }
+    UNLOCK(queue_lock);
+
+    return call;
+}
+
+#else				       /* WANT_EPOLL */
+
+int tcp_splice(U(SVCXPRT * xprt), U(int fd), U(off64_t off), U(uint32 len))
+{
+    return FALSE;
+}
+
+#endif				       /* WANT_EPOLL */
@@ -0,0 +1,51 @@
+/*
+ * UNFS3 native TCP transport
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_TCP_H
+#define UNFS3_TCP_H
+
+/* tcp_input results */
+#define TCP_CLOSED	-1		/* connection is gone */
+#define TCP_PAUSED	0		/* re-armed when calls complete */
+#define TCP_REARM	1		/* wait for more input */
+
+/* size of decoded credentials, as used by the RPC library */
+#ifndef RQCRED_SIZE
+#define RQCRED_SIZE 400
+#endif
+
+/* room for the credentials, verifier and decoded credentials of a call */
+#define TCP_CRED_AREA (2 * MAX_AUTH_BYTES + RQCRED_SIZE)
+
+#if HAVE_SVC_TLI_CREATE == 1
+typedef void *tcp_args_t;
+#else
+typedef caddr_t tcp_args_t;
+#endif
+
+struct tcp_conn;
+struct tcp_call;
+
+/* services reachable over the native transport */
+void tcp_register(unsigned long prog, unsigned long vers,
+		  void (*dispatch) (struct svc_req *, SVCXPRT *));
+
+struct tcp_conn *tcp_open(int fd);
+int tcp_input(struct tcp_conn *conn, struct tcp_call **calls);
+void tcp_close(struct tcp_conn *conn);
+
+void tcp_serve(SVCXPRT * xprt, XDR * xdrs, char *cred_area, uint32 * xid);
+
+SVCXPRT *tcp_detach(SVCXPRT * xprt);
+int tcp_xid(SVCXPRT * xprt, uint32 * xid);
+int tcp_splice(SVCXPRT * xprt, int fd, off64_t off, uint32 len);
+
+struct tcp_call *tcp_next(struct tcp_call *call);
+void tcp_run(struct tcp_call *call);
+void tcp_queue(struct tcp_call *calls);
+struct tcp_call *tcp_dequeue(void);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * UNFS3 native UDP transport
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "daemon.h"
+#include "event.h"
+#include "tcp.h"
+#include "udp.h"
+
+#ifdef WANT_EPOLL
+
+#if HAVE_RECVMMSG == 1 && HAVE_SENDMMSG == 1
+
+#ifdef HAVE_RPC_SVC_MT_H
+# include <rpc/svc_mt.h>
+#endif
+
+/*
+ * a thread that gets the read event of a UDP socket takes a batch of
+ * datagrams with one recvmmsg(), re-arms the socket for the next
+ * thread, runs the calls and sends all replies with one sendmmsg()
+ */
+
+/* most datagrams handled per system call */
+#define UDP_BATCH 16
+
+struct udp_call {
+    SVCXPRT xprt;			/* handed to the dispatcher */
+    uint32 xid;
+    XDR xdrs;				/* decodes the datagram */
+    struct sockaddr_storage peer;
+    char cred_area[TCP_CRED_AREA];
+#if HAVE_SVC_TLI_CREATE == 1
+    SVCXPRT_EXT ext;
+#endif
+    char *reply;
+    size_t reply_len;			/* 0 if there is no reply */
+    int detached;			/* outlives its batch */
+};
+
+/* buffers of the current thread */
+struct udp_batch {
+    struct mmsghdr in[UDP_BATCH];
+    struct mmsghdr out[UDP_BATCH];
+    struct iovec in_iov[UDP_BATCH];
+    struct iovec out_iov[UDP_BATCH];
+    struct udp_call calls[UDP_BATCH];
+    char *data;				/* UDP_BATCH packets */
+    char *replies;			/* UDP_BATCH packets */
+};
+
+static THREAD_LOCAL struct udp_batch *batch = NULL;
+
+static bool_t udp_recv(U(SVCXPRT * xprt), U(struct rpc_msg *msg))
+{
+    return FALSE;
+}
+
+static enum xprt_stat udp_stat(U(SVCXPRT * xprt))
+{
+    return XPRT_IDLE;
+}
+
+static bool_t udp_getargs(SVCXPRT * xprt, xdrproc_t xargs, tcp_args_t args)
+{
+    struct udp_call *call = xprt->xp_p1;
+
+    return (*xargs) (&call->xdrs, args);
+}
+
+/*
+ * encode and send the reply of a detached call
+ */
+static bool_t udp_send(struct udp_call *call, struct rpc_msg *msg)
+{
+    XDR xdrs;
+    char *buf;
+    u_int size;
+
+    size = xdr_sizeof((xdrproc_t) xdr_replymsg, msg);
+    buf = malloc(size);
+    if (!buf)
+	return FALSE;
+
+    xdrmem_create(&xdrs, buf, size, XDR_ENCODE);
+    if (!xdr_replymsg(&xdrs, msg)) {
+	free(buf);
+	return FALSE;
+    }
+
+    /* a reply that cannot be sent is dropped, the client retries */
+    sendto(call->xprt.xp_sock, buf, XDR_GETPOS(&xdrs), MSG_NOSIGNAL,
+	   (struct sockaddr *) &call->peer, call->xprt.xp_addrlen);
+    free(buf);
+
+    return TRUE;
+}
+
+/*
+ * encode reply, it is sent with the rest of the batch
+ */
+static bool_t udp_reply(SVCXPRT * xprt, struct rpc_msg *msg)
+{
+    struct udp_call *call = xprt->xp_p1;
+    XDR xdrs;
+
+    msg->rm_xid = call->xid;
+    if (call->detached)
+	return udp_send(call, msg);
+
+    xdrmem_create(&xdrs, call->reply, NFS_MAX_UDP_PACKET, XDR_ENCODE);
+    if (!xdr_replymsg(&xdrs, msg))
+	return FALSE;
+
+    call->reply_len = XDR_GETPOS(&xdrs);
+    return TRUE;
+}
+
+static bool_t udp_freeargs(U(SVCXPRT * xprt), xdrproc_t xargs,
+			   tcp_args_t args)
+{
+    XDR xdrs;
+
+    xdrs.x_op = XDR_FREE;
+    return (*xargs) (&xdrs, args);
+}
+
+/*
+ * release a detached call
+ */
+static void udp_destroy(SVCXPRT * xprt)
+{
+    struct udp_call *call = xprt->xp_p1;
+
+    if (call->detached)
+	free(call);
+}
+
+static const struct xp_ops udp_ops = {
+    udp_recv,
+    udp_stat,
+    udp_getargs,
+    udp_reply,
+    udp_freeargs,
+    udp_destroy
+};
+
+#if HAVE_SVC_TLI_CREATE == 1
+static bool_t udp_control(U(SVCXPRT * xprt), U(const u_int rq),
+			  U(void *in))
+{
+    return FALSE;
+}
+
+static const struct xp_ops2 udp_ops2 = {
+    udp_control
+};
+#endif
+
+/*
+ * set up the buffers of the current thread
+ */
+static int udp_batch_init(void)
+{
+    struct udp_batch *b;
+    struct udp_call *call;
+    int i;
+
+    b = malloc(sizeof(struct udp_batch));
+    if (!b)
+	return -1;
+
+    memset(b, 0, sizeof(struct udp_batch));
+    b->data = malloc(UDP_BATCH * NFS_MAX_UDP_PACKET);
+    b->replies = malloc(UDP_BATCH * NFS_MAX_UDP_PACKET);
+    if (!b->data || !b->replies) {
+	free(b->data);
+	free(b->replies);
+	free(b);
+	return -1;
+    }
+
+    for (i = 0; i < UDP_BATCH; i++) {
+	call = &b->calls[i];
+	call->reply = b->replies + i * NFS_MAX_UDP_PACKET;
+	call->xprt.xp_ops = &udp_ops;
+	call->xprt.xp_p1 = call;
+#if HAVE_SVC_TLI_CREATE == 1
+	call->xprt.xp_ops2 = &udp_ops2;
+	call->xprt.xp_rtaddr.buf = &call->peer;
+	call->xprt.xp_rtaddr.maxlen = sizeof(call->peer);
+	call->xprt.xp_p3 = &call->ext;
+#endif
+
+	b->in_iov[i].iov_base = b->data + i * NFS_MAX_UDP_PACKET;
+	b->in_iov[i].iov_len = NFS_MAX_UDP_PACKET;
+	b->in[i].msg_hdr.msg_iov = &b->in_iov[i];
+	b->in[i].msg_hdr.msg_iovlen = 1;
+	b->in[i].msg_hdr.msg_name = &call->peer;
+
+	b->out[i].msg_hdr.msg_iov = &b->out_iov[i];
+	b->out[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    batch = b;
+    return 0;
+}
+
+/*
+ * send the replies of a batch
+ */
+static void udp_flush(int fd, int count)
+{
+    struct udp_call *call;
+    int i, n = 0, sent;
+
+    for (i = 0; i < count; i++) {
+	call = &batch->calls[i];
+	if (call->reply_len == 0)
+	    continue;
+
+	batch->out_iov[n].iov_base = call->reply;
+	batch->out_iov[n].iov_len = call->reply_len;
+	batch->out[n].msg_hdr.msg_name = &call->peer;
+	batch->out[n].msg_hdr.msg_namelen = batch->in[i].msg_hdr.msg_namelen;
+	n++;
+    }
+
+    /* a reply that cannot be sent is dropped, the client retries */
+    for (i = 0; i < n; i += sent) {
+	sent = sendmmsg(fd, &batch->out[i], n - i, MSG_NOSIGNAL);
+	if (sent == -1 && errno == EINTR)
+	    sent = 0;
+	else if (sent <= 0)
+	    sent = 1;
+    }
+}
+
+/*
+ * receive and serve a batch of datagrams
+ */
+void udp_input(int fd)
+{
+    struct udp_call *call;
+    int i, n;
+
+    if (!batch && udp_batch_init() == -1) {
+	logmsg(LOG_CRIT, "udp_input: Unable to allocate memory");
+	event_rearm(fd);
+	return;
+    }
+
+    for (i = 0; i < UDP_BATCH; i++)
+	batch->in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+
+    do
+	n = recvmmsg(fd, batch->in, UDP_BATCH, MSG_DONTWAIT, NULL);
+    while (n == -1 && errno == EINTR);
+
+    /* other threads may take the next batch while this one runs */
+    event_rearm(fd);
+
+    for (i = 0; i < n; i++) {
+	call = &batch->calls[i];
+	call->reply_len = 0;
+
+	if (batch->in[i].msg_hdr.msg_flags & MSG_TRUNC)
+	    continue;
+
+	call->xprt.xp_sock = fd;
+	call->xprt.xp_addrlen = batch->in[i].msg_hdr.msg_namelen;
+	memcpy(&call->xprt.xp_raddr, &call->peer,
+	       sizeof(call->xprt.xp_raddr));
+#if HAVE_SVC_TLI_CREATE == 1
+	call->xprt.xp_rtaddr.len = batch->in[i].msg_hdr.msg_namelen;
+#endif
+
+	xdrmem_create(&call->xdrs, batch->in_iov[i].iov_base,
+		      batch->in[i].msg_len, XDR_DECODE);
+	tcp_serve(&call->xprt, &call->xdrs, call->cred_area, &call->xid);
+    }
+
+    if (n > 0)
+	udp_flush(fd, n);
+}
+
+/*
+ * move a call out of its batch, so that it can be answered after the
+ * batch is done; svc_destroy() releases it after the reply
+ * returns NULL for calls of other transports
+ */
+SVCXPRT *udp_detach(SVCXPRT * xprt)
+{
+    struct udp_call *call;
+
+    if (xprt->xp_ops != &udp_ops)
+	return NULL;
+
+    call = malloc(sizeof(struct udp_call));
+    if (!call)
+	return NULL;
+
+    memcpy(call, xprt->xp_p1, sizeof(struct udp_call));
+    call->xprt.xp_p1 = call;
+#if HAVE_SVC_TLI_CREATE == 1
+    call->xprt.xp_rtaddr.buf = &call->peer;
+    call->xprt.xp_p3 = &call->ext;
+#endif
+    call->reply = NULL;
+    call->detached = TRUE;
+
+    return &call->xprt;
+}
+
+/*
+ * return the xid of a call, FALSE for calls of other transports
+ */
+int udp_xid(SVCXPRT * xprt, uint32 * xid)
+{
+    struct udp_call *call;
+
+    if (xprt->xp_ops != &udp_ops)
+	return FALSE;
+
+    call = xprt->xp_p1;
+    *xid = call->xid;
+    return TRUE;
+}
+
+#else				       /* HAVE_RECVMMSG */
+
+void udp_input(int fd)
+{
+    svc_getreq_common(fd);
+    event_rearm(fd);
+}
+
+SVCXPRT *udp_detach(U(SVCXPRT * xprt))
+{
+    return NULL;
+}
+
+int udp_xid(U(SVCXPRT * xprt), U(uint32 * xid))
+{
+    return FALSE;
+}
+
+#endif				       /* HAVE_RECVMMSG */
+
+#endif				       /* WANT_EPOLL */
@@ -0,0 +1,16 @@
+/*
+ * UNFS3 native UDP transport
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_UDP_H
+#define UNFS3_UDP_H
+
+/* receive and serve datagrams, re-arms the socket */
+void udp_input(int fd);
+
+SVCXPRT *udp_detach(SVCXPRT * xprt);
+int udp_xid(SVCXPRT * xprt, uint32 * xid);
+
+#endif
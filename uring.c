@@ -0,0 +1,280 @@
+/*
+ * UNFS3 io_uring engine
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "backend.h"
+#include "uring.h"
+
+#if defined(WANT_IO_URING) && HAVE_LINUX_IO_URING_H == 1 && \
+    HAVE_STATX == 1 && HAVE_SYS_SYSCALL_H == 1 && !defined(AFS_SUPPORT)
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/sysmacros.h>
+# include <fcntl.h>
+# include <linux/io_uring.h>
+# ifdef __NR_io_uring_setup
+#  define URING 1
+# endif
+#endif
+
+#ifdef URING
+
+/*
+ * request handlers wait for each result before they can go on, so a
+ * ring only pays off where one request needs many independent calls;
+ * every thread has a ring of its own and submits such calls in one go
+ */
+
+/* submission queue size */
+#define URING_ENTRIES 64
+
+struct uring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    struct statx stx[URING_ENTRIES];
+    int res[URING_ENTRIES];
+};
+
+static THREAD_LOCAL struct uring *ring = NULL;
+static THREAD_LOCAL int ring_failed = FALSE;
+
+/*
+ * set up the ring of the current thread
+ */
+static int uring_init(void)
+{
+    struct io_uring_params p;
+    struct uring *r;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+    void *sqes;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd == -1)
+	return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+	sq_len = cq_len;
+
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+	close(fd);
+	return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	cq = sq;
+    else {
+	cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED) {
+	    munmap(sq, sq_len);
+	    close(fd);
+	    return -1;
+	}
+    }
+
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		IORING_OFF_SQES);
+    r = malloc(sizeof(struct uring));
+    if (sqes == MAP_FAILED || !r) {
+	if (sqes != MAP_FAILED)
+	    munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+	if (cq != sq)
+	    munmap(cq, cq_len);
+	munmap(sq, sq_len);
+	free(r);
+	close(fd);
+	return -1;
+    }
+
+    r->fd = fd;
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    r->sqes = sqes;
+
+    ring = r;
+    return 0;
+}
+
+/*
+ * collect completions, returns how many arrived
+ */
+static int uring_reap(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    int n = 0;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	ring->res[cqe->user_data] = cqe->res;
+	head++;
+	n++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/*
+ * run up to URING_ENTRIES statx calls, failed ones are left to lstat()
+ */
+static void uring_statx(char *const *paths, int count)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+    int i, n, submitted = 0, done = 0;
+
+    tail = *ring->sq_tail;
+    for (i = 0; i < count; i++) {
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long) paths[i];
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (unsigned long) &ring->stx[i];
+	sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+	sqe->user_data = i;
+	ring->sq_array[idx] = idx;
+	ring->res[i] = -EINPROGRESS;
+	tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (done < count) {
+	n = syscall(__NR_io_uring_enter, ring->fd, count - submitted,
+		    submitted < count ? 1 : count - done,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+	if (n >= 0)
+	    submitted += n;
+	else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+	    /* take back what the kernel has not seen, wait for the rest */
+	    __atomic_store_n(ring->sq_tail, tail - (count - submitted),
+			     __ATOMIC_RELEASE);
+	    count = submitted;
+	    ring_failed = TRUE;
+	}
+	done += uring_reap();
+    }
+}
+
+/*
+ * convert statx results
+ */
+static void uring_stat(const struct statx *stx, struct stat *buf)
+{
+    memset(buf, 0, sizeof(struct stat));
+    buf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    buf->st_ino = stx->stx_ino;
+    buf->st_mode = stx->stx_mode;
+    buf->st_nlink = stx->stx_nlink;
+    buf->st_uid = stx->stx_uid;
+    buf->st_gid = stx->stx_gid;
+    buf->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    buf->st_size = stx->stx_size;
+    buf->st_blksize = stx->stx_blksize;
+    buf->st_blocks = stx->stx_blocks;
+    buf->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    buf->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    buf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    buf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    buf->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    buf->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/*
+ * lstat without io_uring
+ */
+static void lstat_each(char *const *paths, backend_statstruct * bufs,
+		       int *errs, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+	errs[i] = backend_lstat(paths[i], &bufs[i]) == -1 ? errno : 0;
+}
+
+void lstat_many(char *const *paths, backend_statstruct * bufs, int *errs,
+		int count)
+{
+    int i, n, start;
+
+    if (!ring && !ring_failed && uring_init() == -1)
+	ring_failed = TRUE;
+
+    for (start = 0; start < count; start += n) {
+	n = count - start;
+	if (n > URING_ENTRIES)
+	    n = URING_ENTRIES;
+
+	if (ring_failed || n == 1) {
+	    lstat_each(&paths[start], &bufs[start], &errs[start], n);
+	    continue;
+	}
+
+	uring_statx(&paths[start], n);
+
+	/* errors are repeated with lstat(), which also covers old kernels */
+	for (i = 0; i < n; i++) {
+	    if (ring->res[i] == 0) {
+		uring_stat(&ring->stx[i], &bufs[start + i]);
+		errs[start + i] = 0;
+	    } else
+		lstat_each(&paths[start + i], &bufs[start + i],
+			   &errs[start + i], 1);
+	}
+    }
+}
+
+#else				       /* URING */
+
+void lstat_many(char *const *paths, backend_statstruct * bufs, int *errs,
+		int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+	errs[i] = backend_lstat(paths[i], &bufs[i]) == -1 ? errno : 0;
+}
+
+#endif				       /* URING */
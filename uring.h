@@ -0,0 +1,14 @@
+/*
+ * UNFS3 io_uring engine
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_URING_H
+#define UNFS3_URING_H
+
+/* lstat several paths at once, errs receives 0 or errno for each one */
+void lstat_many(char *const *paths, backend_statstruct * bufs, int *errs,
+		int count);
+
+#endif
@@ -13,16 +13,21 @@
 #include <syslog.h>
 #include <unistd.h>
 #endif				       /* WIN32 */
+#if HAVE_SYS_SYSCALL_H == 1
+#include <sys/syscall.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <rpc/rpc.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "nfs.h"
 #include "mount.h"
 #include "daemon.h"
 #include "user.h"
 #include "backend.h"
+#include "context.h"
 #include "Config/exports.h"
 
 /* user and group id we squash to */
@@ -32,6 +37,21 @@ static gid_t squash_gid = 65534;
 /* whether we can use seteuid/setegid */
 static int can_switch = TRUE;
 
+/* most auxiliary groups passed on */
+#define MAX_GROUPS 32
+
+/*
+ * ids the calling thread runs with, (uid_t) -1 and -1 if unknown
+ *
+ * requests of the same user in a row then only switch the user and
+ * group id to root and back; auxiliary groups are left alone while
+ * running as root
+ */
+static THREAD_LOCAL uid_t cred_uid = (uid_t) -1;
+static THREAD_LOCAL gid_t cred_gid = (gid_t) -1;
+static THREAD_LOCAL int cred_ngroups = -1;
+static THREAD_LOCAL gid_t cred_groups[MAX_GROUPS];
+
 /*
  * initialize group and user id used for squashing
  */
@@ -39,6 +59,19 @@ void get_squash_ids(void)
 {
     backend_passwdstruct *passwd;
 
+    if (can_switch && (opt_singleuser || backend_getuid() != 0)) {
+	/* 
+	 * have uid/gid functions behave correctly by squashing
+	 * all user and group ids to the current values
+	 *
+	 * otherwise ACCESS would malfunction
+	 */
+	squash_uid = backend_getuid();
+	squash_gid = backend_getgid();
+
+	can_switch = FALSE;
+    }
+
     if (can_switch) {
 	passwd = backend_getpwnam("nobody");
 	if (passwd) {
@@ -54,11 +87,11 @@ void get_squash_ids(void)
 /*
  * mangle an id
  */
-static int mangle(int id, int squash)
+static int mangle(int id, int squash, unfs3_ctx_t * ctx)
 {
-    if (!can_switch || (exports_opts & OPT_ALL_SQUASH))
+    if (!can_switch || (ctx->opts & OPT_ALL_SQUASH))
 	return squash;
-    else if (exports_opts & OPT_NO_ROOT_SQUASH)
+    else if (ctx->opts & OPT_NO_ROOT_SQUASH)
 	return id;
     else if (id == 0)
 	return squash;
@@ -69,42 +102,43 @@ static int mangle(int id, int squash)
 /*
  * Mangle a given user id according to current settings
  */
-int mangle_uid(int id)
+int mangle_uid(int id, unfs3_ctx_t * ctx)
 {
     int squash = squash_uid;
 
-    if (exports_anonuid() != ANON_NOTSPECIAL)
-	squash = exports_anonuid();
+    if (exports_anonuid(ctx) != ANON_NOTSPECIAL)
+	squash = exports_anonuid(ctx);
 
-    return mangle(id, squash);
+    return mangle(id, squash, ctx);
 }
 
 /*
  * Mangle a given group id according to current settings
  */
-int mangle_gid(int id)
+int mangle_gid(int id, unfs3_ctx_t * ctx)
 {
     int squash = squash_gid;
 
-    if (exports_anongid() != ANON_NOTSPECIAL)
-	squash = exports_anongid();
+    if (exports_anongid(ctx) != ANON_NOTSPECIAL)
+	squash = exports_anongid(ctx);
 
-    return mangle(id, squash);
+    return mangle(id, squash, ctx);
 }
 
 /*
  * return user id of a request
  */
-int get_uid(struct svc_req *req)
+int get_uid(unfs3_ctx_t * ctx)
 {
+    struct svc_req *req = ctx->rqstp;
     struct authunix_parms *auth = (struct authunix_parms *) req->rq_clntcred;
     int squash = squash_uid;
 
-    if (exports_anonuid() != ANON_NOTSPECIAL)
-	squash = exports_anonuid();
+    if (exports_anonuid(ctx) != ANON_NOTSPECIAL)
+	squash = exports_anonuid(ctx);
 
     if (req->rq_cred.oa_flavor == AUTH_UNIX)
-	return mangle(auth->aup_uid, squash);
+	return mangle(auth->aup_uid, squash, ctx);
     else
 	return squash;		       /* fallback if no uid given */
 }
@@ -112,16 +146,17 @@ int get_uid(struct svc_req *req)
 /*
  * return group id of a request
  */
-static int get_gid(struct svc_req *req)
+static int get_gid(unfs3_ctx_t * ctx)
 {
+    struct svc_req *req = ctx->rqstp;
     struct authunix_parms *auth = (struct authunix_parms *) req->rq_clntcred;
     int squash = squash_gid;
 
-    if (exports_anongid() != ANON_NOTSPECIAL)
-	squash = exports_anongid();
+    if (exports_anongid(ctx) != ANON_NOTSPECIAL)
+	squash = exports_anongid(ctx);
 
     if (req->rq_cred.oa_flavor == AUTH_UNIX)
-	return mangle(auth->aup_gid, squash);
+	return mangle(auth->aup_gid, squash, ctx);
     else
 	return squash;		       /* fallback if no gid given */
 }
@@ -129,32 +164,91 @@ static int get_gid(struct svc_req *req)
 /*
  * check whether a request comes from a given user id
  */
-int is_owner(int owner, struct svc_req *req)
+int is_owner(int owner, unfs3_ctx_t * ctx)
 {
-    return (int) (owner == get_uid(req));
+    return (int) (owner == get_uid(ctx));
 }
 
 /*
  * check if a request comes from somebody who has a given group id
  */
-int has_group(int group, struct svc_req *req)
+int has_group(int group, unfs3_ctx_t * ctx)
 {
+    struct svc_req *req = ctx->rqstp;
     struct authunix_parms *auth = (struct authunix_parms *) req->rq_clntcred;
     unsigned int i;
 
     if (req->rq_cred.oa_flavor == AUTH_UNIX) {
-	if (mangle(auth->aup_gid, squash_gid) == group)
+	if (mangle(auth->aup_gid, squash_gid, ctx) == group)
 	    return TRUE;
 
 	/* search groups */
 	for (i = 0; i < auth->aup_len; i++)
-	    if (mangle(auth->aup_gids[i], squash_gid) == group)
+	    if (mangle(auth->aup_gids[i], squash_gid, ctx) == group)
 		return TRUE;
     }
 
     return FALSE;
 }
 
+/*
+ * set the user id of the calling thread, unless it already has it
+ */
+static int set_uid(uid_t uid)
+{
+    if (uid == cred_uid)
+	return 0;
+
+    if (backend_seteuid(uid) == -1) {
+	cred_uid = (uid_t) -1;
+	return -1;
+    }
+
+    cred_uid = uid;
+    return 0;
+}
+
+/*
+ * set the group id of the calling thread, unless it already has it
+ */
+static int set_gid(gid_t gid)
+{
+    if (gid == cred_gid)
+	return 0;
+
+    /* only root can change the effective group id */
+    set_uid(0);
+
+    if (backend_setegid(gid) == -1) {
+	cred_gid = (gid_t) -1;
+	return -1;
+    }
+
+    cred_gid = gid;
+    return 0;
+}
+
+/*
+ * set the auxiliary groups of the calling thread, unless it has them
+ */
+static int set_groups(int ngroups, gid_t * groups)
+{
+    if (ngroups == cred_ngroups &&
+	memcmp(groups, cred_groups, ngroups * sizeof(gid_t)) == 0)
+	return 0;
+
+    set_uid(0);
+
+    if (backend_setgroups(ngroups, groups) == -1) {
+	cred_ngroups = -1;
+	return -1;
+    }
+
+    memcpy(cred_groups, groups, ngroups * sizeof(gid_t));
+    cred_ngroups = ngroups;
+    return 0;
+}
+
 /*
  * switch to root
  */
@@ -163,58 +257,68 @@ void switch_to_root(void)
     if (!can_switch)
 	return;
 
-    backend_setegid(0);
-    backend_seteuid(0);
+    set_uid(0);
+    set_gid(0);
 }
 
 /*
  * switch auxiliary group ids
  */
-static int switch_groups(struct svc_req *req)
+static int switch_groups(unfs3_ctx_t * ctx)
 {
-    struct authunix_parms *auth = (struct authunix_parms *) req->rq_clntcred;
+    struct authunix_parms *auth =
+	(struct authunix_parms *) ctx->rqstp->rq_clntcred;
     unsigned int i, max;
 
-    max = (auth->aup_len <= 32) ? auth->aup_len : 32;
+    max = (auth->aup_len <= MAX_GROUPS) ? auth->aup_len : MAX_GROUPS;
 
     for (i = 0; i < max; ++i) {
-	auth->aup_gids[i] = mangle(auth->aup_gids[i], squash_gid);
+	auth->aup_gids[i] = mangle(auth->aup_gids[i], squash_gid, ctx);
     }
 
-    return backend_setgroups(max, auth->aup_gids);
+    return set_groups(max, auth->aup_gids);
 }
 
 /*
  * switch user and group id to values listed in request
  */
-void switch_user(struct svc_req *req)
+void switch_user(unfs3_ctx_t * ctx)
 {
     int uid, gid, aid;
 
     if (!can_switch)
 	return;
 
-    if (opt_singleuser || (backend_getuid() != 0)) {
-	/* 
-	 * have uid/gid functions behave correctly by squashing
-	 * all user and group ids to the current values
-	 *
-	 * otherwise ACCESS would malfunction
-	 */
-	squash_uid = backend_getuid();
-	squash_gid = backend_getgid();
+    gid = set_gid(get_gid(ctx));
+    aid = switch_groups(ctx);
+    uid = set_uid(get_uid(ctx));
 
-	can_switch = FALSE;
-	return;
+    if (uid == -1 || gid == -1 || aid == -1) {
+	logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
+	daemon_exit(CRISIS);
     }
+}
+
+/*
+ * switch to root, returning the ids to go back to
+ */
+void switch_save(uid_t * uid, gid_t * gid)
+{
+    *uid = (cred_uid != (uid_t) -1) ? cred_uid : backend_geteuid();
+    *gid = (cred_gid != (gid_t) -1) ? cred_gid : backend_getegid();
 
-    backend_setegid(0);
-    backend_seteuid(0);
-    gid = backend_setegid(get_gid(req));
-    aid = switch_groups(req);
-    uid = backend_seteuid(get_uid(req));
+    switch_to_root();
+}
 
-    if (uid == -1 || gid == -1 || aid == -1) {
+/*
+ * go back to the ids returned by switch_save
+ */
+void switch_restore(uid_t uid, gid_t gid)
+{
+    if (!can_switch)
+	return;
+
+    if (set_gid(gid) == -1 || set_uid(uid) == -1) {
 	logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
 	daemon_exit(CRISIS);
     }
@@ -223,14 +327,14 @@ void switch_user(struct svc_req *req)
 /*
  * re-switch to root for reading executable files
  */
-void read_executable(struct svc_req *req, backend_statstruct buf)
+void read_executable(unfs3_ctx_t * ctx, backend_statstruct buf)
 {
     int have_exec = 0;
 
-    if (is_owner(buf.st_uid, req)) {
+    if (is_owner(buf.st_uid, ctx)) {
 	if (!(buf.st_mode & S_IRUSR) && (buf.st_mode & S_IXUSR))
 	    have_exec = 1;
-    } else if (has_group(buf.st_gid, req)) {
+    } else if (has_group(buf.st_gid, ctx)) {
 	if (!(buf.st_mode & S_IRGRP) && (buf.st_mode & S_IXGRP))
 	    have_exec = 1;
     } else {
@@ -238,56 +342,90 @@ void read_executable(struct svc_req *req, backend_statstruct buf)
 	    have_exec = 1;
     }
 
-    if (have_exec) {
-	backend_setegid(0);
-	backend_seteuid(0);
-    }
+    if (have_exec)
+	switch_to_root();
 }
 
 /*
  * re-switch to root for reading owned file
  */
-void read_by_owner(struct svc_req *req, backend_statstruct buf)
+void read_by_owner(unfs3_ctx_t * ctx, backend_statstruct buf)
 {
     int have_owner = 0;
     int have_read = 0;
 
-    have_owner = is_owner(buf.st_uid, req);
+    have_owner = is_owner(buf.st_uid, ctx);
 
     if (have_owner && (buf.st_mode & S_IRUSR)) {
 	have_read = 1;
-    } else if (has_group(buf.st_gid, req) && (buf.st_mode & S_IRGRP)) {
+    } else if (has_group(buf.st_gid, ctx) && (buf.st_mode & S_IRGRP)) {
 	have_read = 1;
     } else if (buf.st_mode & S_IROTH) {
 	have_read = 1;
     }
 
-    if (have_owner && !have_read) {
-	backend_setegid(0);
-	backend_seteuid(0);
-    }
+    if (have_owner && !have_read)
+	switch_to_root();
 }
 
 /*
  * re-switch to root for writing owned file
  */
-void write_by_owner(struct svc_req *req, backend_statstruct buf)
+void write_by_owner(unfs3_ctx_t * ctx, backend_statstruct buf)
 {
     int have_owner = 0;
     int have_write = 0;
 
-    have_owner = is_owner(buf.st_uid, req);
+    have_owner = is_owner(buf.st_uid, ctx);
 
     if (have_owner && (buf.st_mode & S_IWUSR)) {
 	have_write = 1;
-    } else if (has_group(buf.st_gid, req) && (buf.st_mode & S_IWGRP)) {
+    } else if (has_group(buf.st_gid, ctx) && (buf.st_mode & S_IWGRP)) {
 	have_write = 1;
     } else if (buf.st_mode & S_IWOTH) {
 	have_write = 1;
     }
 
-    if (have_owner && !have_write) {
-	backend_setegid(0);
-	backend_seteuid(0);
-    }
+    if (have_owner && !have_write)
+	switch_to_root();
 }
+
+#ifdef THREAD_CREDENTIALS
+
+/*
+ * change credentials of the calling thread only
+ * the raw system calls do not go through the libc broadcast to other
+ * threads, the 32 bit variants are used where they exist
+ *
+ * switching the effective user id away from root also clears the
+ * effective capabilities, so quotas and reserved blocks apply to
+ * client requests; they come back when the thread switches to root
+ */
+int thread_setegid(gid_t egid)
+{
+#ifdef SYS_setresgid32
+    return syscall(SYS_setresgid32, -1, egid, -1);
+#else
+    return syscall(SYS_setresgid, -1, egid, -1);
+#endif
+}
+
+int thread_seteuid(uid_t euid)
+{
+#ifdef SYS_setresuid32
+    return syscall(SYS_setresuid32, -1, euid, -1);
+#else
+    return syscall(SYS_setresuid, -1, euid, -1);
+#endif
+}
+
+int thread_setgroups(size_t size, const gid_t * list)
+{
+#ifdef SYS_setgroups32
+    return syscall(SYS_setgroups32, size, list);
+#else
+    return syscall(SYS_setgroups, size, list);
+#endif
+}
+
+#endif				       /* THREAD_CREDENTIALS */
@@ -9,21 +9,23 @@
 
 #include "backend.h"
 
-int get_uid(struct svc_req *req);
+int get_uid(unfs3_ctx_t *ctx);
 
-int mangle_uid(int id);
-int mangle_gid(int id);
+int mangle_uid(int id, unfs3_ctx_t *ctx);
+int mangle_gid(int id, unfs3_ctx_t *ctx);
 
-int is_owner(int owner, struct svc_req *req);
-int has_group(int group, struct svc_req *req);
+int is_owner(int owner, unfs3_ctx_t *ctx);
+int has_group(int group, unfs3_ctx_t *ctx);
 
 void get_squash_ids(void);
 
 void switch_to_root(void);
-void switch_user(struct svc_req *req);
+void switch_user(unfs3_ctx_t *ctx);
+void switch_save(uid_t *uid, gid_t *gid);
+void switch_restore(uid_t uid, gid_t gid);
 
-void read_executable(struct svc_req *req, backend_statstruct buf);
-void read_by_owner(struct svc_req *req, backend_statstruct buf);
-void write_by_owner(struct svc_req *req, backend_statstruct buf);
+void read_executable(unfs3_ctx_t *ctx, backend_statstruct buf);
+void read_by_owner(unfs3_ctx_t *ctx, backend_statstruct buf);
+void write_by_owner(unfs3_ctx_t *ctx, backend_statstruct buf);
 
 #endif
@@ -0,0 +1,334 @@
+/*
+ * UNFS3 worker threads
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <syslog.h>
+#endif				       /* WIN32 */
+
+#ifdef HAVE_SVC_GETREQ_POLL
+# include <sys/poll.h>
+#endif
+
+#include "nfs.h"
+#include "daemon.h"
+#include "worker.h"
+#include "event.h"
+
+#ifdef WANT_WORKERS
+
+/*
+ * the main thread polls all RPC sockets, marks ready ones busy and
+ * queues them for the workers; a worker runs the complete request
+ * (receive, dispatch, reply) and hands the socket back through the
+ * wake pipe
+ *
+ * listening sockets stay with the main thread, since accepting a
+ * connection registers a new transport with the RPC library
+ *
+ * with the epoll event loop, workers wait for sockets themselves and
+ * the main thread only runs signals and timers
+ */
+
+static int fd_max = 0;			/* size of per-fd tables */
+static char *fd_busy = NULL;		/* fd owned by a worker */
+static char *fd_inline = NULL;		/* fd serviced by main thread */
+
+/* ring of fds ready for workers, each fd is queued at most once */
+static int *queue = NULL;
+static int queue_head = 0;
+static int queue_len = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static int wake_pipe[2] = { -1, -1 };
+
+static struct pollfd *poll_set = NULL;
+static int poll_max = 0;
+
+static int workers = 0;
+
+/* requests in progress and whether new ones must wait */
+static int requests_active = 0;
+static int requests_blocked = FALSE;
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * worker thread main loop
+ */
+static void *worker_main(void *arg)
+{
+    sigset_t set;
+    int fd, res;
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (event_enabled())
+	event_loop((int) (long) arg);
+
+    for (;;) {
+	pthread_mutex_lock(&queue_lock);
+	while (queue_len == 0)
+	    pthread_cond_wait(&queue_cond, &queue_lock);
+	fd = queue[queue_head];
+	queue_head = (queue_head + 1) % fd_max;
+	queue_len--;
+	pthread_mutex_unlock(&queue_lock);
+
+	svc_getreq_common(fd);
+
+	/* give socket back to the main thread */
+	do {
+	    res = write(wake_pipe[1], &fd, sizeof(fd));
+	} while (res == -1 && errno == EINTR);
+    }
+
+    return NULL;
+}
+
+/*
+ * set up the queue that the main thread fills
+ */
+static int worker_queue_init(void)
+{
+    int i, on;
+    socklen_t len;
+
+    fd_max = sysconf(_SC_OPEN_MAX);
+    if (fd_max <= 0)
+	fd_max = FD_SETSIZE;
+
+    fd_busy = calloc(fd_max, 1);
+    fd_inline = calloc(fd_max, 1);
+    queue = malloc(fd_max * sizeof(int));
+    if (!fd_busy || !fd_inline || !queue) {
+	logmsg(LOG_CRIT, "worker_start: Unable to allocate memory");
+	return -1;
+    }
+
+    if (pipe(wake_pipe) == -1) {
+	logmsg(LOG_CRIT, "worker_start: Unable to create pipe");
+	return -1;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+
+    /* keep listening sockets in the main thread */
+    for (i = 0; i < svc_max_pollfd; i++) {
+	if (svc_pollfd[i].fd < 0 || svc_pollfd[i].fd >= fd_max)
+	    continue;
+	len = sizeof(on);
+	if (getsockopt(svc_pollfd[i].fd, SOL_SOCKET, SO_ACCEPTCONN,
+		       &on, &len) == 0 && on)
+	    fd_inline[svc_pollfd[i].fd] = TRUE;
+    }
+
+    return 0;
+}
+
+/*
+ * start worker threads
+ * must be called after all transports have been created
+ */
+int worker_start(int threads)
+{
+    pthread_t thread;
+    int i;
+
+    if (!event_enabled() && worker_queue_init() == -1)
+	return -1;
+
+    for (i = 0; i < threads; i++) {
+	if (pthread_create(&thread, NULL, worker_main, (void *) (long) i) !=
+	    0) {
+	    logmsg(LOG_CRIT, "worker_start: Unable to create thread");
+	    if (workers == 0)
+		return -1;
+	    break;
+	}
+	pthread_detach(thread);
+	workers++;
+    }
+
+    return workers;
+}
+
+/*
+ * wait for RPC sockets and hand ready ones to the workers
+ * returns like poll()
+ */
+int worker_poll(int timeout)
+{
+    struct pollfd *new;
+    int done[64];
+    int i, n, r, fd, len, queued = 0;
+
+    if (poll_max < svc_max_pollfd + 1) {
+	new = realloc(poll_set, (svc_max_pollfd + 1) * sizeof(struct pollfd));
+	if (!new) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	poll_set = new;
+	poll_max = svc_max_pollfd + 1;
+    }
+
+    poll_set[0].fd = wake_pipe[0];
+    poll_set[0].events = POLLIN;
+    poll_set[0].revents = 0;
+    n = 1;
+
+    for (i = 0; i < svc_max_pollfd; i++) {
+	fd = svc_pollfd[i].fd;
+	if (fd < 0 || (fd < fd_max && fd_busy[fd]))
+	    continue;
+	poll_set[n].fd = fd;
+	poll_set[n].events = svc_pollfd[i].events;
+	poll_set[n].revents = 0;
+	n++;
+    }
+
+    r = poll(poll_set, n, timeout);
+    if (r <= 0)
+	return r;
+
+    /* sockets given back by workers */
+    if (poll_set[0].revents) {
+	while ((len = read(wake_pipe[0], done, sizeof(done))) > 0)
+	    for (i = 0; i < len / (int) sizeof(int); i++)
+		fd_busy[done[i]] = FALSE;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    for (i = 1; i < n; i++) {
+	fd = poll_set[i].fd;
+	if (!poll_set[i].revents || fd >= fd_max || fd_inline[fd] ||
+	    (poll_set[i].revents & POLLNVAL))
+	    continue;
+
+	fd_busy[fd] = TRUE;
+	queue[(queue_head + queue_len) % fd_max] = fd;
+	queue_len++;
+	queued++;
+	poll_set[i].revents = 0;
+    }
+    if (queued > 1)
+	pthread_cond_broadcast(&queue_cond);
+    else if (queued)
+	pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    /* whatever is left is serviced here */
+    for (i = 1; i < n; i++)
+	if (poll_set[i].revents)
+	    svc_getreq_poll(&poll_set[i], 1);
+
+    return r;
+}
+
+/*
+ * mark start of request processing
+ */
+void request_begin(void)
+{
+    if (!workers)
+	return;
+
+    pthread_mutex_lock(&request_lock);
+    while (requests_blocked)
+	pthread_cond_wait(&request_cond, &request_lock);
+    requests_active++;
+    pthread_mutex_unlock(&request_lock);
+}
+
+/*
+ * mark end of request processing
+ */
+void request_end(void)
+{
+    if (!workers)
+	return;
+
+    pthread_mutex_lock(&request_lock);
+    requests_active--;
+    if (requests_active == 0 && requests_blocked)
+	pthread_cond_broadcast(&request_cond);
+    pthread_mutex_unlock(&request_lock);
+}
+
+/*
+ * wait for running requests to finish and hold off new ones
+ * used around reloading the exports list
+ */
+void requests_block(void)
+{
+    if (!workers)
+	return;
+
+    pthread_mutex_lock(&request_lock);
+    requests_blocked = TRUE;
+    while (requests_active > 0)
+	pthread_cond_wait(&request_cond, &request_lock);
+    pthread_mutex_unlock(&request_lock);
+}
+
+/*
+ * let requests run again
+ */
+void requests_unblock(void)
+{
+    if (!workers)
+	return;
+
+    pthread_mutex_lock(&request_lock);
+    requests_blocked = FALSE;
+    pthread_cond_broadcast(&request_cond);
+    pthread_mutex_unlock(&request_lock);
+}
+
+#else				       /* WANT_WORKERS */
+
+int worker_start(U(int threads))
+{
+    return -1;
+}
+
+int worker_poll(U(int timeout))
+{
+    errno = EINVAL;
+    return -1;
+}
+
+void request_begin(void)
+{
+}
+
+void request_end(void)
+{
+}
+
+void requests_block(void)
+{
+}
+
+void requests_unblock(void)
+{
+}
+
+#endif				       /* WANT_WORKERS */
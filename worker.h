@@ -0,0 +1,65 @@
+/*
+ * UNFS3 worker threads
+ * (C) 2026
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_WORKER_H
+#define UNFS3_WORKER_H
+
+/*
+ * worker threads need pthreads and a TI-RPC library; the old glibc
+ * sunrpc keeps its transport table per thread, so other threads
+ * cannot service its sockets
+ */
+#if HAVE_PTHREAD_H == 1 && HAVE_SVC_GETREQ_POLL == 1 && \
+    HAVE_SVC_TLI_CREATE == 1 && !defined(WIN32)
+#define WANT_WORKERS 1
+#endif
+
+#ifdef WANT_WORKERS
+
+#include <pthread.h>
+
+#define DEFINE_LOCK(name) \
+	static pthread_mutex_t name = PTHREAD_MUTEX_INITIALIZER
+#define LOCK(name) pthread_mutex_lock(&name)
+#define UNLOCK(name) pthread_mutex_unlock(&name)
+
+/* locks embedded in dynamically allocated structures */
+#define LOCK_T pthread_mutex_t
+#define LOCK_INIT(name) pthread_mutex_init(&name, NULL)
+#define LOCK_FREE(name) pthread_mutex_destroy(&name)
+
+#define DEFINE_RWLOCK(name) \
+	static pthread_rwlock_t name = PTHREAD_RWLOCK_INITIALIZER
+#define RDLOCK(name) pthread_rwlock_rdlock(&name)
+#define WRLOCK(name) pthread_rwlock_wrlock(&name)
+#define RWUNLOCK(name) pthread_rwlock_unlock(&name)
+
+#else
+
+#define DEFINE_LOCK(name) extern int worker_no_lock
+#define LOCK(name) do { } while (0)
+#define UNLOCK(name) do { } while (0)
+
+#define LOCK_T int
+#define LOCK_INIT(name) do { } while (0)
+#define LOCK_FREE(name) do { } while (0)
+
+#define DEFINE_RWLOCK(name) extern int worker_no_lock
+#define RDLOCK(name) do { } while (0)
+#define WRLOCK(name) do { } while (0)
+#define RWUNLOCK(name) do { } while (0)
+
+#endif
+
+int worker_start(int threads);
+int worker_poll(int timeout);
+
+void request_begin(void);
+void request_end(void);
+void requests_block(void);
+void requests_unblock(void);
+
+#endif
@@ -17,8 +17,8 @@
 #define HAVE_XDR_UINT64_T 1
 #endif
 
-#include "mount.h"
 #include "nfs.h"
+#include "mount.h"
 #include "xdr.h"
 
 bool_t xdr_fhandle3(XDR * xdrs, fhandle3 * objp)